@@ -0,0 +1,86 @@
+// Lexes a file a number of times and reports the throughput of lexer_next.
+//
+// Usage: ./lexer_bench <file> [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/common.h"
+#include "../src/lexer.h"
+#include "../src/lexer_scan.h"
+#include "../src/piece_table.h"
+
+static double now_secs(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+    return 1;
+  }
+  const char *filepath = argv[1];
+  int iterations = argc >= 3 ? atoi(argv[2]) : 10;
+
+  Piece_Table pt = {0};
+  Errno err = piece_table_load_from_file(&pt, filepath);
+  if (err != 0) {
+    fprintf(stderr, "ERROR: could not read %s\n", filepath);
+    return 1;
+  }
+
+  printf("%s: %zu bytes\n", filepath, piece_table_size(&pt));
+  // Every implementation has to see the same tokens. `make test` checks
+  // that in detail, this only catches a kernel gone wrong on `filepath`.
+  size_t first_tokens = 0;
+  size_t first_keywords = 0;
+  bool first = true;
+  for (Lexer_Scan_Impl impl = 0; impl < COUNT_LEXER_SCANS; ++impl) {
+    if (!lexer_scan_select(impl)) {
+      printf("%-6s: not supported\n", lexer_scan_impl_name(impl));
+      continue;
+    }
+
+    // The best pass is reported, the others are mostly scheduling noise
+    size_t tokens = 0;
+    size_t keywords = 0;
+    double best = 0;
+    for (int i = 0; i < iterations; ++i) {
+      tokens = 0;
+      keywords = 0;
+      double begin = now_secs();
+      Lexer l = lexer_new(&pt);
+      Token t = lexer_next(&l);
+      while (t.kind != TOKEN_END) {
+        tokens += 1;
+        keywords += t.kind == TOKEN_KEYWORD;
+        t = lexer_next(&l);
+      }
+      double secs = now_secs() - begin;
+      if (i == 0 || secs < best)
+        best = secs;
+    }
+
+    printf("%-6s: %zu tokens (%zu keywords), best of %d passes %.3fs: "
+           "%.1f MB/s, %.1f Mtokens/s\n",
+           lexer_scan_impl_name(impl), tokens, keywords, iterations, best,
+           (double)piece_table_size(&pt) / best / 1e6,
+           (double)tokens / best / 1e6);
+
+    if (first) {
+      first_tokens = tokens;
+      first_keywords = keywords;
+      first = false;
+    } else if (tokens != first_tokens || keywords != first_keywords) {
+      fprintf(stderr, "ERROR: %s sees different tokens than %s\n",
+              lexer_scan_impl_name(impl),
+              lexer_scan_impl_name(LEXER_SCAN_SCALAR));
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,425 @@
+// Renders a file without a window and reports how long every frame took.
+//
+// The GL context is a surfaceless EGL one drawing into a framebuffer object,
+// so this runs on Mesa llvmpipe on machines without a GPU or a display. The
+// window is only there for SDL_GetWindowSize and comes from SDL's dummy
+// video driver.
+//
+// A fixed script is replayed over the file: scrolling down, typing, growing
+// a selection and finally the file browser. Every frame is reported as JSON
+// with its CPU time, GPU time (GL_TIME_ELAPSED), the time glFinish() waited
+// for it, draw calls, vertices and glyphs. On llvmpipe most of the drawing
+// happens in that wait and not in the time the query measures.
+//
+// Usage: ./render_bench [options] <file>
+//   -o PATH            where the JSON goes (default render_bench.json)
+//   -frames N          frames per phase of the script (default 120)
+//   -font PATH         font to render with (default the one niji uses)
+//   -max-cpu-ms X      fail if the 95th percentile of CPU time is above X
+//   -max-gpu-ms X      fail if the 95th percentile of GPU time, or of the
+//                      glFinish() wait if longer, is above X
+//   -max-draw-calls N  fail if any frame takes more than N draw calls
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+#define GL_GLEXT_PROTOTYPES
+#include <SDL2/SDL_opengl.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "../src/common.h"
+#include "../src/editor.h"
+#include "../src/file_browser.h"
+#include "../src/free_glyph.h"
+#include "../src/simple_renderer.h"
+
+typedef enum {
+  PHASE_SCROLL = 0,
+  PHASE_TYPE,
+  PHASE_SELECT,
+  PHASE_BROWSE,
+  COUNT_PHASES,
+} Phase;
+
+static const char *phase_names[COUNT_PHASES] = {
+    [PHASE_SCROLL] = "scroll",
+    [PHASE_TYPE] = "type",
+    [PHASE_SELECT] = "select",
+    [PHASE_BROWSE] = "browse",
+};
+
+typedef struct {
+  Phase phase;
+  double cpu_ms;
+  double gpu_ms;
+  double finish_ms;
+  Simple_Renderer_Stats stats;
+} Frame;
+
+typedef struct {
+  Frame *items;
+  size_t count;
+  size_t capacity;
+} Frames;
+
+static Free_Glyph_Atlas atlas = {0};
+static Simple_Renderer sr = {0};
+static Editor editor = {0};
+static File_Browser fb = {0};
+
+static bool egl_init(void) {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (get_platform_display == NULL) {
+    fprintf(stderr, "ERROR: EGL_EXT_platform_base is not available\n");
+    return false;
+  }
+
+  EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                            EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+    fprintf(stderr, "ERROR: Could not open a surfaceless EGL display: 0x%x\n",
+            eglGetError());
+    return false;
+  }
+
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    fprintf(stderr, "ERROR: EGL can not do desktop OpenGL: 0x%x\n",
+            eglGetError());
+    return false;
+  }
+
+  EGLint attribs[] = {
+      EGL_CONTEXT_MAJOR_VERSION,
+      3,
+      EGL_CONTEXT_MINOR_VERSION,
+      3,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK,
+      EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE,
+  };
+  EGLContext context =
+      eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+  if (context == EGL_NO_CONTEXT) {
+    fprintf(stderr, "ERROR: Could not create OpenGL context: 0x%x\n",
+            eglGetError());
+    return false;
+  }
+
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    fprintf(stderr, "ERROR: Could not make OpenGL context current: 0x%x\n",
+            eglGetError());
+    return false;
+  }
+
+  return true;
+}
+
+// There is no default framebuffer without a surface, so everything is drawn
+// into this one
+static bool framebuffer_init(int w, int h) {
+  GLuint fbo;
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+  GLuint color;
+  glGenRenderbuffers(1, &color);
+  glBindRenderbuffer(GL_RENDERBUFFER, color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, color);
+
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: Framebuffer is not complete: 0x%x\n", status);
+    return false;
+  }
+  return true;
+}
+
+// Moves the editor along the script, `frame` frames into `phase`
+static void script_step(Phase phase, int frame) {
+  switch (phase) {
+  case PHASE_SCROLL: {
+    for (int i = 0; i < 4; ++i) {
+      editor_move_line_down(&editor);
+    }
+  } break;
+
+  case PHASE_TYPE: {
+    if (frame % 16 == 15) {
+      editor_insert_char(&editor, '\n');
+    } else {
+      editor_insert_char(&editor, "niji "[frame % 5]);
+    }
+  } break;
+
+  case PHASE_SELECT: {
+    editor_update_selection(&editor, true);
+    editor_move_line_down(&editor);
+  } break;
+
+  case PHASE_BROWSE: {
+    fb.cursor = (size_t)frame % fb.files.count;
+  } break;
+
+  default:
+    UNREACHABLE("unknown Phase");
+  }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// 95th percentile of `values`, which get sorted
+static double percentile95(double *values, size_t count) {
+  if (count == 0)
+    return 0;
+  qsort(values, count, sizeof(*values), compare_doubles);
+  return values[(count * 95) / 100 < count ? (count * 95) / 100 : count - 1];
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-o PATH] [-frames N] [-font PATH] [-max-cpu-ms X] "
+          "[-max-gpu-ms X] [-max-draw-calls N] <file>\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  const char *program = argv[0];
+  const char *filepath = NULL;
+  const char *output_filepath = "render_bench.json";
+  const char *font_filepath = "./fonts/iosevka-ss04-regular.ttc";
+  int frames_per_phase = 120;
+  double max_cpu_ms = 0;
+  double max_gpu_ms = 0;
+  size_t max_draw_calls = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (arg[0] != '-') {
+      filepath = arg;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(program);
+      return 1;
+    }
+    const char *value = argv[++i];
+    if (strcmp(arg, "-o") == 0) {
+      output_filepath = value;
+    } else if (strcmp(arg, "-frames") == 0) {
+      frames_per_phase = atoi(value);
+    } else if (strcmp(arg, "-font") == 0) {
+      font_filepath = value;
+    } else if (strcmp(arg, "-max-cpu-ms") == 0) {
+      max_cpu_ms = atof(value);
+    } else if (strcmp(arg, "-max-gpu-ms") == 0) {
+      max_gpu_ms = atof(value);
+    } else if (strcmp(arg, "-max-draw-calls") == 0) {
+      max_draw_calls = (size_t)atol(value);
+    } else {
+      usage(program);
+      return 1;
+    }
+  }
+  if (filepath == NULL || frames_per_phase <= 0) {
+    usage(program);
+    return 1;
+  }
+
+  FT_Library library = {0};
+  if (FT_Init_FreeType(&library)) {
+    fprintf(stderr, "ERROR: Could not initialize FreeType2 library\n");
+    return 1;
+  }
+  FT_Face face;
+  if (FT_New_Face(library, font_filepath, 0, &face)) {
+    fprintf(stderr, "ERROR: could not load file `%s`\n", font_filepath);
+    return 1;
+  }
+  if (FT_Set_Pixel_Sizes(face, 0, FREE_GLYPH_FONT_SIZE)) {
+    fprintf(stderr, "ERROR: could not set pixel size to `%u`\n",
+            FREE_GLYPH_FONT_SIZE);
+    return 1;
+  }
+
+  Errno err = editor_load_from_file(&editor, filepath);
+  if (err != 0) {
+    fprintf(stderr, "ERROR: Could not read file %s: %s\n", filepath,
+            strerror(err));
+    return 1;
+  }
+  err = fb_open_dir(&fb, ".");
+  if (err != 0) {
+    fprintf(stderr, "ERROR: Could not read directory .: %s\n", strerror(err));
+    return 1;
+  }
+
+  SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    fprintf(stderr, "ERROR: Could not initialize SDL: %s\n", SDL_GetError());
+    return 1;
+  }
+  SDL_Window *window =
+      SDL_CreateWindow("Niji Editor", 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+  if (window == NULL) {
+    fprintf(stderr, "ERROR: Could not create SDL window %s\n", SDL_GetError());
+    return 1;
+  }
+  int w, h;
+  SDL_GetWindowSize(window, &w, &h);
+
+  if (!egl_init()) {
+    return 1;
+  }
+
+  // GLEW built for GLX finds no X display here, but by then it has already
+  // loaded the entry points of the current context
+  GLenum glew = glewInit();
+  if (glew != GLEW_OK
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+      && glew != GLEW_ERROR_NO_GLX_DISPLAY
+#endif
+  ) {
+    fprintf(stderr, "ERROR: Could not initialize GLEW!\n");
+    return 1;
+  }
+
+  if (!framebuffer_init(w, h)) {
+    return 1;
+  }
+  glViewport(0, 0, w, h);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  free_glyph_atlas_init(&atlas, face, font_filepath, NULL);
+  simple_renderer_init(&sr, NULL);
+  editor.atlas = &atlas;
+
+  GLuint query;
+  glGenQueries(1, &query);
+
+  Vec4f bg_color = hex_to_vec4f(0x181818ff);
+  Frames frames = {0};
+  const double ticks_per_ms = (double)SDL_GetPerformanceFrequency() / 1000.0;
+
+  for (Phase phase = 0; phase < COUNT_PHASES; ++phase) {
+    for (int i = 0; i < frames_per_phase; ++i) {
+      Frame frame = {.phase = phase};
+      Uint64 begin = SDL_GetPerformanceCounter();
+      glBeginQuery(GL_TIME_ELAPSED, query);
+
+      editor_begin_edit(&editor);
+      script_step(phase, i);
+      editor_commit_edit(&editor);
+
+      sr.stats = (Simple_Renderer_Stats){0};
+      glClearColor(bg_color.x, bg_color.y, bg_color.z, bg_color.w);
+      glClear(GL_COLOR_BUFFER_BIT);
+      if (phase == PHASE_BROWSE) {
+        fb_render(window, &atlas, &sr, &fb);
+      } else {
+        editor_render(window, &atlas, &sr, &editor);
+      }
+
+      glEndQuery(GL_TIME_ELAPSED);
+      frame.cpu_ms = (double)(SDL_GetPerformanceCounter() - begin) /
+                     ticks_per_ms;
+      frame.stats = sr.stats;
+
+      // Waits for the GPU, so frames do not overlap and the next one starts
+      // from an idle pipeline
+      Uint64 finish = SDL_GetPerformanceCounter();
+      glFinish();
+      frame.finish_ms =
+          (double)(SDL_GetPerformanceCounter() - finish) / ticks_per_ms;
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+      frame.gpu_ms = (double)elapsed / 1e6;
+
+      da_append(&frames, frame);
+    }
+  }
+
+  FILE *out = fopen(output_filepath, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", output_filepath,
+            strerror(errno));
+    return 1;
+  }
+
+  double *cpu = malloc(frames.count * sizeof(*cpu));
+  double *gpu = malloc(frames.count * sizeof(*gpu));
+  assert(cpu != NULL && gpu != NULL && "Buy more RAM lol");
+  size_t most_draw_calls = 0;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"file\": \"%s\",\n", filepath);
+  fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n", w, h);
+  fprintf(out, "  \"frames\": [\n");
+  for (size_t i = 0; i < frames.count; ++i) {
+    const Frame *f = &frames.items[i];
+    fprintf(out,
+            "    {\"phase\": \"%s\", \"cpu_ms\": %.3f, \"gpu_ms\": %.3f, "
+            "\"finish_ms\": %.3f, \"draw_calls\": %zu, \"vertices\": %zu, "
+            "\"glyphs\": %zu}%s\n",
+            phase_names[f->phase], f->cpu_ms, f->gpu_ms, f->finish_ms,
+            f->stats.draw_calls, f->stats.vertices, f->stats.glyphs,
+            i + 1 < frames.count ? "," : "");
+    cpu[i] = f->cpu_ms;
+    // Whichever says more about how long the GPU took
+    gpu[i] = f->gpu_ms > f->finish_ms ? f->gpu_ms : f->finish_ms;
+    if (f->stats.draw_calls > most_draw_calls)
+      most_draw_calls = f->stats.draw_calls;
+  }
+  double cpu_p95 = percentile95(cpu, frames.count);
+  double gpu_p95 = percentile95(gpu, frames.count);
+  fprintf(out, "  ],\n");
+  fprintf(out,
+          "  \"cpu_ms_p95\": %.3f,\n  \"gpu_ms_p95\": %.3f,\n"
+          "  \"max_draw_calls\": %zu\n}\n",
+          cpu_p95, gpu_p95, most_draw_calls);
+  fclose(out);
+
+  printf("%zu frames: CPU %.3f ms, GPU %.3f ms at the 95th percentile, "
+         "at most %zu draw calls. Details in %s\n",
+         frames.count, cpu_p95, gpu_p95, most_draw_calls, output_filepath);
+
+  int result = 0;
+  if (max_cpu_ms > 0 && cpu_p95 > max_cpu_ms) {
+    fprintf(stderr, "FAIL: 95th percentile CPU time %.3f ms is over %.3f ms\n",
+            cpu_p95, max_cpu_ms);
+    result = 1;
+  }
+  if (max_gpu_ms > 0 && gpu_p95 > max_gpu_ms) {
+    fprintf(stderr, "FAIL: 95th percentile GPU time %.3f ms is over %.3f ms\n",
+            gpu_p95, max_gpu_ms);
+    result = 1;
+  }
+  if (max_draw_calls > 0 && most_draw_calls > max_draw_calls) {
+    fprintf(stderr, "FAIL: a frame took %zu draw calls, more than %zu\n",
+            most_draw_calls, max_draw_calls);
+    result = 1;
+  }
+
+  return result;
+}
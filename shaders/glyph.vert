@@ -0,0 +1,47 @@
+#version 330 core
+
+#define PALETTE_CAP 16
+
+layout(std140) uniform Globals {
+    vec2 resolution;
+    vec2 camera_pos;
+    float camera_scale;
+    float time;
+};
+
+// Two texels per glyph: (left, top, width, height) of its bitmap in pixels,
+// then (u, v, width, height) of it in the atlas
+uniform samplerBuffer glyph_rects;
+uniform vec4 palette[PALETTE_CAP];
+// Added to the position of every glyph, for runs kept on the GPU
+uniform vec2 origin;
+
+layout(location=0) in vec2 position;
+layout(location=1) in uint glyph;
+layout(location=2) in uint color;
+layout(location=3) in uint shader;
+
+out vec4 out_color;
+out vec2 out_uv;
+flat out uint out_shader;
+
+vec2 camera_project(vec2 point) {
+    return 2.0 * (point - camera_pos) * camera_scale / resolution;
+}
+
+void main() {
+    vec4 bitmap = texelFetch(glyph_rects, int(glyph) * 2);
+    vec4 uv = texelFetch(glyph_rects, int(glyph) * 2 + 1);
+
+    // 2 - 3
+    // | \ |
+    // 0 - 1
+    vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));
+
+    vec2 p = origin + position + bitmap.xy + corner * vec2(bitmap.z, -bitmap.w);
+    gl_Position = vec4(camera_project(p), 0, 1);
+
+    out_color = palette[color];
+    out_uv = uv.xy + corner * uv.zw;
+    out_shader = shader;
+}
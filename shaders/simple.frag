@@ -0,0 +1,46 @@
+#version 330 core
+
+// Has to match Simple_Shader in src/simple_renderer.h
+#define SHADER_COLOR 0u
+#define SHADER_IMAGE 1u
+#define SHADER_TEXT 2u
+#define SHADER_EPIC 3u
+
+layout(std140) uniform Globals {
+    vec2 resolution;
+    vec2 camera_pos;
+    float camera_scale;
+    float time;
+};
+
+uniform sampler2D image;
+
+in vec4 out_color;
+in vec2 out_uv;
+flat in uint out_shader;
+
+vec3 hsl2rgb(vec3 c) {
+    vec3 rgb = clamp(abs(mod(c.x * 6.0 + vec3(0.0, 4.0, 2.0), 6.0) - 3.0) - 1.0, 0.0, 1.0);
+    return c.z + c.y * (rgb - 0.5) * (1.0 - abs(2.0 * c.z - 1.0));
+}
+
+void main() {
+    // Sampled before branching, derivatives are undefined inside a branch
+    // that not every fragment of the quad takes
+    vec4 tc = texture(image, out_uv);
+    float d = tc.r;
+    float aaf = fwidth(d);
+    float alpha = smoothstep(0.5 - aaf, 0.5 + aaf, d);
+
+    if (out_shader == SHADER_IMAGE) {
+        gl_FragColor = tc;
+    } else if (out_shader == SHADER_TEXT) {
+        gl_FragColor = vec4(out_color.rgb, alpha);
+    } else if (out_shader == SHADER_EPIC) {
+        vec2 frag_uv = gl_FragCoord.xy / resolution;
+        vec4 rainbow = vec4(hsl2rgb(vec3((time + frag_uv.x + frag_uv.y), 0.5, 0.5)), 1.0);
+        gl_FragColor = vec4(rainbow.rgb, alpha);
+    } else {
+        gl_FragColor = out_color;
+    }
+}
@@ -1,16 +1,20 @@
 #version 330 core
 
-uniform vec2 resolution;
-uniform float time;
-uniform float camera_scale;
-uniform vec2 camera_pos;
+layout(std140) uniform Globals {
+    vec2 resolution;
+    vec2 camera_pos;
+    float camera_scale;
+    float time;
+};
 
 layout(location=0) in vec2 position;
 layout(location=1) in vec4 color;
-layout(location=2) in vec2 uv;
+// Normalized 15 bit, with the shader in the top bit of each component
+layout(location=2) in uvec2 uv;
 
 out vec4 out_color;
 out vec2 out_uv;
+flat out uint out_shader;
 
 vec2 camera_project(vec2 point) {
     return 2.0 * (point - camera_pos) * camera_scale / resolution;
@@ -20,5 +24,6 @@ void main() {
     gl_Position = vec4(camera_project(position), 0, 1);
 
     out_color = color;
-    out_uv = uv;
+    out_uv = vec2(uv & 0x7fffu) / 32767.0;
+    out_shader = (uv.x >> 15) | (uv.y >> 15) << 1;
 }
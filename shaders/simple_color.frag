@@ -1,8 +0,0 @@
-#version 330 core
-
-in vec4 out_color;
-in vec2 uv;
-
-void main() {
-    gl_FragColor = out_color;
-}
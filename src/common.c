@@ -7,6 +7,8 @@
 #include "minirent.h"
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -141,6 +143,100 @@ Vec4f hex_to_vec4f(uint32_t color) {
   return result;
 }
 
+// Writes the file next to `filepath` and renames it over it, so that anyone
+// reading `filepath` at the same time sees either the old or the new file
+Errno replace_entire_file(const char *filepath, const char *buf,
+                          size_t buf_size) {
+  String_Builder tmp_filepath = {0};
+  sb_append_cstr(&tmp_filepath, filepath);
+  sb_append_cstr(&tmp_filepath, ".tmp");
+  sb_append_null(&tmp_filepath);
+
+  Errno err = write_entire_file(tmp_filepath.items, buf, buf_size);
+  if (err == 0 && rename(tmp_filepath.items, filepath) < 0)
+    err = errno;
+  if (err != 0)
+    remove(tmp_filepath.items);
+
+  free(tmp_filepath.items);
+  return err;
+}
+
+Errno map_entire_file(const char *filepath, Mapped_File *mf) {
+  Errno result = 0;
+  mf->data = NULL;
+  mf->size = 0;
+  mf->mapped = false;
+
+#ifdef _WIN32
+  FILE *f = fopen(filepath, "rb");
+  if (f == NULL)
+    return errno;
+
+  size_t size;
+  Errno err = file_size(f, &size);
+  if (err != 0)
+    return_defer(err);
+
+  char *data = malloc(size > 0 ? size : 1);
+  assert(data != NULL && "Buy more RAM lol");
+  mf->data = data;
+  mf->size = fread(data, 1, size, f);
+  if (ferror(f))
+    return_defer(errno);
+
+defer:
+  fclose(f);
+  if (result != 0)
+    unmap_entire_file(mf);
+  return result;
+#else
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  struct stat sb = {0};
+  if (fstat(fd, &sb) < 0)
+    return_defer(errno);
+
+  if (sb.st_size > 0) {
+    void *data = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      return_defer(errno);
+    mf->data = data;
+    mf->size = (size_t)sb.st_size;
+    mf->mapped = true;
+  }
+
+defer:
+  close(fd);
+  return result;
+#endif // _WIN32
+}
+
+void unmap_entire_file(Mapped_File *mf) {
+#ifndef _WIN32
+  if (mf->mapped) {
+    munmap((void *)mf->data, mf->size);
+  } else
+#endif // _WIN32
+  {
+    free((void *)mf->data);
+  }
+  mf->data = NULL;
+  mf->size = 0;
+  mf->mapped = false;
+}
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
 Errno type_of_file(const char *filepath, File_Type *ft) {
 #ifdef _WIN32
 #error "TODO: type_of_file() is not implemented for Windows"
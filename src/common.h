@@ -1,6 +1,7 @@
 #ifndef __NIJI_COMMON_H
 #define __NIJI_COMMON_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -21,6 +22,9 @@ typedef int Errno;
 #define DELTA_TIME (1.0f / FPS)
 
 #define CURSOR_OFFSET 0.13f
+// The cursor stays on for this long after a key stroke and then blinks
+#define CURSOR_BLINK_THRESHOLD 500
+#define CURSOR_BLINK_PERIOD 1000
 
 #define ASCII_DISPLAY_LOW 32
 #define ASCII_DISPLAY_HIGH 126
@@ -137,6 +141,24 @@ Errno type_of_file(const char *filepath, File_Type *ft);
 Errno read_entire_file(const char *filepath, String_Builder *sb);
 Errno read_entire_dir(const char *dirpath, Files *files);
 Errno write_entire_file(const char *filepath, const char *buf, size_t buf_size);
+Errno replace_entire_file(const char *filepath, const char *buf,
+                          size_t buf_size);
+
+// A whole file in memory, mapped where the platform has mmap and read into
+// the heap where it does not
+typedef struct {
+  const char *data;
+  size_t size;
+  bool mapped;
+} Mapped_File;
+
+Errno map_entire_file(const char *filepath, Mapped_File *mf);
+void unmap_entire_file(Mapped_File *mf);
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
 
 Vec4f hex_to_vec4f(uint32_t color);
 
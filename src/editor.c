@@ -1,87 +1,1100 @@
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "editor.h"
 
+static void editor_relex(Editor *e, size_t begin, size_t end, size_t old_size,
+                         size_t old_lines_count);
+static void editor_lex_in_background(Editor *e);
+static void editor_text_changed(Editor *e, size_t begin, size_t end,
+                                size_t old_size, size_t old_lines_count);
+
+#define UTF8_CONTINUATION(x) (((uint8_t)(x) & 0xC0) == 0x80)
+
 void editor_insert_char(Editor *e, char x) { editor_insert_buf(e, &x, 1); }
 
+// Extends the search by one character, unless nothing would match it then
+static void editor_search_append(Editor *e, const char *text, size_t len) {
+  sb_append_buf(&e->search, text, len);
+  bool matched = false;
+  size_t size = piece_table_size(&e->data);
+  for (size_t pos = e->cursor; pos < size; ++pos) {
+    if (editor_search_matches_at(e, pos)) {
+      e->cursor = pos;
+      matched = true;
+      break;
+    }
+  }
+  if (!matched)
+    e->search.count -= len;
+}
+
 void editor_insert_buf(Editor *e, char *buf, size_t buf_len) {
   if (e->searching) {
-    sb_append_buf(&e->search, buf, buf_len);
-    bool matched = false;
-    for (size_t pos = e->cursor; pos < e->data.count; ++pos) {
-      if (editor_search_matches_at(e, pos)) {
-        e->cursor = pos;
-        matched = true;
-        break;
+    // A frame's worth of typing comes in at once, but every character is
+    // still tried on its own, as it was typed
+    size_t i = 0;
+    while (i < buf_len) {
+      size_t n = 1;
+      while (i + n < buf_len && n < 4 && UTF8_CONTINUATION(buf[i + n])) {
+        n += 1;
       }
+      editor_search_append(e, buf + i, n);
+      i += n;
     }
-    if (!matched)
-      e->search.count -= buf_len;
   } else {
-    if (e->cursor > e->data.count) {
-      e->cursor = e->data.count;
-    }
-    for (size_t i = 0; i < buf_len; ++i) {
-      da_append(&e->data, '\0');
+    size_t size = piece_table_size(&e->data);
+    size_t lines_count = piece_table_lines_count(&e->data);
+    if (e->cursor > size) {
+      e->cursor = size;
     }
-    memmove(&e->data.items[e->cursor + buf_len], &e->data.items[e->cursor],
-            e->data.count - e->cursor - buf_len);
-    memcpy(&e->data.items[e->cursor], buf, buf_len);
+    piece_table_insert(&e->data, e->cursor, buf, buf_len);
+    editor_text_changed(e, e->cursor, e->cursor + buf_len, size, lines_count);
     e->cursor += buf_len;
-
-    editor_retokenize(e);
   }
 }
-void editor_retokenize(Editor *e) {
-  e->lines.count = 0;
 
-  Line line;
-  line.begin = 0;
+static void editor_drop_checkpoint_tokens(Editor *e, Lex_Checkpoint *cp) {
+  e->tokens_cached -= cp->tokens.count;
+  tokens_free(&cp->tokens);
+  cp->lexed = false;
+  e->checkpoints_generation += 1;
+}
 
-  for (size_t i = 0; i < e->data.count; ++i) {
-    if (e->data.items[i] == '\n') {
-      line.end = i;
-      da_append(&e->lines, line);
-      line.begin = i + 1;
-    }
+void editor_retokenize(Editor *e) {
+  e->tokens.count = 0;
+  e->checkpoints_generation += 1;
+  e->lex_pending = false;
+  e->edit_dirty = false;
+
+  for (size_t i = 0; i < e->checkpoints.count; ++i) {
+    editor_drop_checkpoint_tokens(e, &e->checkpoints.items[i]);
+  }
+  e->checkpoints.count = 0;
+  e->lazy_lexing =
+      piece_table_size(&e->data) >= EDITOR_LAZY_LEXING_THRESHOLD;
+  if (e->lazy_lexing) {
+    Lex_Checkpoint first = {0};
+    first.state = LEXER_STATE_NORMAL;
+    da_append(&e->checkpoints, first);
+    e->checkpoints_valid = 1;
+    e->checkpoints_damage_row = 0;
+    e->line_states.count = 0;
+    return;
   }
 
-  line.end = e->data.count;
-  da_append(&e->lines, line);
+  e->line_states.count = 0;
+  if (piece_table_size(&e->data) >= EDITOR_BACKGROUND_LEXING_THRESHOLD) {
+    editor_lex_in_background(e);
+    return;
+  }
 
-  /////////////////////////////
+  da_append(&e->line_states, LEXER_STATE_NORMAL);
 
-  e->tokens.count = 0;
-  Lexer l = lexer_new(e->atlas, e->data.items, e->data.count);
+  Lexer l = lexer_new(&e->data);
+  l.line_states = &e->line_states;
   Token t = lexer_next(&l);
   while (t.kind != TOKEN_END) {
-    da_append(&e->tokens, t);
+    tokens_append(&e->tokens, t);
     t = lexer_next(&l);
   }
 }
 
+// Index of the last checkpoint at or before `row`
+static size_t editor_checkpoint_of_row(const Editor *e, size_t count,
+                                       size_t row) {
+  size_t lo = 0;
+  size_t hi = count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (e->checkpoints.items[mid].row <= row) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Lexes the rows from checkpoint `i` up to the next one, keeping the tokens
+// if asked to. A region longer than two checkpoint intervals (after a big
+// paste, say) is cut short and a new checkpoint is inserted where lexing
+// stopped, the same way the file is extended past its last known
+// checkpoint. Returns the state the lexer entered the end row in.
+static Lexer_State editor_lex_checkpoint(Editor *e, size_t i,
+                                         bool keep_tokens) {
+  size_t lines_count = piece_table_lines_count(&e->data);
+  size_t row = e->checkpoints.items[i].row;
+  size_t next_row = lines_count;
+  if (i + 1 < e->checkpoints.count) {
+    next_row = e->checkpoints.items[i + 1].row;
+  }
+
+  size_t end_row = next_row;
+  if (i + 1 == e->checkpoints.count ||
+      next_row - row >= 2 * EDITOR_CHECKPOINT_LINES) {
+    end_row = row + EDITOR_CHECKPOINT_LINES;
+    if (end_row > next_row)
+      end_row = next_row;
+  }
+  size_t end = end_row < lines_count
+                   ? piece_table_line_begin(&e->data, end_row)
+                   : piece_table_size(&e->data);
+
+  e->checkpoints_generation += 1;
+  Lex_Checkpoint *cp = &e->checkpoints.items[i];
+  if (keep_tokens) {
+    e->tokens_cached -= cp->tokens.count;
+    cp->tokens.count = 0;
+  }
+
+  e->relex_states.count = 0;
+  Lexer l = lexer_new(&e->data);
+  lexer_seek(&l, row, piece_table_line_begin(&e->data, row), cp->state);
+  l.line_states = &e->relex_states;
+  for (;;) {
+    Token t = lexer_next(&l);
+    if (t.kind == TOKEN_END || t.offset >= end)
+      break;
+    if (keep_tokens)
+      tokens_append(&cp->tokens, t);
+  }
+
+  if (keep_tokens) {
+    cp->lexed = true;
+    e->tokens_cached += cp->tokens.count;
+  }
+
+  Lexer_State state = l.state;
+  if (end_row < lines_count) {
+    state = e->relex_states.items[end_row - row - 1];
+  }
+
+  if (end_row != next_row) {
+    if (!keep_tokens && cp->lexed) {
+      editor_drop_checkpoint_tokens(e, cp);
+    }
+
+    Lex_Checkpoint split = {0};
+    split.row = end_row;
+    split.state = state;
+    da_append(&e->checkpoints, split);
+    memmove(&e->checkpoints.items[i + 2], &e->checkpoints.items[i + 1],
+            (e->checkpoints.count - i - 2) * sizeof(Lex_Checkpoint));
+    e->checkpoints.items[i + 1] = split;
+    e->checkpoints_valid += 1;
+  }
+
+  return state;
+}
+
+// Re-lexes (without keeping the tokens) from the last valid checkpoint until
+// every checkpoint up to `row` is valid again. Once the lexer reaches a
+// checkpoint past the damaged rows in the state recorded there, the rest of
+// them is valid as well.
+static void editor_validate_checkpoints(Editor *e, size_t row) {
+  size_t lines_count = piece_table_lines_count(&e->data);
+  for (;;) {
+    size_t i = e->checkpoints_valid - 1;
+    size_t count = e->checkpoints.count;
+    if (i + 1 < count) {
+      if (e->checkpoints.items[i + 1].row > row)
+        return;
+    } else {
+      size_t end_row = e->checkpoints.items[i].row + EDITOR_CHECKPOINT_LINES;
+      if (end_row > row || end_row >= lines_count)
+        return;
+    }
+
+    Lexer_State state = editor_lex_checkpoint(e, i, false);
+    if (e->checkpoints.count > count)
+      continue;
+
+    Lex_Checkpoint *next = &e->checkpoints.items[i + 1];
+    if (next->row > e->checkpoints_damage_row && next->state == state) {
+      e->checkpoints_valid = e->checkpoints.count;
+      e->checkpoints_damage_row = 0;
+    } else {
+      if (next->state != state) {
+        next->state = state;
+        editor_drop_checkpoint_tokens(e, next);
+      }
+      e->checkpoints_valid += 1;
+    }
+  }
+}
+
+// Evicts the tokens of the least recently shown checkpoints until the cache
+// fits into EDITOR_LAZY_TOKENS_CAP again
+static void editor_evict_tokens(Editor *e) {
+  while (e->tokens_cached > EDITOR_LAZY_TOKENS_CAP) {
+    Lex_Checkpoint *lru = NULL;
+    for (size_t i = 0; i < e->checkpoints.count; ++i) {
+      Lex_Checkpoint *cp = &e->checkpoints.items[i];
+      if (cp->lexed && cp->last_used != e->lex_clock &&
+          (lru == NULL || cp->last_used < lru->last_used)) {
+        lru = cp;
+      }
+    }
+    if (lru == NULL)
+      break;
+    editor_drop_checkpoint_tokens(e, lru);
+  }
+}
+
+// Fills e->tokens with the tokens of the rows [first_row, last_row] when
+// lexing lazily, lexing only the checkpoints that are not cached yet. The
+// tokens are not copied again while the same checkpoints stay in view.
+void editor_lex_visible(Editor *e, size_t first_row, size_t last_row) {
+  if (!e->lazy_lexing)
+    return;
+
+  e->lex_clock += 1;
+  editor_validate_checkpoints(e, last_row);
+
+  size_t first = editor_checkpoint_of_row(e, e->checkpoints_valid, first_row);
+  size_t end = first;
+  while (end < e->checkpoints_valid &&
+         e->checkpoints.items[end].row <= last_row) {
+    end += 1;
+  }
+  if (first == e->lex_visible_first && end == e->lex_visible_end &&
+      e->checkpoints_generation == e->lex_visible_generation) {
+    for (size_t i = first; i < end; ++i) {
+      e->checkpoints.items[i].last_used = e->lex_clock;
+    }
+    return;
+  }
+
+  // Lexing a checkpoint may split it, so `end` is found again on the way
+  e->tokens.count = 0;
+  for (end = first; end < e->checkpoints_valid; ++end) {
+    if (e->checkpoints.items[end].row > last_row)
+      break;
+    if (!e->checkpoints.items[end].lexed) {
+      editor_lex_checkpoint(e, end, true);
+    }
+
+    Lex_Checkpoint *cp = &e->checkpoints.items[end];
+    cp->last_used = e->lex_clock;
+    tokens_append_range(&e->tokens, &cp->tokens, 0, cp->tokens.count);
+  }
+
+  editor_evict_tokens(e);
+  e->lex_visible_first = first;
+  e->lex_visible_end = end;
+  e->lex_visible_generation = e->checkpoints_generation;
+}
+
+// The lazy counterpart of editor_relex: checkpoints inside the damaged rows
+// are dropped, the ones after them are shifted along with their tokens and
+// need validating before they are trusted again.
+static void editor_damage_checkpoints(Editor *e, size_t begin, size_t end,
+                                      size_t old_size,
+                                      size_t old_lines_count) {
+  size_t size = piece_table_size(&e->data);
+  size_t lines_count = piece_table_lines_count(&e->data);
+  size_t first_row = piece_table_row_of(&e->data, begin);
+  size_t last_row = piece_table_row_of(&e->data, end);
+  size_t old_last_row = last_row + old_lines_count - lines_count;
+  size_t k = editor_checkpoint_of_row(e, e->checkpoints.count, first_row);
+  editor_drop_checkpoint_tokens(e, &e->checkpoints.items[k]);
+
+  size_t kept = k + 1;
+  for (size_t i = k + 1; i < e->checkpoints.count; ++i) {
+    Lex_Checkpoint *cp = &e->checkpoints.items[i];
+    if (cp->row <= old_last_row) {
+      editor_drop_checkpoint_tokens(e, cp);
+      continue;
+    }
+
+    cp->row = cp->row + lines_count - old_lines_count;
+    for (size_t j = 0; j < cp->tokens.count; ++j) {
+      cp->tokens.offsets[j] += size - old_size;
+    }
+    e->checkpoints.items[kept++] = *cp;
+  }
+  e->checkpoints.count = kept;
+
+  if (e->checkpoints_valid > k + 1) {
+    e->checkpoints_valid = k + 1;
+  }
+
+  size_t damage_row = e->checkpoints_damage_row;
+  if (damage_row > old_last_row) {
+    damage_row = damage_row + lines_count - old_lines_count;
+  } else if (damage_row > first_row) {
+    damage_row = last_row;
+  }
+  if (damage_row < last_row) {
+    damage_row = last_row;
+  }
+  e->checkpoints_damage_row = damage_row;
+}
+
+// Index of the first token starting at or after `offset`
+static size_t editor_token_lower_bound(const Editor *e, size_t offset) {
+  size_t lo = 0;
+  size_t hi = e->tokens.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (e->tokens.offsets[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Keeps e->tokens in step with an edit without lexing anything, while the
+// real tokens are on their way from the lexer thread: the tokens past the
+// edit are shifted, the ones it cut into are trimmed, and the text inserted
+// in [begin, end) is covered by tokens of the kind it was typed into, one
+// per line.
+static void editor_remap_tokens(Editor *e, size_t begin, size_t end,
+                                size_t old_size) {
+  size_t size = piece_table_size(&e->data);
+  size_t old_end = end + old_size - size;
+
+  // Tokens [first, last) overlap the replaced text [begin, old_end)
+  size_t first = editor_token_lower_bound(e, begin);
+  if (first > 0 &&
+      e->tokens.offsets[first - 1] + e->tokens.lens[first - 1] > begin) {
+    first -= 1;
+  }
+  size_t last = first;
+  while (last < e->tokens.count && e->tokens.offsets[last] < old_end) {
+    last += 1;
+  }
+
+  e->relex_tokens.count = 0;
+
+  Token_Kind kind = TOKEN_INVALID;
+  if (first < last && e->tokens.offsets[first] < begin) {
+    Token t = tokens_get(&e->tokens, first);
+    kind = t.kind;
+    t.text_len = begin - t.offset;
+    tokens_append(&e->relex_tokens, t);
+  }
+
+  size_t run = begin;
+  for (size_t pos = begin; pos < end;) {
+    const char *chunk;
+    size_t n = piece_table_chunk(&e->data, pos, &chunk);
+    if (n > end - pos)
+      n = end - pos;
+    const char *lf = memchr(chunk, '\n', n);
+    if (lf == NULL) {
+      pos += n;
+      continue;
+    }
+
+    pos += lf - chunk;
+    if (pos > run) {
+      tokens_append(&e->relex_tokens,
+                    (Token){.kind = kind, .offset = run, .text_len = pos - run});
+    }
+    pos += 1;
+    run = pos;
+  }
+  if (end > run) {
+    tokens_append(&e->relex_tokens,
+                  (Token){.kind = kind, .offset = run, .text_len = end - run});
+  }
+
+  if (first < last) {
+    Token t = tokens_get(&e->tokens, last - 1);
+    if (t.offset + t.text_len > old_end) {
+      t.text_len = t.offset + t.text_len - old_end;
+      t.offset = end;
+      tokens_append(&e->relex_tokens, t);
+    }
+  }
+
+  size_t tail = e->tokens.count - last;
+  tokens_replace(&e->tokens, first, last, &e->relex_tokens);
+  for (size_t i = e->tokens.count - tail; i < e->tokens.count; ++i) {
+    e->tokens.offsets[i] += size - old_size;
+  }
+}
+
+// Hands a snapshot of the text over to the lexer thread
+static void editor_lex_in_background(Editor *e) {
+  e->lex_pending = true;
+  e->lex_damaged = false;
+  if (!lex_worker_poll(&e->lex_worker)) {
+    // Still busy with an older snapshot, this one goes out once that is back
+    e->lex_outdated = true;
+    return;
+  }
+
+  e->lex_outdated = false;
+  e->lex_snapshot_size = piece_table_size(&e->data);
+  e->lex_snapshot_lines_count = piece_table_lines_count(&e->data);
+  lex_worker_submit(&e->lex_worker, &e->data);
+}
+
+// Takes the tokens from the lexer thread if they are ready. Edits made in
+// the meantime are caught up with by relexing the range they damaged, the
+// same way a single edit is.
+static void editor_collect_tokens(Editor *e) {
+  if (!e->lex_pending || !lex_worker_poll(&e->lex_worker))
+    return;
+
+  if (e->lex_outdated) {
+    editor_lex_in_background(e);
+    return;
+  }
+
+  lex_worker_swap(&e->lex_worker, &e->tokens, &e->line_states);
+  e->lex_pending = false;
+  if (e->lex_damaged) {
+    e->lex_damaged = false;
+    size_t size = piece_table_size(&e->data);
+    editor_relex(e, e->lex_damage_begin, size - e->lex_damage_tail,
+                 e->lex_snapshot_size, e->lex_snapshot_lines_count);
+  }
+}
+
+// Brings the tokens up to date after the text in [begin, end) was changed,
+// when the whole text used to be old_size bytes and old_lines_count lines
+// long. Lexing restarts at the line containing `begin` and stops at the
+// first line past `end` that the lexer enters in the same state as it did
+// in the previous run: from there on the old tokens are still valid and
+// only need to be shifted.
+static void editor_relex(Editor *e, size_t begin, size_t end, size_t old_size,
+                         size_t old_lines_count) {
+  if (e->lazy_lexing) {
+    editor_damage_checkpoints(e, begin, end, old_size, old_lines_count);
+    return;
+  }
+
+  size_t size = piece_table_size(&e->data);
+  if (e->lex_pending) {
+    editor_remap_tokens(e, begin, end, old_size);
+    if (!e->lex_damaged || e->lex_damage_begin > begin) {
+      e->lex_damage_begin = begin;
+    }
+    if (!e->lex_damaged || e->lex_damage_tail > size - end) {
+      e->lex_damage_tail = size - end;
+    }
+    e->lex_damaged = true;
+    return;
+  }
+
+  if (e->line_states.count != old_lines_count) {
+    editor_retokenize(e);
+    return;
+  }
+
+  size_t lines_count = piece_table_lines_count(&e->data);
+  size_t first_row = piece_table_row_of(&e->data, begin);
+  size_t last_row = piece_table_row_of(&e->data, end);
+  size_t first_row_begin = piece_table_line_begin(&e->data, first_row);
+
+  e->relex_tokens.count = 0;
+  e->relex_states.count = 0;
+
+  Lexer l = lexer_new(&e->data);
+  lexer_seek(&l, first_row, first_row_begin,
+             e->line_states.items[first_row]);
+  l.line_states = &e->relex_states;
+
+  size_t row = first_row;
+  size_t reuse_row = old_lines_count;
+  size_t reuse_token = e->tokens.count;
+  for (;;) {
+    Token t = lexer_next(&l);
+
+    bool converged = false;
+    while (!converged && row < l.line) {
+      row += 1;
+      size_t old_row = row + old_lines_count - lines_count;
+      converged = row > last_row &&
+                  e->relex_states.items[row - first_row - 1] ==
+                      e->line_states.items[old_row];
+    }
+
+    if (converged) {
+      size_t row_begin = piece_table_line_begin(&e->data, row);
+      if (t.kind != TOKEN_END && t.offset < row_begin) {
+        tokens_append(&e->relex_tokens, t);
+      }
+      reuse_row = row + old_lines_count - lines_count;
+      reuse_token = editor_token_lower_bound(e, row_begin + old_size - size);
+      e->relex_states.count = row - first_row - 1;
+      break;
+    }
+
+    if (t.kind == TOKEN_END)
+      break;
+
+    if (row - first_row > EDITOR_RELEX_BUDGET_ROWS &&
+        size >= EDITOR_BACKGROUND_LEXING_THRESHOLD) {
+      // Not converging any time soon, let the lexer thread deal with it
+      editor_remap_tokens(e, begin, end, old_size);
+      editor_lex_in_background(e);
+      return;
+    }
+    tokens_append(&e->relex_tokens, t);
+  }
+
+  // Splice the tokens
+  {
+    size_t first_token = editor_token_lower_bound(e, first_row_begin);
+    size_t tail = e->tokens.count - reuse_token;
+    tokens_replace(&e->tokens, first_token, reuse_token, &e->relex_tokens);
+    for (size_t i = e->tokens.count - tail; i < e->tokens.count; ++i) {
+      e->tokens.offsets[i] += size - old_size;
+    }
+  }
+
+  // Splice the line states
+  {
+    size_t kept = first_row + 1;
+    size_t tail = old_lines_count - reuse_row;
+    size_t count = kept + e->relex_states.count + tail;
+    if (count > e->line_states.capacity) {
+      e->line_states.capacity = count;
+      e->line_states.items = realloc(
+          e->line_states.items, count * sizeof(*e->line_states.items));
+      assert(e->line_states.items != NULL && "Buy more RAM lol");
+    }
+
+    memmove(&e->line_states.items[kept + e->relex_states.count],
+            &e->line_states.items[reuse_row], tail * sizeof(Lexer_State));
+    memcpy(&e->line_states.items[kept], e->relex_states.items,
+           e->relex_states.count * sizeof(Lexer_State));
+    e->line_states.count = count;
+  }
+}
+
+void editor_begin_edit(Editor *e) { e->edit_depth += 1; }
+
+void editor_commit_edit(Editor *e) {
+  assert(e->edit_depth > 0);
+  e->edit_depth -= 1;
+  if (e->edit_depth > 0 || !e->edit_dirty)
+    return;
+
+  e->edit_dirty = false;
+  size_t size = piece_table_size(&e->data);
+  editor_relex(e, e->edit_begin, size - e->edit_tail, e->edit_old_size,
+               e->edit_old_lines_count);
+}
+
+// Lines (begin_row, old_end_row] were replaced by lines
+// (begin_row, new_end_row]. The retained blocks that start after them move
+// along, the ones that started in them are gone.
+static void editor_move_render_blocks(Editor *e, size_t begin_row,
+                                      size_t old_end_row,
+                                      size_t new_end_row) {
+  for (size_t i = 0; i < EDITOR_RENDER_BLOCKS_CAP; ++i) {
+    Editor_Render_Block *block = &e->render_blocks[i];
+    if (!block->used || block->line <= begin_row)
+      continue;
+    if (block->line > old_end_row) {
+      block->line = block->line - old_end_row + new_end_row;
+    } else {
+      block->used = false;
+    }
+  }
+}
+
+static void editor_drop_render_blocks(Editor *e) {
+  for (size_t i = 0; i < EDITOR_RENDER_BLOCKS_CAP; ++i) {
+    e->render_blocks[i].used = false;
+  }
+}
+
+// Drops the advances of line `row` and the ones after it, they may have
+// changed or moved
+static void editor_forget_line_xs(Editor *e, size_t row) {
+  for (size_t i = 0; i < EDITOR_LINE_XS_CAP; ++i) {
+    if (e->line_xs[i].row >= row) {
+      e->line_xs[i].used = false;
+    }
+  }
+}
+
+// Whether the bytes [begin, end) are all laid out by multiplication, see
+// free_glyph_atlas_uniform_prefix
+static bool editor_uniform(Editor *e, size_t begin, size_t end) {
+  if (e->atlas->advance == 0)
+    return false;
+
+  for (size_t pos = begin; pos < end;) {
+    const char *chunk;
+    size_t n = piece_table_chunk(&e->data, pos, &chunk);
+    if (n > end - pos)
+      n = end - pos;
+    if (free_glyph_atlas_uniform_prefix(e->atlas, chunk, n) < n)
+      return false;
+    pos += n;
+  }
+  return true;
+}
+
+// The advances of line `row`, measured again only if they were dropped
+static const Editor_Line_Xs *editor_line_xs(Editor *e, size_t row) {
+  Editor_Line_Xs *xs = &e->line_xs[row % EDITOR_LINE_XS_CAP];
+  if (xs->used && xs->row == row)
+    return xs;
+
+  Line line = editor_line(e, row);
+  size_t size = line.end - line.begin;
+  xs->used = true;
+  xs->row = row;
+  xs->stops.count = 0;
+  if (editor_uniform(e, line.begin, line.end)) {
+    xs->advance = e->atlas->advance;
+    xs->width = (double)size * xs->advance;
+  } else {
+    xs->advance = 0;
+    free_glyph_atlas_stops(
+        e->atlas, piece_table_span(&e->data, line.begin, size, &e->scratch),
+        size, EDITOR_LINE_XS_STRIDE, &xs->stops);
+    xs->width = da_last(&xs->stops).x;
+  }
+  return xs;
+}
+
+// Patches the advances of line `row` after its bytes [begin, end) took the
+// place of `old_size` - `size` more (or fewer) bytes, where `begin` and
+// `end` are columns of the line. Only the characters from the stop before
+// the change to the first stop after it are measured again, the stops past
+// it are moved along.
+static void editor_patch_line_xs(Editor *e, size_t row, size_t begin,
+                                 size_t end, size_t old_size, size_t size) {
+  Editor_Line_Xs *xs = &e->line_xs[row % EDITOR_LINE_XS_CAP];
+  if (!xs->used || xs->row != row)
+    return;
+
+  Line line = editor_line(e, row);
+  size_t line_size = line.end - line.begin;
+  if (xs->advance > 0) {
+    if (editor_uniform(e, line.begin + begin, line.begin + end)) {
+      xs->width = (double)line_size * xs->advance;
+      return;
+    }
+
+    // Not uniform anymore, the stops it would have had before the change
+    size_t old_line_size = line_size + old_size - size;
+    xs->stops.count = 0;
+    for (size_t offset = 0; offset < old_line_size;
+         offset += EDITOR_LINE_XS_STRIDE) {
+      da_append(&xs->stops,
+                ((Glyph_Stop){offset, (double)offset * xs->advance}));
+    }
+    da_append(&xs->stops, ((Glyph_Stop){old_line_size, xs->width}));
+    xs->advance = 0;
+  }
+
+  // The last stop before `begin`, or the first one
+  size_t old_end = end + old_size - size;
+  size_t lo = 0;
+  while (lo + 1 < xs->stops.count && xs->stops.items[lo + 1].offset < begin) {
+    lo += 1;
+  }
+  // The first stop at or after the end of the change that is still after
+  // `lo` once moved
+  size_t hi = lo + 1;
+  while (hi < xs->stops.count &&
+         (xs->stops.items[hi].offset < old_end ||
+          xs->stops.items[hi].offset + size - old_size <=
+              xs->stops.items[lo].offset)) {
+    hi += 1;
+  }
+  if (hi >= xs->stops.count) {
+    xs->used = false;
+    return;
+  }
+
+  Glyph_Stop from = xs->stops.items[lo];
+  size_t n = xs->stops.items[hi].offset + size - old_size - from.offset;
+  Glyph_Stops *fresh = &e->scratch_stops;
+  fresh->count = 0;
+  free_glyph_atlas_stops(
+      e->atlas, piece_table_span(&e->data, line.begin + from.offset, n,
+                                 &e->scratch),
+      n, EDITOR_LINE_XS_STRIDE, fresh);
+  double dx = from.x + da_last(fresh).x - xs->stops.items[hi].x;
+
+  // The stops strictly between `lo` and `hi` make way for the fresh ones
+  // strictly between the first and the last
+  size_t between = fresh->count - 2;
+  size_t tail = xs->stops.count - hi;
+  size_t count = lo + 1 + between + tail;
+  while (xs->stops.count < count) {
+    da_append(&xs->stops, ((Glyph_Stop){0}));
+  }
+  memmove(xs->stops.items + lo + 1 + between, xs->stops.items + hi,
+          tail * sizeof(*xs->stops.items));
+  for (size_t i = 0; i < between; ++i) {
+    Glyph_Stop stop = fresh->items[i + 1];
+    xs->stops.items[lo + 1 + i] =
+        (Glyph_Stop){from.offset + stop.offset, from.x + stop.x};
+  }
+  xs->stops.count = count;
+  for (size_t i = lo + 1 + between; i < count; ++i) {
+    xs->stops.items[i].offset += size;
+    xs->stops.items[i].offset -= old_size;
+    xs->stops.items[i].x += dx;
+  }
+  xs->width += dx;
+}
+
+// How far from the beginning of line `row` its byte `col` is drawn. A
+// double like the stops, it is made a float only where it is drawn.
+static double editor_col_x(Editor *e, size_t row, size_t col) {
+  const Editor_Line_Xs *xs = editor_line_xs(e, row);
+  Line line = editor_line(e, row);
+  size_t size = line.end - line.begin;
+  if (col > size)
+    col = size;
+  if (xs->advance > 0)
+    return (double)col * xs->advance;
+
+  // The last stop at or before `col`
+  size_t lo = 0;
+  size_t hi = xs->stops.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (xs->stops.items[mid].offset <= col) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  Glyph_Stop stop = xs->stops.items[lo - 1];
+  if (stop.offset == col)
+    return stop.x;
+
+  // Through the end of the character `col` is in
+  size_t end = col + 4 < size ? col + 4 : size;
+  const char *text = piece_table_span(&e->data, line.begin + stop.offset,
+                                      end - stop.offset, &e->scratch);
+  return stop.x + free_glyph_atlas_cursor_pos(e->atlas, text,
+                                              end - stop.offset, vec2f(0, 0),
+                                              col - stop.offset);
+}
+
+// The column of line `row` under `x`, see free_glyph_atlas_col_at
+static size_t editor_col_at(Editor *e, size_t row, double x) {
+  const Editor_Line_Xs *xs = editor_line_xs(e, row);
+  Line line = editor_line(e, row);
+  size_t size = line.end - line.begin;
+  if (xs->advance > 0) {
+    double col = x / xs->advance;
+    if (col <= 0)
+      return 0;
+    return col < (double)size ? (size_t)col : size;
+  }
+
+  // The character is between the last stop at or before `x` and the next
+  size_t lo = 0;
+  size_t hi = xs->stops.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (xs->stops.items[mid].x <= x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0)
+    return 0;
+  if (lo == xs->stops.count)
+    return size;
+
+  Glyph_Stop stop = xs->stops.items[lo - 1];
+  size_t n = xs->stops.items[lo].offset - stop.offset;
+  const char *text =
+      piece_table_span(&e->data, line.begin + stop.offset, n, &e->scratch);
+  return stop.offset +
+         free_glyph_atlas_col_at(e->atlas, text, n, 0, (float)(x - stop.x));
+}
+
+// Where the visual row that starts at `begin`, on a line that ends at `end`,
+// ends
+static size_t editor_wrap_row(Editor *e, size_t begin, size_t end) {
+  for (size_t window = EDITOR_WRAP_WINDOW;; window *= 2) {
+    size_t n = end - begin < window ? end - begin : window;
+    const char *text = piece_table_span(&e->data, begin, n, &e->scratch);
+    size_t row = free_glyph_atlas_wrap(e->atlas, text, n, e->wrap_width);
+    if (row < n || n == end - begin)
+      return begin + row;
+  }
+}
+
+// How many of the `count` sorted `breaks` are at or before `col`
+static size_t editor_breaks_upper_bound(const size_t *breaks, size_t count,
+                                        size_t col) {
+  size_t lo = 0;
+  size_t hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (breaks[mid] <= col) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Wraps line `row` for the current width, going on from where it was
+// wrapped part of the way if it was. Stops once its rows up to `rows` are
+// known and `bytes` bytes of it were looked at, the rest of a very long line
+// is left for later (see editor_wrap_stale). Returns the bytes looked at.
+static size_t editor_wrap_line(Editor *e, size_t row, size_t rows,
+                               size_t bytes) {
+  Line line = editor_line(e, row);
+  Wrap_Line wl = wrap_index_line(&e->wrap_index, row);
+  e->wrap_breaks.count = 0;
+  size_t begin = line.begin;
+  if (wl.wrapped && wl.partial) {
+    size_t breaks_count = wl.rows - 1;
+    da_append_many(&e->wrap_breaks, wl.breaks, breaks_count);
+    begin += da_last(&e->wrap_breaks);
+  }
+
+  bool partial = false;
+  size_t pos = editor_wrap_row(e, begin, line.end);
+  for (; pos < line.end; pos = editor_wrap_row(e, pos, line.end)) {
+    da_append(&e->wrap_breaks, pos - line.begin);
+    if (e->wrap_breaks.count > rows && pos - begin >= bytes) {
+      partial = true;
+      break;
+    }
+  }
+  wrap_index_wrap(&e->wrap_index, row, 1, e->wrap_breaks.items,
+                  e->wrap_breaks.count, partial);
+  return pos - begin;
+}
+
+// The wrapping of line `row`, wrapping it first as far as the visual row
+// its byte `col` is on if it is not wrapped for the current width that far
+static Wrap_Line editor_wrapped_line(Editor *e, size_t row, size_t col) {
+  Wrap_Line wl = wrap_index_line(&e->wrap_index, row);
+  if (wl.wrapped && !wl.partial)
+    return wl;
+
+  size_t begin = wl.wrapped ? wl.breaks[wl.rows - 2] : 0;
+  if (!wl.wrapped || col >= begin) {
+    editor_wrap_line(e, row, 0, col < SIZE_MAX ? col - begin + 1 : col);
+    wl = wrap_index_line(&e->wrap_index, row);
+  }
+  return wl;
+}
+
+// The wrapped line on visual row `vrow`, wrapping the lines that may be
+// there first
+static Wrap_Line editor_wrapped_line_at_row(Editor *e, size_t vrow) {
+  Wrap_Line wl = wrap_index_line_at_row(&e->wrap_index, vrow);
+  while (!wl.wrapped || (wl.partial && vrow + 1 >= wl.row + wl.rows)) {
+    editor_wrap_line(e, wl.line, vrow - wl.row, 0);
+    wl = wrap_index_line_at_row(&e->wrap_index, vrow);
+  }
+  return wl;
+}
+
+// Wraps line `row` again after its bytes [begin, old_end) were replaced
+// with [begin, end). A row wraps depending on the text a little past its
+// end, so the rows from two before the edit on are wrapped anew, until one
+// of them ends where it used to and the rest of the old breaks apply again.
+// A line wrapped part of the way is wrapped anew only as far as it was.
+static void editor_rewrap_line(Editor *e, size_t row, size_t begin,
+                               size_t end, size_t old_end) {
+  Wrap_Line wl = wrap_index_line(&e->wrap_index, row);
+  if (!wl.wrapped) {
+    editor_wrap_line(e, row, 0, 0);
+    return;
+  }
+
+  Line line = editor_line(e, row);
+  size_t breaks_count = wl.rows - 1;
+  size_t k = editor_breaks_upper_bound(wl.breaks, breaks_count,
+                                       begin - line.begin);
+  k = k > 2 ? k - 2 : 0;
+  e->wrap_breaks.count = 0;
+  da_append_many(&e->wrap_breaks, wl.breaks, k);
+
+  size_t pos = line.begin + (k > 0 ? wl.breaks[k - 1] : 0);
+  size_t old = k;
+  bool partial = wl.partial;
+  size_t wrapped = partial ? wl.breaks[breaks_count - 1] : 0;
+  for (;;) {
+    pos = editor_wrap_row(e, pos, line.end);
+    if (pos >= line.end) {
+      partial = false;
+      break;
+    }
+
+    size_t col = pos - line.begin;
+    if (pos >= end) {
+      size_t old_col = col + old_end - end;
+      while (old < breaks_count && wl.breaks[old] < old_col) {
+        old += 1;
+      }
+      if (old < breaks_count && wl.breaks[old] == old_col) {
+        for (; old < breaks_count; ++old) {
+          da_append(&e->wrap_breaks, wl.breaks[old] + end - old_end);
+        }
+        break;
+      }
+    }
+    da_append(&e->wrap_breaks, col);
+
+    // As far as the old text was wrapped
+    if (wl.partial && (pos < begin || pos >= end) &&
+        (pos < begin ? col : col + old_end - end) >= wrapped)
+      break;
+  }
+  wrap_index_wrap(&e->wrap_index, row, 1, e->wrap_breaks.items,
+                  e->wrap_breaks.count, partial);
+}
+
+// Keeps the wrap index in step with an edit, with the same arguments as
+// editor_relex. An edit within a line wraps that line again right away, the
+// lines an edit added are wrapped once they are needed.
+static void editor_rewrap(Editor *e, size_t begin, size_t end,
+                          size_t old_size, size_t old_lines_count) {
+  size_t size = piece_table_size(&e->data);
+  size_t lines_count = piece_table_lines_count(&e->data);
+  size_t first_row = piece_table_row_of(&e->data, begin);
+  size_t last_row = piece_table_row_of(&e->data, end);
+  size_t old_last_row = last_row + old_lines_count - lines_count;
+  if (first_row == last_row && last_row == old_last_row) {
+    editor_rewrap_line(e, first_row, begin, end, end + old_size - size);
+  } else {
+    wrap_index_replace(&e->wrap_index, first_row,
+                       old_last_row - first_row + 1, last_row - first_row + 1);
+  }
+}
+
+// Wraps the lines not wrapped for the current width yet in order, until
+// `budget` bytes of them were looked at
+static void editor_wrap_stale(Editor *e, size_t budget) {
+  size_t lines_count = editor_lines_count(e);
+  while (budget > 0) {
+    size_t row = wrap_index_first_stale(&e->wrap_index);
+    if (row >= lines_count)
+      return;
+
+    // The lines that need no breaks are marked wrapped in one go
+    Wrap_Line wl = wrap_index_line(&e->wrap_index, row);
+    size_t unbroken = 0;
+    bool broken = wl.wrapped && wl.partial;
+    while (!broken && unbroken < wl.run && budget > 0) {
+      Line line = editor_line(e, row + unbroken);
+      if (editor_wrap_row(e, line.begin, line.end) < line.end) {
+        broken = true;
+        break;
+      }
+      size_t size = line.end - line.begin + 1;
+      budget -= size < budget ? size : budget;
+      unbroken += 1;
+    }
+
+    if (unbroken > 0)
+      wrap_index_wrap(&e->wrap_index, row, unbroken, NULL, 0, false);
+    if (broken && budget > 0) {
+      size_t size = editor_wrap_line(e, row + unbroken, 0, budget);
+      budget -= size < budget ? size : budget;
+    }
+  }
+}
+
+// Called after every change of the text, with the same arguments as
+// editor_relex. Inside a transaction the change is only recorded.
+static void editor_text_changed(Editor *e, size_t begin, size_t end,
+                                size_t old_size, size_t old_lines_count) {
+  size_t begin_row = piece_table_row_of(&e->data, begin);
+  size_t end_row = piece_table_row_of(&e->data, end);
+  editor_move_render_blocks(e, begin_row,
+                            end_row + old_lines_count -
+                                piece_table_lines_count(&e->data),
+                            end_row);
+  if (begin_row == end_row &&
+      old_lines_count == piece_table_lines_count(&e->data)) {
+    size_t line_begin = editor_line(e, begin_row).begin;
+    editor_patch_line_xs(e, begin_row, begin - line_begin, end - line_begin,
+                         old_size, piece_table_size(&e->data));
+  } else {
+    editor_forget_line_xs(e, begin_row);
+  }
+  if (e->wrap)
+    editor_rewrap(e, begin, end, old_size, old_lines_count);
+
+  if (e->edit_depth == 0) {
+    editor_relex(e, begin, end, old_size, old_lines_count);
+    return;
+  }
+
+  size_t size = piece_table_size(&e->data);
+  if (!e->edit_dirty) {
+    e->edit_dirty = true;
+    e->edit_old_size = old_size;
+    e->edit_old_lines_count = old_lines_count;
+    e->edit_begin = begin;
+    e->edit_tail = size - end;
+    return;
+  }
+
+  if (e->edit_begin > begin)
+    e->edit_begin = begin;
+  if (e->edit_tail > size - end)
+    e->edit_tail = size - end;
+}
+
+// Where the character before `pos` starts, a UTF-8 sequence is stepped over
+// as a whole
+static size_t editor_char_before(const Editor *e, size_t pos) {
+  size_t begin = pos - 1;
+  while (begin > 0 && pos - begin < 4 &&
+         UTF8_CONTINUATION(piece_table_at(&e->data, begin))) {
+    begin -= 1;
+  }
+  return begin;
+}
+
+// Where the character at `pos` ends
+static size_t editor_char_after(const Editor *e, size_t pos, size_t size) {
+  size_t end = pos + 1;
+  while (end < size && end - pos < 4 &&
+         UTF8_CONTINUATION(piece_table_at(&e->data, end))) {
+    end += 1;
+  }
+  return end;
+}
+
 void editor_backspace(Editor *e) {
   if (e->searching) {
+    while (e->search.count > 0 &&
+           UTF8_CONTINUATION(e->search.items[e->search.count - 1])) {
+      e->search.count -= 1;
+    }
     if (e->search.count > 0) {
       e->search.count -= 1;
     }
   } else {
-    if (e->cursor > e->data.count)
-      e->cursor = e->data.count;
+    size_t size = piece_table_size(&e->data);
+    if (e->cursor > size)
+      e->cursor = size;
     if (e->cursor == 0)
       return;
 
-    memmove(&e->data.items[e->cursor - 1], &e->data.items[e->cursor],
-            e->data.count - e->cursor);
-
-    e->data.count -= 1;
-    e->cursor -= 1;
-
-    editor_retokenize(e);
+    size_t lines_count = piece_table_lines_count(&e->data);
+    size_t begin = editor_char_before(e, e->cursor);
+    piece_table_delete(&e->data, begin, e->cursor - begin);
+    e->cursor = begin;
+    editor_text_changed(e, e->cursor, e->cursor, size, lines_count);
   }
 }
 
@@ -89,20 +1102,19 @@ void editor_delete(Editor *e) {
   if (e->searching)
     return;
 
-  if (e->cursor >= e->data.count)
+  size_t size = piece_table_size(&e->data);
+  if (e->cursor >= size)
     return;
 
-  memmove(&e->data.items[e->cursor], &e->data.items[e->cursor + 1],
-          e->data.count - e->cursor - 1);
-
-  e->data.count -= 1;
-
-  editor_retokenize(e);
+  size_t lines_count = piece_table_lines_count(&e->data);
+  size_t end = editor_char_after(e, e->cursor, size);
+  piece_table_delete(&e->data, e->cursor, end - e->cursor);
+  editor_text_changed(e, e->cursor, e->cursor, size, lines_count);
 }
 
 Errno editor_save_as(Editor *e, const char *filepath) {
   printf("Saving as `%s` ...\n", filepath);
-  Errno err = write_entire_file(filepath, e->data.items, e->data.count);
+  Errno err = piece_table_save_to_file(&e->data, filepath);
   if (err != 0)
     return err;
   e->filepath.count = 0;
@@ -115,18 +1127,20 @@ Errno editor_save_as(Editor *e, const char *filepath) {
 Errno editor_save(const Editor *e) {
   assert(e->filepath.count > 0);
   printf("Saving as `%s` ...\n", e->filepath.items);
-  return write_entire_file(e->filepath.items, e->data.items, e->data.count);
+  return piece_table_save_to_file(&e->data, e->filepath.items);
 }
 
 Errno editor_load_from_file(Editor *e, const char *filepath) {
   printf("Loading `%s` ...\n", filepath);
-  e->data.count = 0;
-
-  Errno err = read_entire_file(filepath, &e->data);
+  Errno err = piece_table_load_from_file(&e->data, filepath);
   if (err != 0)
     return err;
 
   e->cursor = 0;
+  editor_drop_render_blocks(e);
+  editor_forget_line_xs(e, 0);
+  if (e->wrap)
+    wrap_index_reset(&e->wrap_index, editor_lines_count(e));
 
   editor_retokenize(e);
 
@@ -137,26 +1151,144 @@ Errno editor_load_from_file(Editor *e, const char *filepath) {
   return 0;
 }
 
+size_t editor_lines_count(const Editor *e) {
+  return piece_table_lines_count(&e->data);
+}
+
+Line editor_line(const Editor *e, size_t row) {
+  Line line;
+  line.begin = piece_table_line_begin(&e->data, row);
+  line.end = piece_table_line_end(&e->data, row);
+  return line;
+}
+
+static size_t editor_line_size(const Editor *e, size_t row) {
+  Line line = editor_line(e, row);
+  return line.end - line.begin;
+}
+
 size_t editor_cursor_row(const Editor *e) {
-  assert(e->lines.count > 0);
+  return piece_table_row_of(&e->data, e->cursor);
+}
 
-  for (size_t row = 0; row < e->lines.count; ++row) {
-    Line line = e->lines.items[row];
-    if (line.begin <= e->cursor && e->cursor <= line.end) {
-      return row;
-    }
+// A visual row: the bytes [begin, end) of line `row`, the first of them
+// drawn `x` from the beginning of the line. Without soft wrap every line is
+// a visual row of its own.
+typedef struct {
+  size_t row;
+  Line line;
+  size_t begin;
+  size_t end;
+  double x;
+} Editor_Visual_Row;
+
+static size_t editor_visual_rows_count(const Editor *e) {
+  if (!e->wrap)
+    return editor_lines_count(e);
+  return wrap_index_rows_count(&e->wrap_index);
+}
+
+static Editor_Visual_Row editor_visual_row(Editor *e, size_t vrow) {
+  Editor_Visual_Row vr = {0};
+  if (!e->wrap) {
+    vr.row = vrow;
+    vr.line = editor_line(e, vrow);
+    vr.begin = vr.line.begin;
+    vr.end = vr.line.end;
+    return vr;
+  }
+
+  Wrap_Line wl = editor_wrapped_line_at_row(e, vrow);
+  size_t k = vrow > wl.row ? vrow - wl.row : 0;
+  if (k >= wl.rows)
+    k = wl.rows - 1;
+
+  vr.row = wl.line;
+  vr.line = editor_line(e, wl.line);
+  vr.begin = vr.line.begin + (k > 0 ? wl.breaks[k - 1] : 0);
+  vr.end = k + 1 < wl.rows ? vr.line.begin + wl.breaks[k] : vr.line.end;
+  if (k > 0)
+    vr.x = editor_col_x(e, vr.row, vr.begin - vr.line.begin);
+  return vr;
+}
+
+// The visual row `pos` is on. Where a line wraps, the position between the
+// two rows is the beginning of the second one.
+static size_t editor_visual_row_of(Editor *e, size_t pos) {
+  size_t row = piece_table_row_of(&e->data, pos);
+  if (!e->wrap)
+    return row;
+
+  size_t col = pos - piece_table_line_begin(&e->data, row);
+  Wrap_Line wl = editor_wrapped_line(e, row, col);
+  return wl.row + editor_breaks_upper_bound(wl.breaks, wl.rows - 1, col);
+}
+
+// The position on `vr` closest to `x` from where the row is drawn. The end
+// of a row that wraps is the beginning of the next one, so the position
+// before its last character is as far as it goes.
+static size_t editor_visual_row_pos_at(Editor *e, const Editor_Visual_Row *vr,
+                                       double x) {
+  size_t begin = vr->begin - vr->line.begin;
+  size_t end = vr->end - vr->line.begin;
+  if (vr->end < vr->line.end)
+    end = editor_char_before(e, vr->end) - vr->line.begin;
+
+  x += vr->x;
+  size_t col = editor_col_at(e, vr->row, x);
+  if (col < begin)
+    col = begin;
+  if (col > end)
+    col = end;
+
+  // Before or after the character under `x`, whichever is closer
+  if (col < end) {
+    size_t next = editor_char_after(e, vr->line.begin + col, vr->line.end) -
+                  vr->line.begin;
+    if (x - editor_col_x(e, vr->row, col) > editor_col_x(e, vr->row, next) - x)
+      col = next;
+  }
+  return vr->line.begin + col;
+}
+
+// Moves the cursor a visual row up or down, to about where it is drawn on
+// the current one
+static void editor_move_visual_row(Editor *e, bool down) {
+  size_t row = editor_cursor_row(e);
+  size_t vrow = editor_visual_row_of(e, e->cursor);
+  Wrap_Line wl = wrap_index_line(&e->wrap_index, row);
+  Editor_Visual_Row vr = editor_visual_row(e, vrow);
+  double x = editor_col_x(e, row, e->cursor - vr.line.begin) - vr.x;
+
+  if (down) {
+    if (vrow + 1 == wl.row + wl.rows && row + 1 == editor_lines_count(e))
+      return;
+    vrow += 1;
+  } else if (vrow > wl.row) {
+    vrow -= 1;
+  } else {
+    if (row == 0)
+      return;
+    // Wrapping the line above does not move where it begins
+    Wrap_Line above = editor_wrapped_line(e, row - 1, SIZE_MAX);
+    vrow = above.row + above.rows - 1;
   }
 
-  return e->lines.count - 1;
+  vr = editor_visual_row(e, vrow);
+  e->cursor = editor_visual_row_pos_at(e, &vr, x);
 }
 
 void editor_move_line_up(Editor *e) {
   editor_stop_search(e);
+  if (e->wrap) {
+    editor_move_visual_row(e, false);
+    return;
+  }
 
   size_t cursor_row = editor_cursor_row(e);
-  size_t cursor_col = e->cursor - e->lines.items[cursor_row].begin;
+  size_t cursor_col = e->cursor - editor_line(e, cursor_row).begin;
   if (cursor_row > 0) {
-    Line prev_line = e->lines.items[cursor_row - 1];
+    Line prev_line = editor_line(e, cursor_row - 1);
     size_t prev_line_size = prev_line.end - prev_line.begin;
     if (cursor_col > prev_line_size)
       cursor_col = prev_line_size;
@@ -167,11 +1299,15 @@ void editor_move_line_up(Editor *e) {
 
 void editor_move_line_down(Editor *e) {
   editor_stop_search(e);
+  if (e->wrap) {
+    editor_move_visual_row(e, true);
+    return;
+  }
 
   size_t cursor_row = editor_cursor_row(e);
-  size_t cursor_col = e->cursor - e->lines.items[cursor_row].begin;
-  if (cursor_row < e->lines.count - 1) {
-    Line next_line = e->lines.items[cursor_row + 1];
+  size_t cursor_col = e->cursor - editor_line(e, cursor_row).begin;
+  if (cursor_row < editor_lines_count(e) - 1) {
+    Line next_line = editor_line(e, cursor_row + 1);
     size_t next_line_size = next_line.end - next_line.begin;
     if (cursor_col > next_line_size)
       cursor_col = next_line_size;
@@ -184,23 +1320,24 @@ void editor_move_char_left(Editor *e) {
   editor_stop_search(e);
 
   if (e->cursor > 0)
-    e->cursor -= 1;
+    e->cursor = editor_char_before(e, e->cursor);
 }
 
 void editor_move_char_right(Editor *e) {
   editor_stop_search(e);
 
-  if (e->cursor < e->data.count)
-    e->cursor += 1;
+  size_t size = piece_table_size(&e->data);
+  if (e->cursor < size)
+    e->cursor = editor_char_after(e, e->cursor, size);
 }
 
 void editor_move_word_left(Editor *e) {
   editor_stop_search(e);
 
-  while (e->cursor > 0 && !isalnum(e->data.items[e->cursor - 1])) {
+  while (e->cursor > 0 && !isalnum(piece_table_at(&e->data, e->cursor - 1))) {
     e->cursor -= 1;
   }
-  while (e->cursor > 0 && isalnum(e->data.items[e->cursor - 1])) {
+  while (e->cursor > 0 && isalnum(piece_table_at(&e->data, e->cursor - 1))) {
     e->cursor -= 1;
   }
 }
@@ -208,10 +1345,11 @@ void editor_move_word_left(Editor *e) {
 void editor_move_word_right(Editor *e) {
   editor_stop_search(e);
 
-  while (e->cursor < e->data.count && !isalnum(e->data.items[e->cursor])) {
+  size_t size = piece_table_size(&e->data);
+  while (e->cursor < size && !isalnum(piece_table_at(&e->data, e->cursor))) {
     e->cursor += 1;
   }
-  while (e->cursor < e->data.count && isalnum(e->data.items[e->cursor])) {
+  while (e->cursor < size && isalnum(piece_table_at(&e->data, e->cursor))) {
     e->cursor += 1;
   }
 }
@@ -223,49 +1361,64 @@ void editor_move_to_begin(Editor *e) {
 
 void editor_move_to_end(Editor *e) {
   editor_stop_search(e);
-  e->cursor = e->data.count;
+  e->cursor = piece_table_size(&e->data);
 }
 
 void editor_move_to_line_begin(Editor *e) {
   editor_stop_search(e);
   size_t row = editor_cursor_row(e);
-  e->cursor = e->lines.items[row].begin;
+  e->cursor = editor_line(e, row).begin;
 }
 
 void editor_move_to_line_end(Editor *e) {
   editor_stop_search(e);
   size_t row = editor_cursor_row(e);
-  e->cursor = e->lines.items[row].end;
+  e->cursor = editor_line(e, row).end;
 }
 
 void editor_move_paragraph_up(Editor *e) {
   editor_stop_search(e);
   size_t row = editor_cursor_row(e);
-  while (row > 0 && e->lines.items[row].end - e->lines.items[row].begin <= 1) {
+  while (row > 0 && editor_line_size(e, row) <= 1) {
     row -= 1;
   }
-  while (row > 0 && e->lines.items[row].end - e->lines.items[row].begin > 1) {
+  while (row > 0 && editor_line_size(e, row) > 1) {
     row -= 1;
   }
-  e->cursor = e->lines.items[row].begin;
+  e->cursor = editor_line(e, row).begin;
 }
 
 void editor_move_paragraph_down(Editor *e) {
   editor_stop_search(e);
   size_t row = editor_cursor_row(e);
-  while (row + 1 < e->lines.count && e->lines.items[row].end - e->lines.items[row].begin <= 1) {
+  size_t lines_count = editor_lines_count(e);
+  while (row + 1 < lines_count && editor_line_size(e, row) <= 1) {
     row += 1;
   }
-  while (row + 1 < e->lines.count && e->lines.items[row].end - e->lines.items[row].begin > 1) {
+  while (row + 1 < lines_count && editor_line_size(e, row) > 1) {
     row += 1;
   }
-  e->cursor = e->lines.items[row].begin;
+  e->cursor = editor_line(e, row).begin;
+}
+
+void editor_move_to_point(Editor *e, Vec2f point) {
+  editor_stop_search(e);
+
+  // The rows are laid out the way editor_render puts the cursor on them
+  float y = -point.y / FREE_GLYPH_FONT_SIZE - CURSOR_OFFSET + 1;
+  size_t vrow = y > 0 ? (size_t)y : 0;
+  if (vrow >= editor_visual_rows_count(e)) {
+    vrow = editor_visual_rows_count(e) - 1;
+  }
+
+  Editor_Visual_Row vr = editor_visual_row(e, vrow);
+  e->cursor = editor_visual_row_pos_at(e, &vr, point.x);
 }
 
 bool editor_line_starts_with(Editor *e, size_t row, size_t col,
                              const char *prefix) {
   size_t prefix_len = strlen(prefix);
-  Line line = e->lines.items[row];
+  Line line = editor_line(e, row);
   if (prefix_len == 0) {
     return true;
   }
@@ -275,7 +1428,7 @@ bool editor_line_starts_with(Editor *e, size_t row, size_t col,
   }
 
   for (size_t i = 0; i < prefix_len; ++i) {
-    if (prefix[i] != e->data.items[line.begin + col + i]) {
+    if (prefix[i] != piece_table_at(&e->data, line.begin + col + i)) {
       return false;
     }
   }
@@ -294,6 +1447,308 @@ const char *editor_line_starts_with_one_of(Editor *e, size_t row, size_t col,
   return NULL;
 }
 
+static Vec4f editor_token_color(Token_Kind kind) {
+  switch (kind) {
+  case TOKEN_PREPROP:
+    return hex_to_vec4f(0x95a99fff);
+
+  case TOKEN_KEYWORD:
+    return hex_to_vec4f(0xffdd33ff);
+
+  case TOKEN_SINGLE_COMMENT:
+  case TOKEN_BLOCK_COMMENT:
+    return hex_to_vec4f(0xcc8c3cff);
+
+  case TOKEN_STRING:
+    return hex_to_vec4f(0x73c936ff);
+
+  default:
+    return vec4fs(1);
+  }
+}
+
+// The part of a row that is laid out: the bytes [begin, end), the first of
+// them drawn `x` from the beginning of the row, and the first token that
+// ends past `begin`
+typedef struct {
+  size_t begin;
+  size_t end;
+  float x;
+  size_t first_token;
+} Editor_Row_Span;
+
+// Lays out the bytes [begin, end) between two tokens. Those are whitespace
+// and only moved past, unless the lexer thread is still busy: then the
+// tokens may not cover the text yet (none do while a big file is lexed
+// for the first time), and the bytes are drawn in the default color.
+static void editor_layout_gap(Editor *e, Free_Glyph_Atlas *atlas,
+                              Simple_Renderer *sr, size_t begin, size_t end,
+                              Vec2f *pos) {
+  const char *text =
+      piece_table_span(&e->data, begin, end - begin, &e->scratch);
+  if (e->lex_pending) {
+    free_glyph_atlas_render_line_sized(atlas, sr, text, end - begin, pos,
+                                       editor_token_color(TOKEN_SYMBOL));
+  } else {
+    free_glyph_atlas_measure_line_sized(atlas, text, end - begin, pos);
+  }
+}
+
+static void editor_layout_block(Editor *e, Free_Glyph_Atlas *atlas,
+                                Simple_Renderer *sr,
+                                Editor_Render_Block *block, size_t first_row,
+                                size_t end_row, const Editor_Row_Span *spans) {
+  simple_renderer_begin_run(sr, &block->run);
+  for (size_t row = first_row; row < end_row; ++row) {
+    const Editor_Row_Span *span = &spans[row - first_row];
+    Vec2f pos =
+        vec2f(span->x, -(float)(row - first_row) * FREE_GLYPH_FONT_SIZE);
+    size_t laid_out = span->begin;
+
+    for (size_t i = span->first_token;
+         i < e->tokens.count && e->tokens.offsets[i] < span->end; ++i) {
+      Token token = tokens_get(&e->tokens, i);
+      size_t begin = token.offset > laid_out ? token.offset : laid_out;
+      size_t end = token.offset + token.text_len;
+      if (end > span->end)
+        end = span->end;
+
+      editor_layout_gap(e, atlas, sr, laid_out, begin, &pos);
+      laid_out = end;
+
+      const char *text =
+          piece_table_span(&e->data, begin, end - begin, &e->scratch);
+      free_glyph_atlas_render_line_sized(atlas, sr, text, end - begin, &pos,
+                                         editor_token_color(token.kind));
+    }
+    if (e->lex_pending && laid_out < span->end)
+      editor_layout_gap(e, atlas, sr, laid_out, span->end, &pos);
+  }
+  simple_renderer_end_run(sr);
+}
+
+// Where the visible columns of rows [first_row, end_row) are, and a hash of
+// the text and tokens there that does not depend on where the rows are
+static uint64_t editor_row_spans(Editor *e, size_t first_row, size_t end_row,
+                                 float left, float right,
+                                 Editor_Row_Span *spans) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t row = first_row; row < end_row; ++row) {
+    Editor_Row_Span *span = &spans[row - first_row];
+    Editor_Visual_Row vr = editor_visual_row(e, row);
+    span->begin = vr.line.begin + editor_col_at(e, vr.row, vr.x + left);
+    span->end = vr.line.begin + editor_col_at(e, vr.row, vr.x + right);
+    if (span->begin < vr.begin)
+      span->begin = vr.begin;
+    if (span->end > vr.end)
+      span->end = vr.end;
+    if (span->end < span->begin)
+      span->end = span->begin;
+    span->x =
+        (float)(editor_col_x(e, vr.row, span->begin - vr.line.begin) - vr.x);
+
+    size_t i = editor_token_lower_bound(e, span->begin);
+    if (i > 0 && e->tokens.offsets[i - 1] + e->tokens.lens[i - 1] >
+                     (uint32_t)span->begin) {
+      i -= 1;
+    }
+    span->first_token = i;
+
+    uint64_t size = span->end - span->begin;
+    hash = fnv1a(hash, &size, sizeof(size));
+    hash = fnv1a(hash, &span->x, sizeof(span->x));
+    for (size_t pos = span->begin; pos < span->end;) {
+      const char *chunk;
+      size_t n = piece_table_chunk(&e->data, pos, &chunk);
+      if (n > span->end - pos)
+        n = span->end - pos;
+      hash = fnv1a(hash, chunk, n);
+      pos += n;
+    }
+    for (; i < e->tokens.count && e->tokens.offsets[i] < span->end; ++i) {
+      uint32_t token[3] = {
+          e->tokens.offsets[i] - (uint32_t)span->begin,
+          e->tokens.lens[i],
+          e->tokens.kinds[i],
+      };
+      hash = fnv1a(hash, token, sizeof(token));
+    }
+  }
+  return hash;
+}
+
+// The visual row `block` starts at
+static size_t editor_render_block_row(const Editor *e,
+                                      const Editor_Render_Block *block) {
+  if (!e->wrap)
+    return block->line;
+  return wrap_index_line(&e->wrap_index, block->line).row + block->line_row;
+}
+
+// The retained block visual row `row` is drawn from, and the row it starts
+// at. It is laid out again only if the text or tokens of its rows have
+// changed since the last time, or the atlas has evicted glyphs since.
+//
+// Without edits the blocks are EDITOR_RENDER_BLOCK_ROWS rows each, aligned
+// to multiples of that. A block whose rows were edited is laid out again
+// up to the next block, as long as that is no more than
+// EDITOR_RENDER_BLOCK_MAX_ROWS away, which takes in the rows the edit
+// inserted. Blocks never overlap.
+static const Editor_Render_Block *
+editor_render_block(Editor *e, Free_Glyph_Atlas *atlas, Simple_Renderer *sr,
+                    size_t row, float left, float right, size_t *first_row) {
+  size_t rows_count = editor_visual_rows_count(e);
+
+  // The block starting closest above `row`, and where the next one starts
+  Editor_Render_Block *block = NULL;
+  size_t block_row = 0;
+  size_t limit = rows_count;
+  for (size_t i = 0; i < EDITOR_RENDER_BLOCKS_CAP; ++i) {
+    Editor_Render_Block *it = &e->render_blocks[i];
+    if (!it->used)
+      continue;
+    size_t it_row = editor_render_block_row(e, it);
+    if (it_row > row) {
+      if (it_row < limit)
+        limit = it_row;
+    } else if (block == NULL || it_row > block_row) {
+      block = it;
+      block_row = it_row;
+    } else if (it_row == block_row) {
+      // Edits above can bring two blocks to the same row
+      it->used = false;
+    }
+  }
+
+  size_t aligned = row / EDITOR_RENDER_BLOCK_ROWS * EDITOR_RENDER_BLOCK_ROWS;
+  size_t end_row;
+  if (block != NULL && block_row + block->rows > row) {
+    end_row = block_row + block->rows;
+    if (end_row > limit)
+      end_row = limit;
+  } else {
+    // A new block in the gap between the ones above and below
+    size_t begin_row = aligned;
+    if (block != NULL && block_row + block->rows > begin_row)
+      begin_row = block_row + block->rows;
+    block_row = begin_row;
+    block = NULL;
+    end_row = aligned + EDITOR_RENDER_BLOCK_ROWS;
+    if (end_row > limit)
+      end_row = limit;
+  }
+  *first_row = block_row;
+
+  Editor_Row_Span spans[EDITOR_RENDER_BLOCK_MAX_ROWS];
+  uint64_t hash =
+      editor_row_spans(e, block_row, end_row, left, right, spans);
+
+  e->render_clock += 1;
+  if (block == NULL) {
+    block = &e->render_blocks[0];
+    for (size_t i = 1; i < EDITOR_RENDER_BLOCKS_CAP && block->used; ++i) {
+      Editor_Render_Block *it = &e->render_blocks[i];
+      if (!it->used || it->last_used < block->last_used)
+        block = it;
+    }
+    block->used = true;
+    if (e->wrap) {
+      Wrap_Line wl = wrap_index_line_at_row(&e->wrap_index, block_row);
+      block->line = wl.line;
+      block->line_row = block_row - wl.row;
+    } else {
+      block->line = block_row;
+      block->line_row = 0;
+    }
+  } else if (block->rows == end_row - block_row && block->hash == hash &&
+             block->generation == atlas->generation) {
+    block->last_used = e->render_clock;
+    return block;
+  } else {
+    size_t grown = limit - block_row <= EDITOR_RENDER_BLOCK_MAX_ROWS
+                       ? limit
+                       : aligned + EDITOR_RENDER_BLOCK_ROWS;
+    if (grown > block_row + EDITOR_RENDER_BLOCK_MAX_ROWS)
+      grown = block_row + EDITOR_RENDER_BLOCK_MAX_ROWS;
+    if (grown > limit)
+      grown = limit;
+    if (grown != end_row) {
+      end_row = grown;
+      hash = editor_row_spans(e, block_row, end_row, left, right, spans);
+    }
+  }
+  block->rows = end_row - block_row;
+  block->hash = hash;
+  block->last_used = e->render_clock;
+
+  block->generation = atlas->generation;
+  editor_layout_block(e, atlas, sr, block, block_row, end_row, spans);
+  if (block->generation != atlas->generation) {
+    // The glyphs evicted midway may have included ones laid out before
+    block->generation = atlas->generation;
+    editor_layout_block(e, atlas, sr, block, block_row, end_row, spans);
+  }
+
+  return block;
+}
+
+// The visual rows the camera can see, give or take
+// EDITOR_VISIBLE_MARGIN_ROWS. Only these are laid out and drawn, so the cost
+// of a frame depends on the window and not on the size of the document.
+static void editor_visible_rows(const Editor *e, const Simple_Renderer *sr,
+                                int h, size_t *first, size_t *last) {
+  float half_height = (float)h / 2 / sr->camera_scale;
+  float top = (-sr->camera_pos.y - half_height) / FREE_GLYPH_FONT_SIZE -
+              EDITOR_VISIBLE_MARGIN_ROWS;
+  float bottom = (-sr->camera_pos.y + half_height) / FREE_GLYPH_FONT_SIZE +
+                 EDITOR_VISIBLE_MARGIN_ROWS;
+  *first = top > 0 ? (size_t)top : 0;
+  *last = bottom > 0 ? (size_t)bottom : 0;
+  if (*last >= editor_visual_rows_count(e)) {
+    *last = editor_visual_rows_count(e) - 1;
+  }
+}
+
+// Wraps the lines in the blocks the camera is about to show for the width
+// of the window, then some more off screen. Lines above the cursor that
+// take up more or fewer rows than they used to move it, so the camera moves
+// along and the text on screen stays put.
+static void editor_wrap_visible(Editor *e, Simple_Renderer *sr, int w,
+                                int h) {
+  float width = (float)w / EDITOR_WRAP_SCALE - 2 * EDITOR_WRAP_MARGIN;
+  if (e->wrap_width != width) {
+    e->wrap_width = width;
+    wrap_index_invalidate(&e->wrap_index);
+  }
+
+  size_t cursor_row = editor_cursor_row(e);
+  size_t anchor = wrap_index_line(&e->wrap_index, cursor_row).row;
+
+  size_t first, last;
+  editor_visible_rows(e, sr, h, &first, &last);
+  first = first > EDITOR_RENDER_BLOCK_MAX_ROWS
+              ? first - EDITOR_RENDER_BLOCK_MAX_ROWS
+              : 0;
+  last += EDITOR_RENDER_BLOCK_MAX_ROWS;
+  for (size_t vrow = first;
+       vrow <= last && vrow < wrap_index_rows_count(&e->wrap_index);) {
+    Wrap_Line wl = editor_wrapped_line_at_row(e, vrow);
+    if (wl.partial && wl.row + wl.rows <= last + 1) {
+      editor_wrap_line(e, wl.line, last - wl.row, 0);
+      wl = wrap_index_line(&e->wrap_index, wl.line);
+    }
+    vrow = wl.row + wl.rows;
+  }
+  editor_wrap_stale(e, EDITOR_WRAP_BUDGET);
+
+  size_t moved = wrap_index_line(&e->wrap_index, cursor_row).row;
+  if (moved > anchor) {
+    sr->camera_pos.y -= (float)(moved - anchor) * FREE_GLYPH_FONT_SIZE;
+  } else {
+    sr->camera_pos.y += (float)(anchor - moved) * FREE_GLYPH_FONT_SIZE;
+  }
+}
+
 void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
                    Simple_Renderer *sr, Editor *e) {
   int w, h;
@@ -304,64 +1759,73 @@ void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
   sr->resolution = vec2f(w, h);
   sr->time = (float)SDL_GetTicks() / 1000.0f;
 
+  if (e->wrap) {
+    editor_wrap_visible(e, sr, w, h);
+  }
+
+  size_t first_visible_row = 0;
+  size_t last_visible_row = 0;
+  editor_visible_rows(e, sr, h, &first_visible_row, &last_visible_row);
+
   // Render selection
 
   simple_renderer_set_shader(sr, SHADER_COLOR);
 
   if (e->selection) {
     Vec4f sel_color = vec4f(.25, .25, .25, 1);
-    for (size_t row = 0; row < e->lines.count; ++row) {
-      size_t sb_c = e->sel_begin;
-      size_t se_c = e->cursor;
+    size_t sel_first = e->sel_begin;
+    size_t sel_last = e->cursor;
+    if (sel_first > sel_last) {
+      SWAP(size_t, sel_first, sel_last);
+    }
 
-      if (sb_c > se_c) {
-        SWAP(size_t, sb_c, se_c);
-      }
+    size_t first_row = editor_visual_row_of(e, sel_first);
+    size_t last_row = editor_visual_row_of(e, sel_last);
+    if (first_row < first_visible_row)
+      first_row = first_visible_row;
+    if (last_row > last_visible_row)
+      last_row = last_visible_row;
+    for (size_t row = first_row; row <= last_row; ++row) {
+      size_t sb_c = sel_first;
+      size_t se_c = sel_last;
 
-      Line line_c = e->lines.items[row];
+      Editor_Visual_Row vr = editor_visual_row(e, row);
 
-      if (sb_c < line_c.begin) {
-        sb_c = line_c.begin;
+      if (sb_c < vr.begin) {
+        sb_c = vr.begin;
       }
 
-      if (se_c > line_c.end) {
-        se_c = line_c.end;
+      if (se_c > vr.end) {
+        se_c = vr.end;
       }
 
       if (sb_c <= se_c) {
-        Vec2f sb_s =
-            vec2f(0, -((float)row + CURSOR_OFFSET) * FREE_GLYPH_FONT_SIZE);
-        free_glyph_atlas_measure_line_sized(atlas, e->data.items + line_c.begin,
-                                            sb_c - line_c.begin, &sb_s);
-        Vec2f se_s = sb_s;
-        free_glyph_atlas_measure_line_sized(atlas, e->data.items + sb_c,
-                                            se_c - sb_c, &se_s);
+        float y = -((float)row + CURSOR_OFFSET) * FREE_GLYPH_FONT_SIZE;
+        double sb_x = editor_col_x(e, vr.row, sb_c - vr.line.begin) - vr.x;
+        double se_x = editor_col_x(e, vr.row, se_c - vr.line.begin) - vr.x;
 
         simple_renderer_solid_rect(
-            sr, sb_s, vec2f(se_s.x - sb_s.x, FREE_GLYPH_FONT_SIZE), sel_color);
+            sr, vec2f((float)sb_x, y),
+            vec2f((float)(se_x - sb_x), FREE_GLYPH_FONT_SIZE), sel_color);
       }
     }
   }
-  simple_renderer_flush(sr);
 
   Vec2f cursor_pos = vec2fs(0);
+  size_t cursor_row = editor_visual_row_of(e, e->cursor);
   {
-    size_t cursor_row = editor_cursor_row(e);
-    Line line = e->lines.items[cursor_row];
-
-    size_t cursor_col = e->cursor - line.begin;
+    Editor_Visual_Row vr = editor_visual_row(e, cursor_row);
+    size_t cursor_col = e->cursor - vr.line.begin;
 
     cursor_pos.y = -((float)cursor_row + CURSOR_OFFSET) * FREE_GLYPH_FONT_SIZE;
-    cursor_pos.x = free_glyph_atlas_cursor_pos(
-        atlas, e->data.items + line.begin, line.end - line.begin,
-        vec2f(0, cursor_pos.y), cursor_col);
+    cursor_pos.x = (float)(editor_col_x(e, vr.row, cursor_col) - vr.x);
   }
 
   // Render search
 
   {
-    if (e->searching) {
-      simple_renderer_set_shader(sr, SHADER_COLOR);
+    if (e->searching && first_visible_row <= cursor_row &&
+        cursor_row <= last_visible_row) {
       Vec4f selection_color = vec4f(.1, .1, .25, 1);
       Vec2f p1 = cursor_pos;
       Vec2f p2 = p1;
@@ -370,52 +1834,64 @@ void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
 
       simple_renderer_solid_rect(
           sr, p1, vec2f(p2.x - p1.x, FREE_GLYPH_FONT_SIZE), selection_color);
-      simple_renderer_flush(sr);
     }
   }
 
   // Render text
 
-  simple_renderer_set_shader(sr, SHADER_TEXT);
-  for (size_t i = 0; i < e->tokens.count; ++i) {
-    Token token = e->tokens.items[i];
-    Vec2f pos = token.position;
-    Vec4f color = vec4fs(1);
-    switch (token.kind) {
-    case TOKEN_PREPROP:
-      color = hex_to_vec4f(0x95a99fff);
-      break;
-
-    case TOKEN_KEYWORD:
-      color = hex_to_vec4f(0xffdd33ff);
-      break;
-
-    case TOKEN_SINGLE_COMMENT:
-      color = hex_to_vec4f(0xcc8c3cff);
-      break;
+  if (e->lazy_lexing) {
+    // Whole blocks are laid out, so whole blocks need tokens
+    size_t last_row = last_visible_row + EDITOR_RENDER_BLOCK_MAX_ROWS;
+    if (last_row >= editor_visual_rows_count(e)) {
+      last_row = editor_visual_rows_count(e) - 1;
+    }
+    size_t first_row = first_visible_row > EDITOR_RENDER_BLOCK_MAX_ROWS
+                           ? first_visible_row - EDITOR_RENDER_BLOCK_MAX_ROWS
+                           : 0;
+    editor_lex_visible(e, editor_visual_row(e, first_row).row,
+                       editor_visual_row(e, last_row).row);
+  } else {
+    editor_collect_tokens(e);
+  }
 
-    case TOKEN_STRING:
-      color = hex_to_vec4f(0x73c936ff);
-      break;
+  // Each block drawn also draws the selection and search quads batched so
+  // far, underneath it
+  simple_renderer_set_shader(sr, SHADER_TEXT);
+  if (first_visible_row <= last_visible_row) {
+    // Only the columns the camera can see, snapped outward to whole spans
+    // so that panning within a span keeps the laid out blocks
+    float half_width = (float)w / 2 / sr->camera_scale;
+    float left = floorf((sr->camera_pos.x - half_width - FREE_GLYPH_FONT_SIZE) /
+                        EDITOR_RENDER_SPAN_WIDTH) *
+                 EDITOR_RENDER_SPAN_WIDTH;
+    float right =
+        ceilf((sr->camera_pos.x + half_width + FREE_GLYPH_FONT_SIZE) /
+              EDITOR_RENDER_SPAN_WIDTH) *
+        EDITOR_RENDER_SPAN_WIDTH;
+
+    for (size_t row = first_visible_row; row <= last_visible_row;) {
+      size_t block_row;
+      const Editor_Render_Block *block =
+          editor_render_block(e, atlas, sr, row, left, right, &block_row);
+      simple_renderer_draw_run(
+          sr, &block->run,
+          vec2f(0, -(float)block_row * FREE_GLYPH_FONT_SIZE));
+      row = block_row + block->rows;
+    }
 
-    default: {
-      color = vec4fs(1);
-    } break;
+    for (size_t row = first_visible_row;
+         !e->wrap && row <= last_visible_row; ++row) {
+      float width = (float)editor_line_xs(e, row)->width;
+      if (max_line_len < width)
+        max_line_len = width;
     }
-    free_glyph_atlas_render_line_sized(atlas, sr, token.text, token.text_len,
-                                       &pos, color);
-    if (max_line_len < pos.x)
-      max_line_len = pos.x;
   }
-  simple_renderer_flush(sr);
 
   // Render cursor
 
   simple_renderer_set_shader(sr, SHADER_COLOR);
   {
     float CURSOR_WIDTH = 5.0f;
-    Uint32 CURSOR_BLINK_THRESHOLD = 500;
-    Uint32 CURSOR_BLINK_PERIOD = 1000;
     Uint32 t = SDL_GetTicks() - e->last_stroke;
 
     if (t < CURSOR_BLINK_THRESHOLD || t / CURSOR_BLINK_PERIOD % 2 != 0) {
@@ -429,24 +1905,39 @@ void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
   }
 
   {
-    if (max_line_len > 1000) {
-      max_line_len = 1000;
-    }
-    if (max_line_len <= 0) {
-      max_line_len = 1;
-    }
-
-    float target_scale = (float)w / 3 / (max_line_len * 0.75);
+    float target_scale;
     Vec2f target = cursor_pos;
-    float offset = 0.0f;
 
-    if (target_scale > 2) {
-      target_scale = 2;
-    } else {
-      offset = cursor_pos.x - (float)w / 3 / sr->camera_scale;
+    if (e->wrap) {
+      // The rows fit into the window, unless they end in spaces past its
+      // edge
+      target_scale = EDITOR_WRAP_SCALE;
+      float offset = cursor_pos.x - e->wrap_width;
       if (offset < 0.0f)
         offset = 0.0f;
-      target = vec2f((float)w / 3 / sr->camera_scale + offset, cursor_pos.y);
+      target = vec2f((float)w / 2 / EDITOR_WRAP_SCALE - EDITOR_WRAP_MARGIN +
+                         offset,
+                     cursor_pos.y);
+    } else {
+      if (max_line_len > 1000) {
+        max_line_len = 1000;
+      }
+      if (max_line_len <= 0) {
+        max_line_len = 1;
+      }
+
+      target_scale = (float)w / 3 / (max_line_len * 0.75);
+      float offset = 0.0f;
+
+      if (target_scale > 2) {
+        target_scale = 2;
+      } else {
+        offset = cursor_pos.x - (float)w / 3 / sr->camera_scale;
+        if (offset < 0.0f)
+          offset = 0.0f;
+        target =
+            vec2f((float)w / 3 / sr->camera_scale + offset, cursor_pos.y);
+      }
     }
 
     sr->camera_vel = vec2f_mul(vec2f_sub(target, sr->camera_pos), vec2fs(2));
@@ -459,6 +1950,26 @@ void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
   }
 }
 
+Uint32 editor_cursor_blink_timeout(const Editor *e) {
+  Uint32 t = SDL_GetTicks() - e->last_stroke;
+  if (t < CURSOR_BLINK_THRESHOLD)
+    return CURSOR_BLINK_THRESHOLD - t;
+  return CURSOR_BLINK_PERIOD - t % CURSOR_BLINK_PERIOD;
+}
+
+void editor_toggle_wrap(Editor *e) {
+  e->wrap = !e->wrap;
+  editor_drop_render_blocks(e);
+  if (e->wrap) {
+    wrap_index_reset(&e->wrap_index, editor_lines_count(e));
+  }
+}
+
+bool editor_wrap_pending(const Editor *e) {
+  return e->wrap &&
+         wrap_index_first_stale(&e->wrap_index) < editor_lines_count(e);
+}
+
 void editor_update_selection(Editor *e, bool shift) {
   if (e->searching)
     return;
@@ -487,7 +1998,7 @@ void editor_clipboard_copy(Editor *e) {
       SWAP(size_t, begin, end);
 
     e->clipboard.count = 0;
-    sb_append_buf(&e->clipboard, &e->data.items[begin], end - begin + 1);
+    piece_table_read(&e->data, begin, end - begin + 1, &e->clipboard);
     sb_append_null(&e->clipboard);
 
     if (SDL_SetClipboardText(e->clipboard.items) < 0) {
@@ -509,7 +2020,8 @@ void editor_clipboard_paste(Editor *e) {
 
 void editor_start_search(Editor *e) {
   if (e->searching) {
-    for (size_t pos = e->cursor + 1; pos < e->data.count; ++pos) {
+    size_t size = piece_table_size(&e->data);
+    for (size_t pos = e->cursor + 1; pos < size; ++pos) {
       if (editor_search_matches_at(e, pos)) {
         e->cursor = pos;
         break;
@@ -528,10 +2040,10 @@ void editor_start_search(Editor *e) {
 void editor_stop_search(Editor *e) { e->searching = false; }
 
 bool editor_search_matches_at(Editor *e, size_t pos) {
-  if (e->data.count - pos < e->search.count)
+  if (piece_table_size(&e->data) - pos < e->search.count)
     return false;
   for (size_t i = 0; i < e->search.count; ++i) {
-    if (e->search.items[i] != e->data.items[pos + i]) {
+    if (e->search.items[i] != piece_table_at(&e->data, pos + i)) {
       return false;
     }
   }
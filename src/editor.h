@@ -8,32 +8,124 @@
 
 #include "common.h"
 #include "free_glyph.h"
+#include "lex_worker.h"
 #include "lexer.h"
+#include "piece_table.h"
 #include "simple_renderer.h"
+#include "wrap_index.h"
 
 typedef struct {
   size_t begin;
   size_t end;
 } Line;
 
+// Files at least this big are lexed lazily: only the rows around the
+// camera are tokenized (see editor_lex_visible).
+#define EDITOR_LAZY_LEXING_THRESHOLD (4 * 1024 * 1024)
+// Rows between two lexer checkpoints
+#define EDITOR_CHECKPOINT_LINES 256
+// How many tokens lazy lexing keeps around before evicting the least
+// recently shown ones
+#define EDITOR_LAZY_TOKENS_CAP (1024 * 1024)
+
+// Rows past the edges of the window that editor_render still draws
+#define EDITOR_VISIBLE_MARGIN_ROWS 2
+
+// The text is laid out and kept on the GPU in blocks of this many rows
+// (see Editor_Render_Block)
+#define EDITOR_RENDER_BLOCK_ROWS 32
+// ... or up to this many, when an edit inserted rows into a block
+#define EDITOR_RENDER_BLOCK_MAX_ROWS (2 * EDITOR_RENDER_BLOCK_ROWS)
+#define EDITOR_RENDER_BLOCKS_CAP 16
+// Only the glyphs within the columns the camera can see are laid out, the
+// edges of those rounded out to multiples of this width, so panning only
+// lays blocks out again once in a while
+#define EDITOR_RENDER_SPAN_WIDTH 2048
+
+// Lines whose glyph advances are kept around (see Editor_Line_Xs), line
+// `row` in slot row % EDITOR_LINE_XS_CAP
+#define EDITOR_LINE_XS_CAP 256
+// Bytes between two of their stops
+#define EDITOR_LINE_XS_STRIDE 256
+
+// With soft wrap on, the text is shown at this zoom and wrapped at the width
+// of the window less EDITOR_WRAP_MARGIN on either side
+#define EDITOR_WRAP_SCALE 0.75f
+#define EDITOR_WRAP_MARGIN FREE_GLYPH_FONT_SIZE
+// How many bytes of lines off screen are wrapped per frame, until every
+// line is wrapped for the current width
+#define EDITOR_WRAP_BUDGET (1024 * 1024)
+// Bytes looked at to find where a visual row ends, doubled as long as the
+// whole of them fits on the row
+#define EDITOR_WRAP_WINDOW 1024
+
+// Smaller files are lexed on the lexer thread (see lex_worker.h) whenever
+// they need lexing from scratch
+#define EDITOR_BACKGROUND_LEXING_THRESHOLD (256 * 1024)
+// ... and so are edits of them that keep the lexer busy for more rows than
+// this without converging, e.g. opening a block comment
+#define EDITOR_RELEX_BUDGET_ROWS 2048
+
+// The lexer state at the beginning of `row`, together with the tokens of
+// the rows up to the next checkpoint once they were lexed.
 typedef struct {
-  Line *items;
-  size_t count;
-  size_t capacity;
-} Lines;
+  size_t row;
+  Lexer_State state;
+
+  bool lexed;
+  Tokens tokens;
+  size_t last_used;
+} Lex_Checkpoint;
 
 typedef struct {
-  Token *items;
+  Lex_Checkpoint *items;
   size_t count;
   size_t capacity;
-} Tokens;
+} Lex_Checkpoints;
+
+// The glyphs of `rows` visual rows as last laid out, relative to the top
+// of the block. They are redrawn from the GPU for as long as the visible
+// text and tokens of those rows hash to `hash` and the atlas has not
+// evicted any glyphs since, see `generation`.
+//
+// A block starts at visual row `line_row` of line `line` and moves along
+// with that line when lines are inserted or deleted above it, so an edit
+// only lays out again the blocks whose own rows it changed.
+typedef struct {
+  bool used;
+  size_t line;
+  size_t line_row;
+  size_t rows;
+  uint64_t hash;
+  uint64_t generation;
+  size_t last_used;
+
+  Simple_Glyph_Run run;
+} Editor_Render_Block;
+
+// Where the characters of line `row` are drawn: the stops of the line
+// every EDITOR_LINE_XS_STRIDE bytes, the last one its end at its width.
+// The characters between two stops are measured when needed. Patched in
+// place when only line `row` is edited, dropped when lines are added or
+// removed at or before it.
+typedef struct {
+  bool used;
+  size_t row;
+  double width;
+  // Nonzero when the line is nothing but characters that advance by this
+  // much each, then byte `col` is drawn at col * advance and there are no
+  // stops
+  float advance;
+  Glyph_Stops stops;
+} Editor_Line_Xs;
 
 typedef struct {
   Free_Glyph_Atlas *atlas;
 
-  String_Builder data;
-  Lines lines;
+  Piece_Table data;
   Tokens tokens;
+  // The state the lexer was in when it entered each line
+  Lexer_States line_states;
   String_Builder filepath;
 
   bool searching;
@@ -46,6 +138,67 @@ typedef struct {
   Uint32 last_stroke;
 
   String_Builder clipboard;
+  String_Builder scratch;
+  Glyph_Stops scratch_stops;
+
+  Tokens relex_tokens;
+  Lexer_States relex_states;
+
+  bool lazy_lexing;
+  Lex_Checkpoints checkpoints;
+  // Checkpoints past this many were not re-lexed since the last edit
+  size_t checkpoints_valid;
+  // The last row touched by those edits
+  size_t checkpoints_damage_row;
+  size_t tokens_cached;
+  size_t lex_clock;
+  // Bumped whenever the checkpoints or their tokens change. e->tokens hold
+  // the tokens of the checkpoints [lex_visible_first, lex_visible_end) as of
+  // generation lex_visible_generation.
+  size_t checkpoints_generation;
+  size_t lex_visible_first;
+  size_t lex_visible_end;
+  size_t lex_visible_generation;
+
+  Lex_Worker lex_worker;
+  // The tokens are being lexed on the lexer thread. Until they are back,
+  // e->tokens are only remapped by each edit and e->line_states are stale.
+  bool lex_pending;
+  // The text changed from under the snapshot the lexer thread is busy with
+  // so much that its result is of no use
+  bool lex_outdated;
+  size_t lex_snapshot_size;
+  size_t lex_snapshot_lines_count;
+  // The edits made since the snapshot all fall after the first
+  // lex_damage_begin bytes and before the last lex_damage_tail bytes
+  bool lex_damaged;
+  size_t lex_damage_begin;
+  size_t lex_damage_tail;
+
+  // Open editor_begin_edit() calls. While there are any, edits only widen
+  // the damaged range below and the tokens are brought up to date once by
+  // the outermost editor_commit_edit().
+  size_t edit_depth;
+  bool edit_dirty;
+  // The text was edit_old_size bytes and edit_old_lines_count lines long
+  // before the first edit of the transaction, and its first edit_begin
+  // bytes and last edit_tail bytes were not touched since
+  size_t edit_old_size;
+  size_t edit_old_lines_count;
+  size_t edit_begin;
+  size_t edit_tail;
+
+  Editor_Render_Block render_blocks[EDITOR_RENDER_BLOCKS_CAP];
+  size_t render_clock;
+
+  Editor_Line_Xs line_xs[EDITOR_LINE_XS_CAP];
+
+  // Soft wrap: the lines are broken into visual rows wrap_width wide, see
+  // Wrap_Index. Without it every line is a single visual row.
+  bool wrap;
+  float wrap_width;
+  Wrap_Index wrap_index;
+  Wrap_Breaks wrap_breaks;
 } Editor;
 
 Errno editor_save_as(Editor *editor, const char *filepath);
@@ -53,14 +206,21 @@ Errno editor_save(const Editor *editor);
 Errno editor_load_from_file(Editor *editor, const char *filepath);
 
 void editor_retokenize(Editor *editor);
+void editor_lex_visible(Editor *editor, size_t first_row, size_t last_row);
+
+void editor_begin_edit(Editor *editor);
+void editor_commit_edit(Editor *editor);
 
 void editor_insert_char(Editor *editor, const char ch);
 void editor_insert_buf(Editor *editor, char *buf, size_t buf_len);
 void editor_backspace(Editor *editor);
 void editor_delete(Editor *editor);
 
+size_t editor_lines_count(const Editor *editor);
+Line editor_line(const Editor *editor, size_t row);
 size_t editor_cursor_row(const Editor *editor);
 
+// Up and down a visual row, so within a line when it wraps
 void editor_move_line_up(Editor *editor);
 void editor_move_line_down(Editor *editor);
 void editor_move_char_left(Editor *editor);
@@ -73,15 +233,24 @@ void editor_move_to_line_begin(Editor *e);
 void editor_move_to_line_end(Editor *e);
 void editor_move_paragraph_up(Editor *e);
 void editor_move_paragraph_down(Editor *e);
+// Moves the cursor to the character closest to `point`, in the coordinates
+// the text is laid out in
+void editor_move_to_point(Editor *e, Vec2f point);
 
 void editor_update_selection(Editor *e, bool shift);
 
+void editor_toggle_wrap(Editor *e);
+// There are lines left to wrap for the current width
+bool editor_wrap_pending(const Editor *e);
+
 void editor_start_search(Editor *e);
 void editor_stop_search(Editor *e);
 bool editor_search_matches_at(Editor *e, size_t pos);
 
 void editor_render(SDL_Window *window, Free_Glyph_Atlas *atlas,
                    Simple_Renderer *sr, Editor *e);
+// Milliseconds until the cursor blinks on or off next
+Uint32 editor_cursor_blink_timeout(const Editor *e);
 
 void editor_clipboard_copy(Editor *editor);
 void editor_clipboard_paste(Editor *editor);
@@ -175,9 +175,7 @@ void fb_render(SDL_Window *window, Free_Glyph_Atlas *atlas, Simple_Renderer *sr,
                                vec4f(.25, .25, .25, 1));
   }
 
-  simple_renderer_flush(sr);
-
-  // Render text
+  // Render text, in the same batch: the glyphs are drawn after the quads
   simple_renderer_set_shader(sr, SHADER_EPIC);
   for (size_t row = 0; row < fb->files.count; ++row) {
     const Vec2f begin = vec2f(0, -(float)row * FREE_GLYPH_FONT_SIZE);
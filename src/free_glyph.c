@@ -2,21 +2,361 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-void free_glyph_atlas_init(Free_Glyph_Atlas *atlas, FT_Face face) {
-  FT_Int32 load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_(FT_RENDER_MODE_SDF);
-  
+#include "common.h"
+
+// Bumped whenever the layout of the atlas cache changes
+#define FREE_GLYPH_CACHE_VERSION 2
+
+// Empty pixels kept to the right of and below every glyph, so sampling at
+// its edges does not bleed into its neighbours
+#define FREE_GLYPH_PADDING 1
+
+#define FREE_GLYPH_ATLAS_HEIGHT (FREE_GLYPH_PAGES * FREE_GLYPH_PAGE_HEIGHT)
+
+// The atlas cache file is this header followed by the bitmap of the pinned
+// pages, atlas_width * pinned_pages * FREE_GLYPH_PAGE_HEIGHT bytes
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t key;
+  uint32_t atlas_width;
+  uint32_t pinned_pages;
+  Glyph_Metric metrics[GLYPH_METRICS_CAPACITY];
+} Free_Glyph_Cache_Header;
+
+static const char free_glyph_cache_magic[8] = "NIJIATLS";
+
+// What the atlas depends on: the font file itself, which face of it, the
+// size it is rendered at, how and by which FreeType
+static bool free_glyph_cache_key(FT_Face face, const char *font_filepath,
+                                 FT_Int32 load_flags, uint64_t *key) {
+  Mapped_File font = {0};
+  Errno err = map_entire_file(font_filepath, &font);
+  if (err != 0) {
+    fprintf(stderr,
+            "WARNING: Could not read font `%s` to cache its atlas: %s\n",
+            font_filepath, strerror(err));
+    return false;
+  }
+
+  FT_Int major, minor, patch;
+  FT_Library_Version(face->glyph->library, &major, &minor, &patch);
+  int64_t params[] = {
+      face->face_index,
+      face->size->metrics.x_ppem,
+      face->size->metrics.y_ppem,
+      load_flags,
+      major,
+      minor,
+      patch,
+  };
+
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, font.data, font.size);
+  *key = fnv1a(hash, params, sizeof(params));
+  unmap_entire_file(&font);
+  return true;
+}
+
+static void free_glyph_page_reset(Free_Glyph_Page *page) {
+  page->skyline[0] = (Free_Glyph_Skyline){0, 0, FREE_GLYPH_ATLAS_WIDTH};
+  page->skyline_count = 1;
+  page->last_used = 0;
+}
+
+// How high a `width` wide rect with its left edge at segment `i` of the
+// skyline of `page` has to sit: on the highest segment below it
+static bool free_glyph_page_fit(const Free_Glyph_Page *page, size_t i,
+                                size_t width, size_t *y) {
+  if (page->skyline[i].x + width > FREE_GLYPH_ATLAS_WIDTH)
+    return false;
+
+  *y = 0;
+  for (size_t left = width; left > 0; ++i) {
+    if (*y < page->skyline[i].y) {
+      *y = page->skyline[i].y;
+    }
+    if (page->skyline[i].width >= left)
+      break;
+    left -= page->skyline[i].width;
+  }
+  return true;
+}
+
+// Finds room for a `width` x `height` rect in `page` and puts it there: as
+// low as it goes, and the leftmost of the equally low spots
+static bool free_glyph_page_pack(Free_Glyph_Page *page, size_t width,
+                                 size_t height, size_t *x, size_t *y) {
+  if (page->skyline_count >= FREE_GLYPH_SKYLINE_CAP)
+    return false;
+
+  size_t best = page->skyline_count;
+  size_t best_y = FREE_GLYPH_PAGE_HEIGHT;
+  for (size_t i = 0; i < page->skyline_count; ++i) {
+    size_t fit_y;
+    if (free_glyph_page_fit(page, i, width, &fit_y) &&
+        fit_y + height <= FREE_GLYPH_PAGE_HEIGHT && fit_y < best_y) {
+      best = i;
+      best_y = fit_y;
+    }
+  }
+  if (best == page->skyline_count)
+    return false;
+
+  *x = page->skyline[best].x;
+  *y = best_y;
+
+  memmove(&page->skyline[best + 1], &page->skyline[best],
+          (page->skyline_count - best) * sizeof(page->skyline[0]));
+  page->skyline[best] = (Free_Glyph_Skyline){
+      (uint16_t)*x, (uint16_t)(best_y + height), (uint16_t)width};
+  page->skyline_count += 1;
+
+  // The segments the rect now covers shrink or go away
+  size_t right = *x + width;
+  size_t i = best + 1;
+  while (i < page->skyline_count && page->skyline[i].x < right) {
+    Free_Glyph_Skyline *it = &page->skyline[i];
+    if (it->x + it->width <= right) {
+      memmove(it, it + 1, (page->skyline_count - i - 1) * sizeof(*it));
+      page->skyline_count -= 1;
+    } else {
+      it->width -= (uint16_t)(right - it->x);
+      it->x = (uint16_t)right;
+      break;
+    }
+  }
+
+  // Neighbours at the same height become one segment
+  for (i = 0; i + 1 < page->skyline_count;) {
+    Free_Glyph_Skyline *it = &page->skyline[i];
+    if (it->y == it[1].y) {
+      it->width += it[1].width;
+      memmove(it + 1, it + 2, (page->skyline_count - i - 2) * sizeof(*it));
+      page->skyline_count -= 1;
+    } else {
+      i += 1;
+    }
+  }
+
+  return true;
+}
+
+// The padding of the glyphs to come has to be empty
+static void free_glyph_atlas_clear_page(Free_Glyph_Atlas *atlas,
+                                        size_t page) {
+  static unsigned char blank[FREE_GLYPH_ATLAS_WIDTH * FREE_GLYPH_PAGE_HEIGHT];
+  glBindTexture(GL_TEXTURE_2D, atlas->glyphs_texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint)(page * FREE_GLYPH_PAGE_HEIGHT),
+                  FREE_GLYPH_ATLAS_WIDTH, FREE_GLYPH_PAGE_HEIGHT, GL_RED,
+                  GL_UNSIGNED_BYTE, blank);
+  atlas->pages[page].cleared = true;
+}
+
+// Finds room for a `width` x `height` rect in any of the pages that are not
+// pinned, in atlas coordinates
+static bool free_glyph_atlas_pack(Free_Glyph_Atlas *atlas, size_t width,
+                                  size_t height, size_t *page, size_t *x,
+                                  size_t *y) {
+  for (size_t i = 0; i < FREE_GLYPH_PAGES; ++i) {
+    if (!atlas->pages[i].pinned &&
+        free_glyph_page_pack(&atlas->pages[i], width, height, x, y)) {
+      *page = i;
+      *y += i * FREE_GLYPH_PAGE_HEIGHT;
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t free_glyph_table_home(uint32_t codepoint) {
+  return (codepoint * 2654435761u) & (FREE_GLYPH_TABLE_CAP - 1);
+}
+
+// The entry of `codepoint`, or the empty one where it would go
+static size_t free_glyph_table_find(const Free_Glyph_Atlas *atlas,
+                                    uint32_t codepoint) {
+  size_t i = free_glyph_table_home(codepoint);
+  while (atlas->table[i].codepoint != 0 &&
+         atlas->table[i].codepoint != codepoint) {
+    i = (i + 1) & (FREE_GLYPH_TABLE_CAP - 1);
+  }
+  return i;
+}
+
+static void free_glyph_table_insert(Free_Glyph_Atlas *atlas,
+                                    uint32_t codepoint, size_t glyph) {
+  size_t i = free_glyph_table_find(atlas, codepoint);
+  if (atlas->table[i].codepoint == 0) {
+    atlas->table_count += 1;
+  }
+  atlas->table[i] = (Free_Glyph_Entry){codepoint, (uint16_t)glyph};
+}
+
+// Removes the entry of `codepoint`, moving back the entries after it that
+// would no longer be found past the hole
+static void free_glyph_table_remove(Free_Glyph_Atlas *atlas,
+                                    uint32_t codepoint) {
+  size_t hole = free_glyph_table_find(atlas, codepoint);
+  if (atlas->table[hole].codepoint == 0)
+    return;
+
+  const size_t mask = FREE_GLYPH_TABLE_CAP - 1;
+  for (size_t i = (hole + 1) & mask; atlas->table[i].codepoint != 0;
+       i = (i + 1) & mask) {
+    size_t home = free_glyph_table_home(atlas->table[i].codepoint);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      atlas->table[hole] = atlas->table[i];
+      hole = i;
+    }
+  }
+  atlas->table[hole].codepoint = 0;
+  atlas->table_count -= 1;
+}
+
+// The two texels shaders/glyph.vert reads for `glyph`
+static void free_glyph_rect(const Free_Glyph_Atlas *atlas, size_t glyph,
+                            float rect[8]) {
+  Glyph_Metric metric = atlas->metrics[glyph];
+  rect[0] = metric.bl;
+  rect[1] = metric.bt;
+  rect[2] = metric.bw;
+  rect[3] = metric.bh;
+  rect[4] = metric.tx;
+  rect[5] = metric.ty;
+  rect[6] = metric.bw / (float)atlas->atlas_width;
+  rect[7] = metric.bh / (float)atlas->atlas_height;
+}
+
+// Uploads the first `pages_count` pages of the atlas from `bitmap`
+static void free_glyph_atlas_upload_pages(Free_Glyph_Atlas *atlas,
+                                          const void *bitmap,
+                                          size_t pages_count) {
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)atlas->atlas_width,
+                  (GLsizei)(pages_count * FREE_GLYPH_PAGE_HEIGHT), GL_RED,
+                  GL_UNSIGNED_BYTE, bitmap);
+}
+
+// Takes the metrics of the ASCII characters and the pages they are on from
+// the cache at `cache_filepath`, if it is there and was made with the same
+// `key`. The pages go to the texture straight from the mapped file.
+static bool free_glyph_cache_load(Free_Glyph_Atlas *atlas,
+                                  const char *cache_filepath, uint64_t key,
+                                  size_t *pinned_pages) {
+  Mapped_File cache = {0};
+  if (map_entire_file(cache_filepath, &cache) != 0)
+    return false;
+
+  bool result = true;
+  Free_Glyph_Cache_Header header;
+  if (cache.size < sizeof(header))
+    return_defer(false);
+  memcpy(&header, cache.data, sizeof(header));
+
+  if (memcmp(header.magic, free_glyph_cache_magic, sizeof(header.magic)) !=
+          0 ||
+      header.version != FREE_GLYPH_CACHE_VERSION ||
+      header.header_size != sizeof(header) || header.key != key ||
+      header.atlas_width != atlas->atlas_width || header.pinned_pages == 0 ||
+      header.pinned_pages > FREE_GLYPH_PAGES ||
+      cache.size - sizeof(header) != (size_t)header.atlas_width *
+                                         header.pinned_pages *
+                                         FREE_GLYPH_PAGE_HEIGHT)
+    return_defer(false);
+
+  memcpy(atlas->metrics, header.metrics, sizeof(header.metrics));
+  free_glyph_atlas_upload_pages(atlas, cache.data + sizeof(header),
+                                header.pinned_pages);
+  *pinned_pages = header.pinned_pages;
+
+defer:
+  unmap_entire_file(&cache);
+  return result;
+}
+
+static void free_glyph_cache_save(const Free_Glyph_Atlas *atlas,
+                                  const char *cache_filepath, uint64_t key,
+                                  const unsigned char *bitmap,
+                                  size_t pinned_pages) {
+  Free_Glyph_Cache_Header header = {0};
+  memcpy(header.magic, free_glyph_cache_magic, sizeof(header.magic));
+  header.version = FREE_GLYPH_CACHE_VERSION;
+  header.header_size = sizeof(header);
+  header.key = key;
+  header.atlas_width = atlas->atlas_width;
+  header.pinned_pages = (uint32_t)pinned_pages;
+  memcpy(header.metrics, atlas->metrics, sizeof(header.metrics));
+
+  String_Builder sb = {0};
+  sb_append_buf(&sb, (const char *)&header, sizeof(header));
+  sb_append_buf(&sb, (const char *)bitmap,
+                (size_t)atlas->atlas_width * pinned_pages *
+                    FREE_GLYPH_PAGE_HEIGHT);
+
+  Errno err = replace_entire_file(cache_filepath, sb.items, sb.count);
+  if (err != 0) {
+    fprintf(stderr, "WARNING: Could not save the glyph atlas to `%s`: %s\n",
+            cache_filepath, strerror(err));
+  }
+  free(sb.items);
+}
+
+// Renders the printable ASCII characters of `face` with FreeType into
+// `bitmap`, the whole atlas. Returns how many pages they took.
+static size_t free_glyph_atlas_rasterize(Free_Glyph_Atlas *atlas,
+                                         unsigned char *bitmap) {
+  size_t pages_count = 0;
   for (int i = 32; i < 128; ++i) {
-    if (FT_Load_Char(face, i, load_flags)) {
-      fprintf(stderr, "ERROR: Loading character `%c` failed!\n", i);
+    if (FT_Load_Char(atlas->face, i, atlas->load_flags)) {
+      fprintf(stderr,
+              "ERROR: Could not load glyph of a character with code %d\n", i);
+      exit(1);
+    }
+
+    const FT_Bitmap *glyph = &atlas->face->glyph->bitmap;
+    size_t page, x, y;
+    if (!free_glyph_atlas_pack(atlas, glyph->width + FREE_GLYPH_PADDING,
+                               glyph->rows + FREE_GLYPH_PADDING, &page, &x,
+                               &y)) {
+      fprintf(stderr,
+              "ERROR: The glyph atlas is too small for the font size %d\n",
+              FREE_GLYPH_FONT_SIZE);
       exit(1);
     }
+    if (pages_count < page + 1) {
+      pages_count = page + 1;
+    }
 
-    atlas->atlas_width += face->glyph->bitmap.width;
-    if (atlas->atlas_height < face->glyph->bitmap.rows) {
-      atlas->atlas_height = face->glyph->bitmap.rows;
+    for (unsigned int row = 0; row < glyph->rows; ++row) {
+      memcpy(bitmap + (y + row) * atlas->atlas_width + x,
+             glyph->buffer + (ptrdiff_t)row * glyph->pitch, glyph->width);
     }
+
+    atlas->metrics[i].ax = atlas->face->glyph->advance.x >> 6;
+    atlas->metrics[i].ay = atlas->face->glyph->advance.y >> 6;
+    atlas->metrics[i].bw = glyph->width;
+    atlas->metrics[i].bh = glyph->rows;
+    atlas->metrics[i].bl = atlas->face->glyph->bitmap_left;
+    atlas->metrics[i].bt = atlas->face->glyph->bitmap_top;
+    atlas->metrics[i].tx = (float)x / (float)atlas->atlas_width;
+    atlas->metrics[i].ty = (float)y / (float)atlas->atlas_height;
+  }
+  return pages_count;
+}
+
+void free_glyph_atlas_init(Free_Glyph_Atlas *atlas, FT_Face face,
+                           const char *font_filepath,
+                           const char *cache_filepath) {
+  atlas->face = face;
+  atlas->load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_(FT_RENDER_MODE_SDF);
+  atlas->atlas_width = FREE_GLYPH_ATLAS_WIDTH;
+  atlas->atlas_height = FREE_GLYPH_ATLAS_HEIGHT;
+  for (size_t i = 0; i < FREE_GLYPH_PAGES; ++i) {
+    free_glyph_page_reset(&atlas->pages[i]);
   }
 
   glActiveTexture(GL_TEXTURE0);
@@ -29,43 +369,318 @@ void free_glyph_atlas_init(Free_Glyph_Atlas *atlas, FT_Face face) {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
+  // Only the pinned pages are uploaded, the rest is cleared the first time
+  // a glyph goes there
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, (GLsizei)atlas->atlas_width,
-               (GLsizei)atlas->atlas_height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
-  int x = 0;
-  for (int i = 32; i < 128; ++i) {
-    if (FT_Load_Char(face, i, load_flags)) {
-      fprintf(stderr,
-              "ERROR: Could not load glyph of a character with code %d\n", i);
-      exit(1);
+               (GLsizei)atlas->atlas_height, 0, GL_RED, GL_UNSIGNED_BYTE,
+               NULL);
+
+  uint64_t key = 0;
+  size_t pinned_pages = 0;
+  bool cached =
+      cache_filepath != NULL &&
+      free_glyph_cache_key(face, font_filepath, atlas->load_flags, &key);
+  if (!cached ||
+      !free_glyph_cache_load(atlas, cache_filepath, key, &pinned_pages)) {
+    unsigned char *bitmap =
+        calloc((size_t)atlas->atlas_width * atlas->atlas_height, 1);
+    assert(bitmap != NULL && "Buy more RAM lol");
+    pinned_pages = free_glyph_atlas_rasterize(atlas, bitmap);
+    free_glyph_atlas_upload_pages(atlas, bitmap, pinned_pages);
+    if (cached) {
+      free_glyph_cache_save(atlas, cache_filepath, key, bitmap, pinned_pages);
     }
+    free(bitmap);
+  }
 
-    if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
-      fprintf(stderr,
-              "ERROR: Could not render glyph of a character with code %d\n", i);
-      exit(1);
+  for (size_t i = 0; i < pinned_pages; ++i) {
+    atlas->pages[i].pinned = true;
+    atlas->pages[i].cleared = true;
+  }
+
+  atlas->advance = atlas->metrics[' '].ax;
+  for (int i = ' '; i <= '~'; ++i) {
+    if (atlas->metrics[i].ax != atlas->advance ||
+        atlas->metrics[i].ay != 0) {
+      atlas->advance = 0;
+      break;
     }
+  }
+  for (size_t i = FREE_GLYPH_SLOTS_CAP; i > GLYPH_METRICS_CAPACITY; --i) {
+    atlas->free_glyphs[atlas->free_glyphs_count++] = (uint16_t)(i - 1);
+  }
 
-    atlas->metrics[i].ax = face->glyph->advance.x >> 6;
-    atlas->metrics[i].ay = face->glyph->advance.y >> 6;
-    atlas->metrics[i].bw = face->glyph->bitmap.width;
-    atlas->metrics[i].bh = face->glyph->bitmap.rows;
-    atlas->metrics[i].bl = face->glyph->bitmap_left;
-    atlas->metrics[i].bt = face->glyph->bitmap_top;
-    atlas->metrics[i].tx = (float)x / (float)atlas->atlas_width;
+  static float rects[FREE_GLYPH_SLOTS_CAP][8];
+  for (size_t i = 0; i < GLYPH_METRICS_CAPACITY; ++i) {
+    free_glyph_rect(atlas, i, rects[i]);
+  }
+
+  glGenBuffers(1, &atlas->glyph_rects_buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, atlas->glyph_rects_buffer);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(rects), rects, GL_DYNAMIC_DRAW);
+
+  glActiveTexture(GL_TEXTURE0 + SIMPLE_GLYPH_RECTS_UNIT);
+  glGenTextures(1, &atlas->glyph_rects_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, atlas->glyph_rects_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, atlas->glyph_rects_buffer);
+  glActiveTexture(GL_TEXTURE0);
+}
+
+// Clears the page used least recently and drops the glyphs on it. Pages
+// with nothing on them are skipped, clearing them would free nothing.
+static bool free_glyph_atlas_evict(Free_Glyph_Atlas *atlas) {
+  size_t lru = FREE_GLYPH_PAGES;
+  for (size_t i = 0; i < FREE_GLYPH_PAGES; ++i) {
+    const Free_Glyph_Page *page = &atlas->pages[i];
+    bool empty = page->skyline_count == 1 && page->skyline[0].y == 0;
+    if (!page->pinned && !empty &&
+        (lru == FREE_GLYPH_PAGES ||
+         atlas->pages[i].last_used < atlas->pages[lru].last_used)) {
+      lru = i;
+    }
+  }
+  if (lru == FREE_GLYPH_PAGES)
+    return false;
+
+  for (size_t i = GLYPH_METRICS_CAPACITY; i < FREE_GLYPH_SLOTS_CAP; ++i) {
+    if (atlas->glyph_codepoints[i] != 0 && atlas->glyph_pages[i] == lru) {
+      free_glyph_table_remove(atlas, atlas->glyph_codepoints[i]);
+      atlas->glyph_codepoints[i] = 0;
+      atlas->free_glyphs[atlas->free_glyphs_count++] = (uint16_t)i;
+    }
+  }
+  free_glyph_page_reset(&atlas->pages[lru]);
+  free_glyph_atlas_clear_page(atlas, lru);
+
+  atlas->generation += 1;
+  return true;
+}
+
+// Renders `codepoint` into the atlas. Characters the font does not have
+// are drawn as '?', and so is one that could not be rendered or had no
+// room this time, until it is asked for again.
+static size_t free_glyph_atlas_add(Free_Glyph_Atlas *atlas,
+                                   uint32_t codepoint) {
+  FT_Face face = atlas->face;
+  if (FT_Get_Char_Index(face, codepoint) == 0) {
+    // Remembered so the font is not asked again, while there is room
+    if (atlas->table_count < FREE_GLYPH_TABLE_CAP / 4) {
+      free_glyph_table_insert(atlas, codepoint, '?');
+    }
+    return '?';
+  }
+
+  const FT_Bitmap *bitmap = &face->glyph->bitmap;
+  size_t page, x, y;
+  bool loaded = FT_Load_Char(face, codepoint, atlas->load_flags) == 0 &&
+                bitmap->width + FREE_GLYPH_PADDING <= FREE_GLYPH_ATLAS_WIDTH &&
+                bitmap->rows + FREE_GLYPH_PADDING <= FREE_GLYPH_PAGE_HEIGHT;
+  while (loaded && atlas->free_glyphs_count == 0) {
+    loaded = free_glyph_atlas_evict(atlas);
+  }
+  while (loaded && !free_glyph_atlas_pack(
+                       atlas, bitmap->width + FREE_GLYPH_PADDING,
+                       bitmap->rows + FREE_GLYPH_PADDING, &page, &x, &y)) {
+    loaded = free_glyph_atlas_evict(atlas);
+  }
+  if (!loaded)
+    return '?';
+
+  if (!atlas->pages[page].cleared) {
+    free_glyph_atlas_clear_page(atlas, page);
+  }
+
+  size_t glyph = atlas->free_glyphs[--atlas->free_glyphs_count];
+  atlas->glyph_codepoints[glyph] = codepoint;
+  atlas->glyph_pages[glyph] = (uint8_t)page;
+  atlas->pages[page].last_used = atlas->clock;
+  free_glyph_table_insert(atlas, codepoint, glyph);
+
+  Glyph_Metric *metric = &atlas->metrics[glyph];
+  metric->ax = face->glyph->advance.x >> 6;
+  metric->ay = face->glyph->advance.y >> 6;
+  metric->bw = bitmap->width;
+  metric->bh = bitmap->rows;
+  metric->bl = face->glyph->bitmap_left;
+  metric->bt = face->glyph->bitmap_top;
+  metric->tx = (float)x / (float)atlas->atlas_width;
+  metric->ty = (float)y / (float)atlas->atlas_height;
+
+  glBindTexture(GL_TEXTURE_2D, atlas->glyphs_texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->pitch);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)x, (GLint)y,
+                  (GLsizei)bitmap->width, (GLsizei)bitmap->rows, GL_RED,
+                  GL_UNSIGNED_BYTE, bitmap->buffer);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+  float rect[8];
+  free_glyph_rect(atlas, glyph, rect);
+  glBindBuffer(GL_TEXTURE_BUFFER, atlas->glyph_rects_buffer);
+  glBufferSubData(GL_TEXTURE_BUFFER, (GLintptr)(glyph * sizeof(rect)),
+                  sizeof(rect), rect);
+
+  return glyph;
+}
+
+size_t free_glyph_atlas_glyph(Free_Glyph_Atlas *atlas, uint32_t codepoint) {
+  if (codepoint < GLYPH_METRICS_CAPACITY)
+    return codepoint;
+
+  atlas->clock += 1;
+  const Free_Glyph_Entry *entry =
+      &atlas->table[free_glyph_table_find(atlas, codepoint)];
+  if (entry->codepoint == 0)
+    return free_glyph_atlas_add(atlas, codepoint);
+
+  atlas->pages[atlas->glyph_pages[entry->glyph]].last_used = atlas->clock;
+  return entry->glyph;
+}
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, x, 0, face->glyph->bitmap.width,
-                    face->glyph->bitmap.rows, GL_RED, GL_UNSIGNED_BYTE,
-                    face->glyph->bitmap.buffer);
-    x += face->glyph->bitmap.width;
+#define UTF8_REPLACEMENT_CHARACTER 0xFFFD
+
+// Decodes the character `text` starts with into `codepoint` and returns how
+// many bytes it takes. Malformed UTF-8 is taken one byte at a time, as
+// U+FFFD.
+static size_t utf8_decode(const char *text, size_t text_size,
+                          uint32_t *codepoint) {
+  const unsigned char *s = (const unsigned char *)text;
+  *codepoint = UTF8_REPLACEMENT_CHARACTER;
+
+  size_t len;
+  uint32_t c, min;
+  if (s[0] < 0x80) {
+    *codepoint = s[0];
+    return 1;
+  } else if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    len = 2, c = s[0] & 0x1F, min = 0x80;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    len = 3, c = s[0] & 0x0F, min = 0x800;
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    len = 4, c = s[0] & 0x07, min = 0x10000;
+  } else {
+    return 1;
+  }
+
+  if (len > text_size)
+    return 1;
+  for (size_t i = 1; i < len; ++i) {
+    if ((s[i] & 0xC0) != 0x80)
+      return 1;
+    c = (c << 6) | (s[i] & 0x3F);
   }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return 1;
+
+  *codepoint = c;
+  return len;
+}
+
+// The glyph of the character at `text[*i]`, moving `*i` past it
+static size_t free_glyph_atlas_next(Free_Glyph_Atlas *atlas, const char *text,
+                                    size_t text_size, size_t *i) {
+  unsigned char x = (unsigned char)text[*i];
+  if (x < 0x80) {
+    *i += 1;
+    return x;
+  }
+
+  uint32_t codepoint;
+  *i += utf8_decode(text + *i, text_size - *i, &codepoint);
+  return free_glyph_atlas_glyph(atlas, codepoint);
+}
+
+size_t free_glyph_atlas_uniform_prefix(const Free_Glyph_Atlas *atlas,
+                                       const char *text, size_t text_size) {
+  if (atlas->advance == 0)
+    return 0;
+
+  size_t i = 0;
+  while (i < text_size && (uint8_t)(text[i] - ' ') < '~' - ' ' + 1) {
+    i += 1;
+  }
+  return i;
+}
+
+void free_glyph_atlas_stops(Free_Glyph_Atlas *atlas, const char *text,
+                            size_t text_size, size_t stride,
+                            Glyph_Stops *stops) {
+  size_t uniform = free_glyph_atlas_uniform_prefix(atlas, text, text_size);
+  size_t next = 0;
+  for (; next < uniform; next += stride) {
+    da_append(stops, ((Glyph_Stop){next, (double)next * atlas->advance}));
+  }
+
+  double x = (double)uniform * atlas->advance;
+  for (size_t i = uniform; i < text_size;) {
+    if (i >= next) {
+      da_append(stops, ((Glyph_Stop){i, x}));
+      next = (i / stride + 1) * stride;
+    }
+    size_t glyph = free_glyph_atlas_next(atlas, text, text_size, &i);
+    x += atlas->metrics[glyph].ax;
+  }
+  da_append(stops, ((Glyph_Stop){text_size, x}));
+}
+
+size_t free_glyph_atlas_col_at(Free_Glyph_Atlas *atlas, const char *text,
+                               size_t text_size, float x0, float x) {
+  size_t uniform = free_glyph_atlas_uniform_prefix(atlas, text, text_size);
+  if (uniform > 0) {
+    float col = (x - x0) / atlas->advance;
+    if (col < (float)uniform)
+      return col > 0 ? (size_t)col : 0;
+    x0 += (float)uniform * atlas->advance;
+  }
+
+  for (size_t i = uniform; i < text_size;) {
+    size_t begin = i;
+    size_t glyph = free_glyph_atlas_next(atlas, text, text_size, &i);
+    x0 += atlas->metrics[glyph].ax;
+    if (x0 > x)
+      return begin;
+  }
+  return text_size;
+}
+
+static bool free_glyph_is_space(char c) { return c == ' ' || c == '\t'; }
+
+size_t free_glyph_atlas_wrap(Free_Glyph_Atlas *atlas, const char *text,
+                             size_t text_size, float width) {
+  size_t fit = free_glyph_atlas_col_at(atlas, text, text_size, 0, width);
+  if (fit == text_size)
+    return text_size;
+  if (fit == 0) {
+    // Every row takes at least one character
+    free_glyph_atlas_next(atlas, text, text_size, &fit);
+    return fit;
+  }
+
+  // Spaces past the edge stay on the row...
+  if (free_glyph_is_space(text[fit])) {
+    while (fit < text_size && free_glyph_is_space(text[fit])) {
+      fit += 1;
+    }
+    return fit;
+  }
+
+  // ... and a word that does not fit moves to the next one, unless it is
+  // the only word on the row
+  for (size_t i = fit; i > 0; --i) {
+    if (free_glyph_is_space(text[i - 1]))
+      return i;
+  }
+  return fit;
 }
 
 void free_glyph_atlas_measure_line_sized(Free_Glyph_Atlas *atlas,
                                          const char *text, size_t text_size,
                                          Vec2f *pos) {
+  size_t uniform = free_glyph_atlas_uniform_prefix(atlas, text, text_size);
+  pos->x += (float)uniform * atlas->advance;
 
-  for (size_t i = 0; i < text_size; ++i) {
-    Glyph_Metric metric = atlas->metrics[(size_t)text[i]];
+  for (size_t i = uniform; i < text_size;) {
+    size_t glyph = free_glyph_atlas_next(atlas, text, text_size, &i);
+    Glyph_Metric metric = atlas->metrics[glyph];
     pos->x += metric.ax;
     pos->y += metric.ay;
   }
@@ -75,38 +690,43 @@ void free_glyph_atlas_render_line_sized(Free_Glyph_Atlas *atlas,
                                         Simple_Renderer *sr, const char *text,
                                         size_t text_size, Vec2f *pos,
                                         Vec4f color) {
-  for (size_t i = 0; i < text_size; ++i) {
-    Glyph_Metric metric = atlas->metrics[(size_t)text[i]];
-    float x2 = pos->x + metric.bl;
-    float y2 = -pos->y - metric.bt;
-    float w = metric.bw;
-    float h = metric.bh;
+  size_t uniform = free_glyph_atlas_uniform_prefix(atlas, text, text_size);
+  for (size_t i = 0; i < uniform; ++i) {
+    simple_renderer_glyph(
+        sr, vec2f(pos->x + (float)i * atlas->advance, pos->y),
+        (uint8_t)text[i], color);
+  }
+  pos->x += (float)uniform * atlas->advance;
+
+  for (size_t i = uniform; i < text_size;) {
+    size_t glyph = free_glyph_atlas_next(atlas, text, text_size, &i);
+    Glyph_Metric metric = atlas->metrics[glyph];
+
+    simple_renderer_glyph(sr, *pos, glyph, color);
 
     pos->x += metric.ax;
     pos->y += metric.ay;
-
-    simple_renderer_image_rect(sr, vec2f(x2, -y2), vec2f(w, -h),
-                               vec2f(metric.tx, 0.0f),
-                               vec2f(metric.bw / (float)atlas->atlas_width,
-                                     metric.bh / (float)atlas->atlas_height),
-                               color);
   }
 }
 
-float free_glyph_atlas_cursor_pos(const Free_Glyph_Atlas *atlas,
-                                  const char *text, size_t text_size, Vec2f pos,
-                                  size_t col) {
-  for (size_t i = 0; i < text_size; ++i) {
-    if (i == col) {
-      return pos.x;
-    }
+float free_glyph_atlas_cursor_pos(Free_Glyph_Atlas *atlas, const char *text,
+                                  size_t text_size, Vec2f pos, size_t col) {
+  if (col > text_size)
+    col = text_size;
+  size_t uniform = free_glyph_atlas_uniform_prefix(atlas, text, text_size);
+  if (col <= uniform) {
+    return pos.x + (float)col * atlas->advance;
+  }
+  pos.x += (float)uniform * atlas->advance;
 
-    size_t glyph_index = text[i];
-    if (glyph_index >= GLYPH_METRICS_CAPACITY) {
-      glyph_index = '?';
+  for (size_t i = uniform; i < text_size;) {
+    size_t glyph = free_glyph_atlas_next(atlas, text, text_size, &i);
+    // A `col` in the middle of a character counts as its start
+    if (col < i) {
+      return pos.x;
     }
-    Glyph_Metric metric = atlas->metrics[glyph_index];
 
+    Glyph_Metric metric = atlas->metrics[glyph];
     pos.x += metric.ax;
     pos.y += metric.ay;
   }
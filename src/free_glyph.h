@@ -2,6 +2,7 @@
 #define __NIJI_FREE_GLYPH_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "la.h"
@@ -29,25 +30,123 @@ typedef struct {
   float bt; // bitmap_top;
 
   float tx; // x offset of glyph in texture coordinates
+  float ty; // y offset of glyph in texture coordinates
 } Glyph_Metric;
 
+// The ASCII characters are rendered up front and their glyph is the byte
+// itself. Every other character gets one of the remaining slots the first
+// time it is drawn.
 #define GLYPH_METRICS_CAPACITY 128
+#define FREE_GLYPH_SLOTS_CAP 4096
+#define FREE_GLYPH_TABLE_CAP (2 * FREE_GLYPH_SLOTS_CAP)
 
+// The atlas is split into pages, horizontal bands packed independently.
+// When the atlas is full the page used least recently is cleared.
+#define FREE_GLYPH_ATLAS_WIDTH 2048
+#define FREE_GLYPH_PAGE_HEIGHT 256
+#define FREE_GLYPH_PAGES 8
+#define FREE_GLYPH_SKYLINE_CAP 256
+
+typedef struct {
+  uint16_t x;
+  uint16_t y; // the height the page is filled to over this segment
+  uint16_t width;
+} Free_Glyph_Skyline;
+
+typedef struct {
+  Free_Glyph_Skyline skyline[FREE_GLYPH_SKYLINE_CAP];
+  size_t skyline_count;
+  uint64_t last_used;
+  // Holds the ASCII characters, which are never evicted
+  bool pinned;
+  // The texture under the page is undefined until it is first cleared
+  bool cleared;
+} Free_Glyph_Page;
+
+typedef struct {
+  uint32_t codepoint; // 0 for an empty entry
+  uint16_t glyph;
+} Free_Glyph_Entry;
+
+// A character `offset` bytes into a text, drawn `x` from its beginning. A
+// double, a float is off by whole characters a hundred megabytes in.
 typedef struct {
+  size_t offset;
+  double x;
+} Glyph_Stop;
+
+typedef struct {
+  Glyph_Stop *items;
+  size_t count;
+  size_t capacity;
+} Glyph_Stops;
+
+typedef struct {
+  FT_Face face;
+  FT_Int32 load_flags;
+
   FT_UInt atlas_width;
   FT_UInt atlas_height;
 
   GLuint glyphs_texture;
-
-  Glyph_Metric metrics[GLYPH_METRICS_CAPACITY];
-
+  // The rects of the glyphs in the shape shaders/glyph.vert reads them, as
+  // a buffer texture bound to SIMPLE_GLYPH_RECTS_UNIT
+  GLuint glyph_rects_buffer;
+  GLuint glyph_rects_texture;
+
+  Glyph_Metric metrics[FREE_GLYPH_SLOTS_CAP];
+  uint8_t glyph_pages[FREE_GLYPH_SLOTS_CAP];
+  uint32_t glyph_codepoints[FREE_GLYPH_SLOTS_CAP];
+  uint16_t free_glyphs[FREE_GLYPH_SLOTS_CAP];
+  size_t free_glyphs_count;
+
+  // Open addressing from a codepoint to its glyph
+  Free_Glyph_Entry table[FREE_GLYPH_TABLE_CAP];
+  size_t table_count;
+
+  // How far every printable ASCII character advances when the font is
+  // monospaced, 0 when it is not
+  float advance;
+
+  Free_Glyph_Page pages[FREE_GLYPH_PAGES];
+  uint64_t clock;
+  // Bumped whenever glyphs are evicted. Glyph indices handed out before
+  // that may now point at other characters.
+  uint64_t generation;
 } Free_Glyph_Atlas;
 
-void free_glyph_atlas_init(Free_Glyph_Atlas *atlas, FT_Face face);
-
-float free_glyph_atlas_cursor_pos(const Free_Glyph_Atlas *atlas,
-                                  const char *text, size_t text_size, Vec2f pos,
-                                  size_t col);
+// Renders the ASCII characters of `face`, which was opened from
+// `font_filepath`. With a `cache_filepath` the result is kept there and
+// later calls with the same font and size take it from there instead of
+// rendering it again. `face` has to outlive the atlas, the rest of Unicode
+// is rendered from it on demand.
+void free_glyph_atlas_init(Free_Glyph_Atlas *atlas, FT_Face face,
+                           const char *font_filepath,
+                           const char *cache_filepath);
+
+// The glyph of `codepoint`, rendering it into the atlas if it is not there
+size_t free_glyph_atlas_glyph(Free_Glyph_Atlas *atlas, uint32_t codepoint);
+
+// `text` is UTF-8 in all of these, `col` a byte offset into it
+float free_glyph_atlas_cursor_pos(Free_Glyph_Atlas *atlas, const char *text,
+                                  size_t text_size, Vec2f pos, size_t col);
+// How many bytes at the beginning of `text` are printable ASCII, when the
+// font is monospaced. Byte `col` of those is drawn at col * atlas->advance.
+size_t free_glyph_atlas_uniform_prefix(const Free_Glyph_Atlas *atlas,
+                                       const char *text, size_t text_size);
+// Appends to `stops` the first character at or after every `stride`th
+// byte of `text`, then the end of `text` drawn at its width
+void free_glyph_atlas_stops(Free_Glyph_Atlas *atlas, const char *text,
+                            size_t text_size, size_t stride,
+                            Glyph_Stops *stops);
+// The offset of the character under `x` in `text` drawn from `x0`: the first
+// one that ends past `x`, or text_size if there is none
+size_t free_glyph_atlas_col_at(Free_Glyph_Atlas *atlas, const char *text,
+                               size_t text_size, float x0, float x);
+// How much of `text` goes on the first row when it is wrapped `width` wide:
+// up to the last space that fits, or as much of the first word as fits
+size_t free_glyph_atlas_wrap(Free_Glyph_Atlas *atlas, const char *text,
+                             size_t text_size, float width);
 void free_glyph_atlas_measure_line_sized(Free_Glyph_Atlas *atlas,
                                          const char *text, size_t text_size,
                                          Vec2f *pos);
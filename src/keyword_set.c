@@ -0,0 +1,74 @@
+#include "keyword_set.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define KEYWORD_SET_SEED_ATTEMPTS 4096
+
+static size_t keyword_hash(uint32_t seed, const char *text, size_t text_len) {
+  uint32_t key = (uint32_t)(uint8_t)text[0] |
+                 (uint32_t)(uint8_t)text[text_len / 2] << 8 |
+                 (uint32_t)(uint8_t)text[text_len - 1] << 16 |
+                 (uint32_t)text_len << 24;
+  return (key * seed) >> (32 - KEYWORD_SET_BITS);
+}
+
+// Places every word into the slots under `seed`, probing linearly on
+// collisions. Returns the number of collisions.
+static size_t keyword_set_fill(Keyword_Set *set, uint32_t seed) {
+  memset(set->slots, 0, sizeof(set->slots));
+  set->seed = seed;
+
+  size_t collisions = 0;
+  for (size_t i = 0; i < set->words_count; ++i) {
+    const char *word = set->words[i];
+    size_t word_len = strlen(word);
+    assert(word_len > 0 && word_len <= KEYWORD_MAX_LEN);
+
+    size_t slot = keyword_hash(seed, word, word_len);
+    while (set->slots[slot] != 0) {
+      slot = (slot + 1) & (KEYWORD_SET_CAPACITY - 1);
+      collisions += 1;
+    }
+    set->slots[slot] = (uint16_t)(i + 1);
+    set->slot_lens[slot] = (uint8_t)word_len;
+  }
+  return collisions;
+}
+
+void keyword_set_build(Keyword_Set *set) {
+  assert(set->words_count < KEYWORD_SET_CAPACITY / 2);
+
+  uint32_t best_seed = 0;
+  size_t best_collisions = (size_t)-1;
+  for (uint32_t seed = 0; seed < KEYWORD_SET_SEED_ATTEMPTS; ++seed) {
+    uint32_t odd = seed * 0x9e3779b9u | 1;
+    size_t collisions = keyword_set_fill(set, odd);
+    if (collisions < best_collisions) {
+      best_seed = odd;
+      best_collisions = collisions;
+    }
+    if (collisions == 0)
+      break;
+  }
+
+  keyword_set_fill(set, best_seed);
+  set->built = true;
+}
+
+bool keyword_set_contains(const Keyword_Set *set, const char *text,
+                          size_t text_len) {
+  assert(set->built);
+  if (text_len == 0 || text_len > KEYWORD_MAX_LEN)
+    return false;
+
+  size_t slot = keyword_hash(set->seed, text, text_len);
+  while (set->slots[slot] != 0) {
+    if (set->slot_lens[slot] == text_len &&
+        memcmp(set->words[set->slots[slot] - 1], text, text_len) == 0) {
+      return true;
+    }
+    slot = (slot + 1) & (KEYWORD_SET_CAPACITY - 1);
+  }
+  return false;
+}
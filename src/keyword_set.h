@@ -0,0 +1,40 @@
+#ifndef __NIJI_KEYWORD_SET_H
+#define __NIJI_KEYWORD_SET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A fixed set of words (the keywords of a language) answering "is this
+// identifier one of them?" with a single hash probe. The hash only looks at
+// the length and three characters of a word; keyword_set_build() searches
+// for a seed under which no two words of the set share a slot, which makes
+// the hash perfect for that set. Sets it cannot find one for fall back to
+// linear probing, so any list of words works.
+
+#define KEYWORD_SET_BITS 10
+#define KEYWORD_SET_CAPACITY (1 << KEYWORD_SET_BITS)
+#define KEYWORD_MAX_LEN 32
+
+typedef struct {
+  const char **words;
+  size_t words_count;
+
+  bool built;
+  uint32_t seed;
+  // Index + 1 of the word in each slot, 0 for an empty slot
+  uint16_t slots[KEYWORD_SET_CAPACITY];
+  uint8_t slot_lens[KEYWORD_SET_CAPACITY];
+} Keyword_Set;
+
+#define KEYWORD_SET(words_array)                                               \
+  {                                                                            \
+    .words = (words_array),                                                    \
+    .words_count = sizeof(words_array) / sizeof((words_array)[0]),             \
+  }
+
+void keyword_set_build(Keyword_Set *set);
+bool keyword_set_contains(const Keyword_Set *set, const char *text,
+                          size_t text_len);
+
+#endif // __NIJI_KEYWORD_SET_H
@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "lex_worker.h"
+
+static void lex_worker_lex(Lex_Worker *w) {
+  w->tokens.count = 0;
+  w->line_states.count = 0;
+  da_append(&w->line_states, LEXER_STATE_NORMAL);
+
+  Lexer l = lexer_new(&w->snapshot);
+  l.line_states = &w->line_states;
+  for (Token t = lexer_next(&l); t.kind != TOKEN_END; t = lexer_next(&l)) {
+    tokens_append(&w->tokens, t);
+  }
+}
+
+static int lex_worker_run(void *data) {
+  Lex_Worker *w = data;
+  for (;;) {
+    SDL_SemWait(w->jobs);
+    lex_worker_lex(w);
+    // SDL_AtomicSet() is a full barrier, so the result is visible to the
+    // main thread by the time it sees the flag
+    SDL_AtomicSet(&w->done, 1);
+
+    if (w->done_event != (Uint32)-1) {
+      SDL_Event event = {0};
+      event.type = w->done_event;
+      SDL_PushEvent(&event);
+    }
+  }
+  return 0;
+}
+
+void lex_worker_submit(Lex_Worker *w, Piece_Table *pt) {
+  assert(!w->busy);
+
+  piece_table_snapshot(pt, &w->snapshot);
+  w->source = pt;
+  w->busy = true;
+  SDL_AtomicSet(&w->done, 0);
+
+  if (w->jobs == NULL) {
+    // The lexer tables are built lazily, do it before there is a second
+    // thread around to race with
+    lexer_init();
+    w->done_event = SDL_RegisterEvents(1);
+    w->jobs = SDL_CreateSemaphore(0);
+    if (w->jobs != NULL) {
+      w->thread = SDL_CreateThread(lex_worker_run, "lexer", w);
+    }
+    if (w->thread == NULL) {
+      fprintf(stderr, "WARNING: could not start the lexer thread: %s\n",
+              SDL_GetError());
+    }
+  }
+
+  if (w->thread == NULL) {
+    lex_worker_lex(w);
+    SDL_AtomicSet(&w->done, 1);
+    return;
+  }
+
+  SDL_SemPost(w->jobs);
+}
+
+bool lex_worker_poll(Lex_Worker *w) {
+  if (w->busy && SDL_AtomicGet(&w->done)) {
+    w->busy = false;
+    piece_table_release(w->source);
+  }
+  return !w->busy;
+}
+
+void lex_worker_swap(Lex_Worker *w, Tokens *tokens, Lexer_States *line_states) {
+  assert(!w->busy);
+
+  Tokens t = *tokens;
+  *tokens = w->tokens;
+  w->tokens = t;
+
+  Lexer_States s = *line_states;
+  *line_states = w->line_states;
+  w->line_states = s;
+}
@@ -0,0 +1,41 @@
+#ifndef __NIJI_LEX_WORKER_H
+#define __NIJI_LEX_WORKER_H
+
+#include <stdbool.h>
+
+#include <SDL2/SDL.h>
+
+#include "common.h"
+#include "lexer.h"
+#include "piece_table.h"
+
+// Lexes a snapshot of a document on a thread of its own, so that lexing a
+// big file never stalls the main loop. There is at most one job in flight:
+// lex_worker_submit() takes a snapshot of the pieces (the text itself is
+// shared, see piece_table_snapshot) and wakes the thread up, and
+// lex_worker_poll() tells without blocking whether the job is done. The
+// result is handed over by swapping arrays with lex_worker_swap(), which
+// gives the worker the caller's previous arrays to lex into next time.
+// Finishing a job pushes an SDL event, so a main loop sleeping in
+// SDL_WaitEvent() wakes up to show the result.
+typedef struct {
+  SDL_Thread *thread;
+  SDL_sem *jobs;
+  SDL_atomic_t done;
+  Uint32 done_event;
+  // Only touched by the main thread: a job was submitted and not polled yet,
+  // on a snapshot of `source`
+  bool busy;
+  Piece_Table *source;
+
+  // Owned by the worker thread while busy
+  Piece_Table snapshot;
+  Tokens tokens;
+  Lexer_States line_states;
+} Lex_Worker;
+
+void lex_worker_submit(Lex_Worker *w, Piece_Table *pt);
+bool lex_worker_poll(Lex_Worker *w);
+void lex_worker_swap(Lex_Worker *w, Tokens *tokens, Lexer_States *line_states);
+
+#endif // __NIJI_LEX_WORKER_H
@@ -1,9 +1,10 @@
 #include "lexer.h"
+#include "lexer_scan.h"
 
 #include "common.h"
 #include <assert.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 typedef struct {
@@ -24,7 +25,7 @@ Literal_Token literal_tokens[] = {
 #define literal_tokens_count                                                   \
   (sizeof(literal_tokens) / sizeof(literal_tokens[0]))
 
-const char *keywords[] = {
+static const char *c_keywords_words[] = {
     "auto",          "break",
     "case",          "char",
     "const",         "continue",
@@ -76,150 +77,258 @@ const char *keywords[] = {
     "xor_eq",
 };
 
-#define keywords_count (sizeof(keywords) / sizeof(keywords[0]))
+static Keyword_Set c_keywords = KEYWORD_SET(c_keywords_words);
+
+// The kind of token a byte starts, looked up once per token
+typedef enum {
+  CHAR_START_INVALID = 0,
+  CHAR_START_SYMBOL,
+  CHAR_START_LITERAL,
+  CHAR_START_STRING,
+  CHAR_START_PREPROP,
+  CHAR_START_SLASH,
+} Char_Start;
+
+static bool char_tables_built = false;
+static uint8_t char_starts[256];
+static Token_Kind literal_kinds[256];
+
+static void lexer_build_char_tables(void) {
+  for (int x = 0; x < 256; ++x) {
+    if ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') || x == '_') {
+      char_starts[x] = CHAR_START_SYMBOL;
+    }
+  }
+
+  char_starts['"'] = CHAR_START_STRING;
+  char_starts['#'] = CHAR_START_PREPROP;
+  char_starts['/'] = CHAR_START_SLASH;
+  for (size_t i = 0; i < literal_tokens_count; ++i) {
+    assert(strlen(literal_tokens[i].text) == 1);
+    uint8_t x = (uint8_t)literal_tokens[i].text[0];
+    char_starts[x] = CHAR_START_LITERAL;
+    literal_kinds[x] = literal_tokens[i].kind;
+  }
+
+  char_tables_built = true;
+}
+
+void lexer_init(void) {
+  if (!c_keywords.built) {
+    keyword_set_build(&c_keywords);
+  }
+  if (!char_tables_built) {
+    lexer_build_char_tables();
+  }
+  lexer_scan_init();
+}
+
+Lexer lexer_new(const Piece_Table *content) {
+  lexer_init();
 
-Lexer lexer_new(Free_Glyph_Atlas *atlas, const char *content,
-                size_t content_len) {
   Lexer l = {0};
   l.content = content;
-  l.content_len = content_len;
-  l.atlas = atlas;
+  l.content_len = piece_table_size(content);
+  l.keywords = &c_keywords;
 
   return l;
 }
 
-bool lexer_starts_with(Lexer *l, const char *prefix) {
-  size_t prefix_len = strlen(prefix);
-  if (prefix_len == 0) {
-    return true;
-  }
-  if (l->cursor + prefix_len - 1 >= l->content_len) {
-    return false;
+// Moves the lexer to the beginning of line `row`, which starts at offset
+// `line_begin` and is entered in `state`
+void lexer_seek(Lexer *l, size_t row, size_t line_begin, Lexer_State state) {
+  l->cursor = line_begin;
+  l->line = row;
+  l->bol = line_begin;
+  l->state = state;
+}
+
+static char lexer_char_at(Lexer *l, size_t pos) {
+  assert(pos < l->content_len);
+  if (pos < l->chunk_begin || pos >= l->chunk_end) {
+    l->chunk_begin = pos;
+    l->chunk_end = pos + piece_table_chunk(l->content, pos, &l->chunk);
   }
+  return l->chunk[pos - l->chunk_begin];
+}
 
-  for (size_t i = 0; i < prefix_len; ++i) {
-    if (prefix[i] != l->content[l->cursor + i]) {
-      return false;
+// Accounts for the byte `x` right before the cursor
+static void lexer_step(Lexer *l, char x) {
+  if (x == '\n') {
+    l->line += 1;
+    l->bol = l->cursor;
+    if (l->line_states) {
+      da_append(l->line_states, l->state);
     }
   }
-
-  return true;
 }
 
 void lexer_chop_chars(Lexer *l, size_t len) {
   for (size_t i = 0; i < len; ++i) {
     assert(l->cursor < l->content_len);
-    char x = l->content[l->cursor];
+    char x = lexer_char_at(l, l->cursor);
     l->cursor += 1;
-    if (x == '\n') {
+    lexer_step(l, x);
+  }
+}
+
+// Accounts for the `n` bytes of `text` right before the cursor
+static void lexer_step_run(Lexer *l, const char *text, size_t n) {
+  const char *end = text + n;
+  for (const char *p = text; p < end; ++p) {
+    if (*p == '\n') {
       l->line += 1;
-      l->bol = l->cursor;
-      l->x = 0;
-    } else {
-      if (l->atlas) {
-        size_t glyph_index = x;
-        if (glyph_index >= GLYPH_METRICS_CAPACITY) {
-          glyph_index = '?';
-        }
-        Glyph_Metric metric = l->atlas->metrics[glyph_index];
-        l->x += metric.ax;
+      l->bol = l->cursor - (size_t)(end - p - 1);
+      if (l->line_states) {
+        da_append(l->line_states, l->state);
       }
     }
   }
 }
 
-void lexer_trim_left(Lexer *l) {
-  while (l->cursor < l->content_len && isspace(l->content[l->cursor])) {
-    lexer_chop_chars(l, 1);
+// Consumes bytes for as long as they belong to `cls`
+static void lexer_chop_run(Lexer *l, Char_Class cls) {
+  while (l->cursor < l->content_len) {
+    lexer_char_at(l, l->cursor);
+    const char *text = l->chunk + (l->cursor - l->chunk_begin);
+    size_t n = lexer_scan(cls, text, l->chunk_end - l->cursor);
+    l->cursor += n;
+    if (cls == CHAR_SPACE) {
+      // The other classes never include '\n'
+      lexer_step_run(l, text, n);
+    }
+    if (l->cursor < l->chunk_end)
+      return;
   }
 }
 
-bool is_symbol_start(char x) { return isalpha(x) || x == '_'; }
+static bool lexer_next_is(Lexer *l, size_t offset, char x) {
+  return l->cursor + offset < l->content_len &&
+         lexer_char_at(l, l->cursor + offset) == x;
+}
 
-bool is_symbol(char x) { return isalnum(x) || x == '_'; }
+// Consumes the block comment up to and including its `*/`, or up to and
+// including the end of the current line, whichever comes first
+static void lexer_chop_block_comment(Lexer *l) {
+  while (l->cursor < l->content_len) {
+    lexer_chop_run(l, CHAR_COMMENT);
+    if (l->cursor >= l->content_len)
+      return;
+
+    if (lexer_next_is(l, 0, '*') && lexer_next_is(l, 1, '/')) {
+      lexer_chop_chars(l, 2);
+      l->state = LEXER_STATE_NORMAL;
+      return;
+    }
+
+    char x = lexer_char_at(l, l->cursor);
+    lexer_chop_chars(l, 1);
+    if (x == '\n') {
+      return;
+    }
+  }
+}
+
+// Consumes the rest of the line, including its '\n'
+static void lexer_chop_line(Lexer *l) {
+  lexer_chop_run(l, CHAR_LINE);
+  if (l->cursor < l->content_len) {
+    lexer_chop_chars(l, 1);
+  }
+}
 
 Token lexer_next(Lexer *l) {
-  lexer_trim_left(l);
+  if (l->state == LEXER_STATE_NORMAL) {
+    lexer_chop_run(l, CHAR_SPACE);
+  }
   Token token = {
-      .text = &l->content[l->cursor],
+      .offset = l->cursor,
   };
 
-  token.position.x = l->x;
-  token.position.y = -(float)l->line * FREE_GLYPH_FONT_SIZE;
-
   if (l->cursor >= l->content_len)
     return token;
 
-  if (l->content[l->cursor] == '"') {
+  if (l->state == LEXER_STATE_BLOCK_COMMENT) {
+    token.kind = TOKEN_BLOCK_COMMENT;
+    lexer_chop_block_comment(l);
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  uint8_t x = (uint8_t)lexer_char_at(l, l->cursor);
+  switch (char_starts[x]) {
+  case CHAR_START_STRING:
     // TODO: TOKEN_STRING should handle escape sequences
     token.kind = TOKEN_STRING;
     lexer_chop_chars(l, 1);
-    while (l->cursor < l->content_len && l->content[l->cursor] != '"' &&
-           l->content[l->cursor] != '\n') {
-      lexer_chop_chars(l, 1);
-    }
+    lexer_chop_run(l, CHAR_STRING);
     if (l->cursor < l->content_len) {
       lexer_chop_chars(l, 1);
     }
-    token.text_len = &l->content[l->cursor] - token.text;
-    return token;
-  }
+    break;
 
-  if (l->content[l->cursor] == '#') {
+  case CHAR_START_PREPROP:
     token.kind = TOKEN_PREPROP;
-    while (l->cursor < l->content_len && l->content[l->cursor] != '\n') {
-      lexer_chop_chars(l, 1);
-    }
-    if (l->cursor < l->content_len) {
-      lexer_chop_chars(l, 1);
-    }
-    token.text_len = &l->content[l->cursor] - token.text;
-    return token;
-  }
+    lexer_chop_line(l);
+    break;
 
-  if (lexer_starts_with(l, "//")) {
-    token.kind = TOKEN_SINGLE_COMMENT;
-    while (l->cursor < l->content_len && l->content[l->cursor] != '\n') {
-      lexer_chop_chars(l, 1);
-    }
-    if (l->cursor < l->content_len) {
+  case CHAR_START_SLASH:
+    if (lexer_next_is(l, 1, '/')) {
+      token.kind = TOKEN_SINGLE_COMMENT;
+      lexer_chop_line(l);
+    } else if (lexer_next_is(l, 1, '*')) {
+      token.kind = TOKEN_BLOCK_COMMENT;
+      l->state = LEXER_STATE_BLOCK_COMMENT;
+      lexer_chop_chars(l, 2);
+      lexer_chop_block_comment(l);
+    } else {
+      token.kind = TOKEN_INVALID;
       lexer_chop_chars(l, 1);
     }
-    token.text_len = &l->content[l->cursor] - token.text;
-    return token;
-  }
+    break;
 
-  for (size_t i = 0; i < literal_tokens_count; ++i) {
-    if (lexer_starts_with(l, literal_tokens[i].text)) {
-      size_t text_len = strlen(literal_tokens[i].text);
-      token.kind = literal_tokens[i].kind;
-      token.text_len = text_len;
-      lexer_chop_chars(l, text_len);
-      return token;
-    }
-  }
+  case CHAR_START_LITERAL:
+    token.kind = literal_kinds[x];
+    lexer_chop_chars(l, 1);
+    break;
 
-  if (is_symbol_start(l->content[l->cursor])) {
+  case CHAR_START_SYMBOL: {
     token.kind = TOKEN_SYMBOL;
-    while (l->cursor < l->content_len && is_symbol(l->content[l->cursor])) {
-      lexer_chop_chars(l, 1);
-      token.text_len += 1;
-    }
-    for (size_t i = 0; i < keywords_count; ++i) {
-      size_t keyword_len = strlen(keywords[i]);
-      if (keyword_len == token.text_len &&
-          memcmp(keywords[i], token.text, keyword_len) == 0) {
+    lexer_chop_run(l, CHAR_SYMBOL);
+
+    size_t text_len = l->cursor - token.offset;
+    if (text_len <= KEYWORD_MAX_LEN) {
+      const char *text = l->chunk + (token.offset - l->chunk_begin);
+      char buf[KEYWORD_MAX_LEN];
+      if (token.offset < l->chunk_begin) {
+        for (size_t i = 0; i < text_len; ++i) {
+          buf[i] = lexer_char_at(l, token.offset + i);
+        }
+        text = buf;
+      }
+      if (keyword_set_contains(l->keywords, text, text_len)) {
         token.kind = TOKEN_KEYWORD;
-        break;
       }
     }
-    return token;
-  }
+  } break;
 
-  lexer_chop_chars(l, 1);
-  token.kind = TOKEN_INVALID;
-  token.text_len = 1;
+  case CHAR_START_INVALID:
+  default:
+    token.kind = TOKEN_INVALID;
+    lexer_chop_chars(l, 1);
+    // The rest of a UTF-8 sequence stays with its lead byte, so the
+    // character is drawn whole
+    if (x >= 0xC0) {
+      for (size_t n = 1; n < 4 && l->cursor < l->content_len &&
+                         (lexer_char_at(l, l->cursor) & 0xC0) == 0x80;
+           ++n) {
+        lexer_chop_chars(l, 1);
+      }
+    }
+    break;
+  }
 
+  token.text_len = l->cursor - token.offset;
   return token;
 }
 
@@ -251,9 +360,109 @@ const char *token_kind_name(Token_Kind kind) {
     return "keyword";
   case TOKEN_SINGLE_COMMENT:
     return "single line comment";
+  case TOKEN_BLOCK_COMMENT:
+    return "block comment";
+  case TOKEN_STRING:
+    return "string";
   default:
     UNREACHABLE("token_kind_name");
   }
 
   return NULL;
 }
+
+Token tokens_get(const Tokens *tokens, size_t i) {
+  assert(i < tokens->count);
+  Token token = {
+      .kind = tokens->kinds[i],
+      .offset = tokens->offsets[i],
+      .text_len = tokens->lens[i],
+  };
+  return token;
+}
+
+static void tokens_reserve(Tokens *tokens, size_t capacity) {
+  if (capacity <= tokens->capacity)
+    return;
+
+  if (tokens->capacity == 0)
+    tokens->capacity = DA_INIT_CAP;
+  while (tokens->capacity < capacity)
+    tokens->capacity *= 2;
+
+  tokens->offsets = realloc(tokens->offsets,
+                            tokens->capacity * sizeof(*tokens->offsets));
+  tokens->lens =
+      realloc(tokens->lens, tokens->capacity * sizeof(*tokens->lens));
+  tokens->kinds =
+      realloc(tokens->kinds, tokens->capacity * sizeof(*tokens->kinds));
+  assert(tokens->offsets != NULL && tokens->lens != NULL &&
+         tokens->kinds != NULL && "Buy more RAM lol");
+}
+
+void tokens_append(Tokens *tokens, Token token) {
+  assert(token.offset + token.text_len <= UINT32_MAX);
+  do {
+    size_t len = token.text_len;
+    if (len > UINT16_MAX)
+      len = UINT16_MAX;
+
+    tokens_reserve(tokens, tokens->count + 1);
+    tokens->offsets[tokens->count] = (uint32_t)token.offset;
+    tokens->lens[tokens->count] = (uint16_t)len;
+    tokens->kinds[tokens->count] = (uint8_t)token.kind;
+    tokens->count += 1;
+
+    token.offset += len;
+    token.text_len -= len;
+  } while (token.text_len > 0);
+}
+
+void tokens_append_range(Tokens *dst, const Tokens *src, size_t begin,
+                         size_t end) {
+  Tokens with = {
+      .offsets = src->offsets + begin,
+      .lens = src->lens + begin,
+      .kinds = src->kinds + begin,
+      .count = end - begin,
+  };
+  tokens_replace(dst, dst->count, dst->count, &with);
+}
+
+void tokens_replace(Tokens *tokens, size_t begin, size_t end,
+                    const Tokens *with) {
+  assert(begin <= end && end <= tokens->count);
+  size_t tail = tokens->count - end;
+  size_t count = begin + with->count + tail;
+  tokens_reserve(tokens, count);
+
+  size_t moved = begin + with->count;
+  if (tail > 0) {
+    memmove(&tokens->offsets[moved], &tokens->offsets[end],
+            tail * sizeof(*tokens->offsets));
+    memmove(&tokens->lens[moved], &tokens->lens[end],
+            tail * sizeof(*tokens->lens));
+    memmove(&tokens->kinds[moved], &tokens->kinds[end],
+            tail * sizeof(*tokens->kinds));
+  }
+  if (with->count > 0) {
+    memcpy(&tokens->offsets[begin], with->offsets,
+           with->count * sizeof(*tokens->offsets));
+    memcpy(&tokens->lens[begin], with->lens,
+           with->count * sizeof(*tokens->lens));
+    memcpy(&tokens->kinds[begin], with->kinds,
+           with->count * sizeof(*tokens->kinds));
+  }
+  tokens->count = count;
+}
+
+void tokens_free(Tokens *tokens) {
+  free(tokens->offsets);
+  free(tokens->lens);
+  free(tokens->kinds);
+  tokens->offsets = NULL;
+  tokens->lens = NULL;
+  tokens->kinds = NULL;
+  tokens->count = 0;
+  tokens->capacity = 0;
+}
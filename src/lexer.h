@@ -1,8 +1,9 @@
 #ifndef __NIJI_LEXER_H
 #define __NIJI_LEXER_H
 
-#include "la.h"
-#include "free_glyph.h"
+#include "keyword_set.h"
+#include "piece_table.h"
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef enum {
@@ -21,6 +22,7 @@ typedef enum {
   TOKEN_SEMICOLON,
   TOKEN_KEYWORD,
   TOKEN_SINGLE_COMMENT,
+  TOKEN_BLOCK_COMMENT,
   TOKEN_STRING,
     
   COUNT_TOKENS,
@@ -34,24 +36,75 @@ typedef enum {
 
 typedef struct {
   Token_Kind kind;
-  const char *text;
+  size_t offset;
   size_t text_len;
-  Vec2f position;
 } Token;
 
+// Tokens are stored as a struct of arrays, 7 bytes per token. Tokens longer
+// than UINT16_MAX bytes are stored as several consecutive ones of the same
+// kind. Where a token ends up on the screen is not part of it: that is
+// worked out when the visible lines are laid out for rendering.
 typedef struct {
-  Free_Glyph_Atlas *atlas;
-  
-  const char *content;
+  uint32_t *offsets;
+  uint16_t *lens;
+  uint8_t *kinds;
+  size_t count;
+  size_t capacity;
+} Tokens;
+
+// What the lexer is in the middle of when it crosses a line boundary.
+// Together with the text of a line this fully determines the tokens of that
+// line, because no token ever spans more than one line (a block comment is
+// emitted as one TOKEN_BLOCK_COMMENT per line it covers).
+typedef enum {
+  LEXER_STATE_NORMAL = 0,
+  LEXER_STATE_BLOCK_COMMENT,
+  COUNT_LEXER_STATES,
+} Lexer_State;
+
+typedef struct {
+  Lexer_State *items;
+  size_t count;
+  size_t capacity;
+} Lexer_States;
+
+typedef struct {
+  // Symbols in this set are emitted as TOKEN_KEYWORD
+  const Keyword_Set *keywords;
+
+  const Piece_Table *content;
   size_t content_len;
   size_t cursor;
   size_t line;
   size_t bol;
-  float x;
+
+  Lexer_State state;
+  // If not NULL, the state of the lexer is appended here every time it
+  // enters a new line
+  Lexer_States *line_states;
+
+  // The piece of content the cursor was last in
+  const char *chunk;
+  size_t chunk_begin;
+  size_t chunk_end;
 } Lexer;
 
-Lexer lexer_new(Free_Glyph_Atlas *atlas, const char *content, size_t content_len);
+// Builds the tables shared by every lexer. lexer_new() does it on first use;
+// call it up front before lexing from more than one thread.
+void lexer_init(void);
+Lexer lexer_new(const Piece_Table *content);
+void lexer_seek(Lexer *l, size_t row, size_t line_begin, Lexer_State state);
 Token lexer_next(Lexer *l);
 
 const char *token_kind_name(Token_Kind kind);
+
+Token tokens_get(const Tokens *tokens, size_t i);
+void tokens_append(Tokens *tokens, Token token);
+// Appends tokens[begin..end) of `src`
+void tokens_append_range(Tokens *dst, const Tokens *src, size_t begin,
+                         size_t end);
+// Replaces tokens[begin..end) with all of `with`
+void tokens_replace(Tokens *tokens, size_t begin, size_t end,
+                    const Tokens *with);
+void tokens_free(Tokens *tokens);
 #endif // __NIJI_LEXER_H
@@ -0,0 +1,284 @@
+#include "lexer_scan.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LEXER_SCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LEXER_SCAN_AVX2_TARGET
+#else
+#define LEXER_SCAN_AVX2_TARGET __attribute__((target("avx2")))
+#endif // _MSC_VER
+#endif // __x86_64__ || _M_X64
+
+typedef size_t (*Lexer_Scan_Fn)(Char_Class cls, const char *text, size_t len);
+
+static uint8_t char_classes[256];
+static bool scan_initialized = false;
+static Lexer_Scan_Impl scan_impl = LEXER_SCAN_SCALAR;
+static Lexer_Scan_Fn scan_fn = NULL;
+
+static size_t scan_scalar(Char_Class cls, const char *text, size_t len) {
+  if (cls == CHAR_LINE) {
+    const char *nl = memchr(text, '\n', len);
+    return nl != NULL ? (size_t)(nl - text) : len;
+  }
+
+  size_t i = 0;
+  while (i < len && (char_classes[(uint8_t)text[i]] & cls)) {
+    i += 1;
+  }
+  return i;
+}
+
+#ifdef LEXER_SCAN_X86
+
+static unsigned scan_ctz(uint32_t x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return (unsigned)index;
+#else
+  return (unsigned)__builtin_ctz(x);
+#endif // _MSC_VER
+}
+
+// Bytes of `v` in [lo, hi], as 0xff lanes
+static __m128i sse2_in_range(__m128i v, char lo, char hi) {
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  __m128i k = _mm_set1_epi8((char)(hi - lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(t, k), t);
+}
+
+// A bit set for every byte of `v` that ends a run of class `cls`
+static uint32_t sse2_stops(Char_Class cls, __m128i v) {
+  __m128i in;
+  switch (cls) {
+  case CHAR_SPACE:
+    in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                      sse2_in_range(v, '\t', '\r'));
+    return ~(uint32_t)_mm_movemask_epi8(in) & 0xffff;
+  case CHAR_SYMBOL:
+    in = _mm_or_si128(
+        sse2_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'),
+        _mm_or_si128(sse2_in_range(v, '0', '9'),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+    return ~(uint32_t)_mm_movemask_epi8(in) & 0xffff;
+  case CHAR_LINE:
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  case CHAR_STRING:
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))));
+  case CHAR_COMMENT:
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('*'))));
+  default:
+    assert(0 && "unreachable");
+    return 1;
+  }
+}
+
+#define SCAN_SSE2_LOOP(cls)                                                    \
+  for (; i + 16 <= len; i += 16) {                                             \
+    __m128i v = _mm_loadu_si128((const __m128i *)(text + i));                  \
+    uint32_t stops = sse2_stops(cls, v);                                       \
+    if (stops != 0)                                                            \
+      return i + scan_ctz(stops);                                              \
+  }
+
+static size_t scan_sse2(Char_Class cls, const char *text, size_t len) {
+  // One loop per class, so that the class is a constant inside of it
+  size_t i = 0;
+  switch (cls) {
+  case CHAR_SPACE:
+    SCAN_SSE2_LOOP(CHAR_SPACE);
+    break;
+  case CHAR_SYMBOL:
+    SCAN_SSE2_LOOP(CHAR_SYMBOL);
+    break;
+  case CHAR_LINE:
+    SCAN_SSE2_LOOP(CHAR_LINE);
+    break;
+  case CHAR_STRING:
+    SCAN_SSE2_LOOP(CHAR_STRING);
+    break;
+  case CHAR_COMMENT:
+    SCAN_SSE2_LOOP(CHAR_COMMENT);
+    break;
+  }
+  return i + scan_scalar(cls, text + i, len - i);
+}
+
+LEXER_SCAN_AVX2_TARGET
+static __m256i avx2_in_range(__m256i v, char lo, char hi) {
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+  __m256i k = _mm256_set1_epi8((char)(hi - lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(t, k), t);
+}
+
+LEXER_SCAN_AVX2_TARGET
+static uint32_t avx2_stops(Char_Class cls, __m256i v) {
+  __m256i in;
+  switch (cls) {
+  case CHAR_SPACE:
+    in = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                         avx2_in_range(v, '\t', '\r'));
+    return ~(uint32_t)_mm256_movemask_epi8(in);
+  case CHAR_SYMBOL:
+    in = _mm256_or_si256(
+        avx2_in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'),
+        _mm256_or_si256(avx2_in_range(v, '0', '9'),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+    return ~(uint32_t)_mm256_movemask_epi8(in);
+  case CHAR_LINE:
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  case CHAR_STRING:
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))));
+  case CHAR_COMMENT:
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*'))));
+  default:
+    assert(0 && "unreachable");
+    return 1;
+  }
+}
+
+#define SCAN_AVX2_LOOP(cls)                                                    \
+  for (; i + 32 <= len; i += 32) {                                             \
+    __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));               \
+    uint32_t stops = avx2_stops(cls, v);                                       \
+    if (stops != 0)                                                            \
+      return i + scan_ctz(stops);                                              \
+  }
+
+LEXER_SCAN_AVX2_TARGET
+static size_t scan_avx2(Char_Class cls, const char *text, size_t len) {
+  size_t i = 0;
+  switch (cls) {
+  case CHAR_SPACE:
+    SCAN_AVX2_LOOP(CHAR_SPACE);
+    break;
+  case CHAR_SYMBOL:
+    SCAN_AVX2_LOOP(CHAR_SYMBOL);
+    break;
+  case CHAR_LINE:
+    SCAN_AVX2_LOOP(CHAR_LINE);
+    break;
+  case CHAR_STRING:
+    SCAN_AVX2_LOOP(CHAR_STRING);
+    break;
+  case CHAR_COMMENT:
+    SCAN_AVX2_LOOP(CHAR_COMMENT);
+    break;
+  }
+  return i + scan_sse2(cls, text + i, len - i);
+}
+
+static bool cpu_has_avx2(void) {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!osxsave || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif // _MSC_VER
+}
+
+#endif // LEXER_SCAN_X86
+
+static void lexer_scan_build_classes(void) {
+  for (int x = 0; x < 256; ++x) {
+    uint8_t classes = CHAR_LINE | CHAR_STRING | CHAR_COMMENT;
+    if (x == ' ' || (x >= '\t' && x <= '\r')) {
+      classes |= CHAR_SPACE;
+    }
+    if ((x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') ||
+        (x >= '0' && x <= '9') || x == '_') {
+      classes |= CHAR_SYMBOL;
+    }
+    char_classes[x] = classes;
+  }
+
+  char_classes['\n'] &= ~(CHAR_LINE | CHAR_STRING | CHAR_COMMENT);
+  char_classes['"'] &= ~CHAR_STRING;
+  char_classes['*'] &= ~CHAR_COMMENT;
+}
+
+void lexer_scan_init(void) {
+  if (scan_initialized)
+    return;
+
+  lexer_scan_build_classes();
+  scan_initialized = true;
+
+  if (!lexer_scan_select(LEXER_SCAN_AVX2) &&
+      !lexer_scan_select(LEXER_SCAN_SSE2)) {
+    lexer_scan_select(LEXER_SCAN_SCALAR);
+  }
+}
+
+bool lexer_scan_select(Lexer_Scan_Impl impl) {
+  lexer_scan_init();
+
+  switch (impl) {
+  case LEXER_SCAN_SCALAR:
+    scan_fn = scan_scalar;
+    break;
+#ifdef LEXER_SCAN_X86
+  case LEXER_SCAN_SSE2:
+    scan_fn = scan_sse2;
+    break;
+  case LEXER_SCAN_AVX2:
+    if (!cpu_has_avx2())
+      return false;
+    scan_fn = scan_avx2;
+    break;
+#endif // LEXER_SCAN_X86
+  default:
+    return false;
+  }
+
+  scan_impl = impl;
+  return true;
+}
+
+Lexer_Scan_Impl lexer_scan_selected(void) { return scan_impl; }
+
+const char *lexer_scan_impl_name(Lexer_Scan_Impl impl) {
+  switch (impl) {
+  case LEXER_SCAN_SCALAR:
+    return "scalar";
+  case LEXER_SCAN_SSE2:
+    return "sse2";
+  case LEXER_SCAN_AVX2:
+    return "avx2";
+  default:
+    return "unknown";
+  }
+}
+
+size_t lexer_scan(Char_Class cls, const char *text, size_t len) {
+  // Most runs between two tokens are zero or one byte long, which the table
+  // answers quicker than setting up a vector would
+  if (len == 0 || !(char_classes[(uint8_t)text[0]] & cls))
+    return 0;
+  if (len == 1 || !(char_classes[(uint8_t)text[1]] & cls))
+    return 1;
+  return 2 + scan_fn(cls, text + 2, len - 2);
+}
@@ -0,0 +1,40 @@
+#ifndef __NIJI_LEXER_SCAN_H
+#define __NIJI_LEXER_SCAN_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Finding where a run of bytes of the same class ends (whitespace, the rest
+// of an identifier, the body of a comment or a string) is where the lexer
+// spends its time, so it is done 16 or 32 bytes at a time where the CPU
+// allows it. The implementation is picked at runtime, with a table-driven
+// scalar one to fall back to.
+
+// The runs a byte can be part of
+typedef enum {
+  CHAR_SPACE = 1 << 0,
+  CHAR_SYMBOL = 1 << 1,
+  CHAR_LINE = 1 << 2,    // anything but '\n'
+  CHAR_STRING = 1 << 3,  // anything but '"' and '\n'
+  CHAR_COMMENT = 1 << 4, // anything but '*' and '\n'
+} Char_Class;
+
+typedef enum {
+  LEXER_SCAN_SCALAR = 0,
+  LEXER_SCAN_SSE2,
+  LEXER_SCAN_AVX2,
+  COUNT_LEXER_SCANS,
+} Lexer_Scan_Impl;
+
+// Picks the fastest implementation the CPU supports, unless one was
+// selected already
+void lexer_scan_init(void);
+// Returns false if the CPU (or the build) does not support `impl`
+bool lexer_scan_select(Lexer_Scan_Impl impl);
+Lexer_Scan_Impl lexer_scan_selected(void);
+const char *lexer_scan_impl_name(Lexer_Scan_Impl impl);
+
+// Length of the longest prefix of `text` made of bytes of class `cls`
+size_t lexer_scan(Char_Class cls, const char *text, size_t len);
+
+#endif // __NIJI_LEXER_SCAN_H
@@ -43,6 +43,17 @@ static Simple_Renderer sr = {0};
 static Editor editor = {0};
 static File_Browser fb = {0};
 
+// Text typed since the last key that is not plain text, inserted into the
+// editor in one go
+static String_Builder typed = {0};
+
+static void flush_typed(void) {
+  if (typed.count > 0) {
+    editor_insert_buf(&editor, typed.items, typed.count);
+    typed.count = 0;
+  }
+}
+
 // TODO: display errors reported via flash_error right into the text editor
 #define flash_error(...)                                                       \
   do {                                                                         \
@@ -155,19 +166,67 @@ int main(int argc, char **argv) {
 
   Vec4f bg_color = hex_to_vec4f(0x181818ff);
 
-  free_glyph_atlas_init(&atlas, face);
-
-  simple_renderer_init(&sr);
+  {
+    // The atlas is rendered once per font and size and the shaders are
+    // linked once per driver, later starts take them from the cache
+    String_Builder atlas_cache_filepath = {0};
+    String_Builder program_cache_filepath = {0};
+    char *pref_path = SDL_GetPrefPath("niji", "niji");
+    if (pref_path != NULL) {
+      sb_append_cstr(&atlas_cache_filepath, pref_path);
+      sb_append_cstr(&atlas_cache_filepath, "glyph_atlas.cache");
+      sb_append_null(&atlas_cache_filepath);
+      sb_append_cstr(&program_cache_filepath, pref_path);
+      sb_append_cstr(&program_cache_filepath, "programs.cache");
+      sb_append_null(&program_cache_filepath);
+      SDL_free(pref_path);
+    } else {
+      fprintf(stderr, "WARNING: Could not find where to keep caches: %s\n",
+              SDL_GetError());
+    }
+    free_glyph_atlas_init(&atlas, face, font_filepath,
+                          atlas_cache_filepath.items);
+    simple_renderer_init(&sr, program_cache_filepath.items);
+    free(atlas_cache_filepath.items);
+    free(program_cache_filepath.items);
+  }
 
   editor.atlas = &atlas;
-  editor_retokenize(&editor);
 
   bool quit = false;
   bool file_browser = false;
+  // Something changed since the last frame, or is still animating
+  bool redraw = true;
+  Uint32 last_frame = 0;
+  // When the cursor blinks next
+  Uint32 blink_deadline = 0;
+  // Everything typed between two frames is one edit, so the tokens are
+  // brought up to date at most once per frame
+  editor_begin_edit(&editor);
   while (!quit) {
-    const Uint32 start = SDL_GetTicks();
+    // Sleep until an event comes in, the cursor blinks or, if there is
+    // something to draw, the next frame is due
+    const Uint32 frame_ms = 1000 / FPS;
+    Uint32 now = SDL_GetTicks();
+    Uint32 timeout = blink_deadline - now;
+    if ((Sint32)timeout < 0) {
+      timeout = 0;
+    }
+    if (redraw) {
+      Uint32 since = now - last_frame;
+      Uint32 frame_timeout = since < frame_ms ? frame_ms - since : 0;
+      if (timeout > frame_timeout) {
+        timeout = frame_timeout;
+      }
+    }
+
     SDL_Event event = {0};
-    while (SDL_PollEvent(&event)) {
+    int has_event = SDL_WaitEventTimeout(&event, (int)timeout);
+    while (has_event) {
+      if (event.type != SDL_MOUSEMOTION) {
+        redraw = true;
+      }
+
       switch (event.type) {
       case SDL_QUIT: {
         quit = true;
@@ -236,6 +295,7 @@ int main(int argc, char **argv) {
           } break;
           }
         } else {
+          flush_typed();
           switch (event.key.keysym.sym) {
           case SDLK_F2: {
             if (editor.filepath.count > 0) {
@@ -253,6 +313,10 @@ int main(int argc, char **argv) {
             file_browser = true;
           } break;
 
+          case SDLK_F4: {
+            editor_toggle_wrap(&editor);
+          } break;
+
           case SDLK_F5: {
             simple_renderer_reload_shaders(&sr);
           } break;
@@ -296,14 +360,14 @@ int main(int argc, char **argv) {
             } else {
               editor_update_selection(&editor,
                                       event.key.keysym.mod & KMOD_SHIFT);
-              editor_insert_char(&editor, '\n');
+              da_append(&typed, '\n');
             }
           } break;
 
           case SDLK_TAB: {
             editor_update_selection(&editor, event.key.keysym.mod & KMOD_SHIFT);
             for (int i = 0; i < TAB_SIZE; ++i) {
-              editor_insert_char(&editor, ' ');
+              da_append(&typed, ' ');
             }
           } break;
 
@@ -317,7 +381,7 @@ int main(int argc, char **argv) {
             if (event.key.keysym.mod & KMOD_CTRL) {
               editor.selection = true;
               editor.sel_begin = 0;
-              editor.cursor = editor.data.count;
+              editor.cursor = piece_table_size(&editor.data);
             }
           } break;
 
@@ -377,37 +441,44 @@ int main(int argc, char **argv) {
       case SDL_TEXTINPUT: {
         if (file_browser) {
         } else {
-          const char *text = event.text.text;
-          size_t text_len = strlen(text);
-          for (size_t i = 0; i < text_len; ++i) {
-            editor_insert_char(&editor, text[i]);
-          }
+          sb_append_cstr(&typed, event.text.text);
         }
       } break;
 
       case SDL_MOUSEBUTTONDOWN: {
-        // TODO OR NEVER: Mouse is utterly broken
-
-        //   Vec2f mouse_click = vec2f((float)event.button.x,
-        //   (float)event.button.y); switch (event.button.button) { case
-        //   SDL_BUTTON_LEFT: {
-        //     Vec2f cursor_click = vec2f_add(
-        //         mouse_click, vec2f_sub(camera_pos,
-        //         vec2f_div(window_size(window),
-        //                                                      vec2fs(2.0f))));
-        //     if (cursor_click.x > 0.0f && cursor_click.y > 0.0f) {
-        //       editor.cursor_row = (size_t)fmax(
-        //           floorf(cursor_click.y / ((float)FONT_CHAR_HEIGHT *
-        //           FONT_SCALE)), editor.size);
-        //       editor.cursor_col = (size_t)fmax(
-        //           floorf(cursor_click.x / ((float)FONT_CHAR_WIDTH *
-        //           FONT_SCALE)), editor.lines[editor.cursor_row].size);
-        //     }
-        //   } break;
-        //   }
+        if (!file_browser && event.button.button == SDL_BUTTON_LEFT) {
+          // From the window, y pointing down, to around the camera
+          int w, h;
+          SDL_GetWindowSize(window, &w, &h);
+          Vec2f point = vec2f(
+              sr.camera_pos.x +
+                  ((float)event.button.x - (float)w / 2) / sr.camera_scale,
+              sr.camera_pos.y -
+                  ((float)event.button.y - (float)h / 2) / sr.camera_scale);
+
+          flush_typed();
+          editor.last_stroke = SDL_GetTicks();
+          editor_update_selection(&editor, SDL_GetModState() & KMOD_SHIFT);
+          editor_move_to_point(&editor, point);
+        }
       } break;
       }
+
+      has_event = SDL_PollEvent(&event);
+    }
+
+    now = SDL_GetTicks();
+    if ((Sint32)(now - blink_deadline) >= 0) {
+      redraw = true;
     }
+    if (!redraw || now - last_frame < frame_ms) {
+      continue;
+    }
+    last_frame = now;
+
+    flush_typed();
+    editor_commit_edit(&editor);
+    simple_renderer_poll_shaders(&sr);
 
     glClearColor(bg_color.x, bg_color.y, bg_color.z, bg_color.w);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -426,11 +497,13 @@ int main(int argc, char **argv) {
 
     SDL_GL_SwapWindow(window);
 
-    const Uint32 duration = SDL_GetTicks() - start;
-    const Uint32 delta_time_ms = 1000 / FPS;
-    if (duration < delta_time_ms) {
-      SDL_Delay(delta_time_ms - duration);
-    }
+    // The file browser text is drawn with an animated shader, shaders being
+    // reloaded are picked up by the first frame after they are ready, and
+    // lines off screen are wrapped a bit every frame
+    redraw = file_browser || simple_renderer_camera_moving(&sr) ||
+             sr.building || editor_wrap_pending(&editor);
+    blink_deadline = SDL_GetTicks() + editor_cursor_blink_timeout(&editor);
+    editor_begin_edit(&editor);
   }
 
   SDL_Quit();
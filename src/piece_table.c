@@ -0,0 +1,491 @@
+#include "piece_table.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static void piece_table_ensure_nil(Piece_Table *pt) {
+  if (pt->pieces.count == 0) {
+    // Index 0 is the nil piece. Its subtree_len is always 0 so the tree
+    // code never has to special case missing children.
+    da_append(&pt->pieces, (Piece){0});
+  }
+}
+
+static uint32_t piece_table_random(Piece_Table *pt) {
+  // xorshift32
+  uint32_t x = pt->seed ? pt->seed : 0x9E3779B9;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  pt->seed = x;
+  return x;
+}
+
+static const Newlines *piece_newlines(const Piece_Table *pt,
+                                      Piece_Source source) {
+  if (source == PIECE_ORIGINAL) {
+    return &pt->original_newlines;
+  }
+  return &pt->added_newlines;
+}
+
+// Index of the first line feed at or after buffer offset `offset`
+static size_t newlines_lower_bound(const Newlines *newlines, size_t offset) {
+  size_t lo = 0;
+  size_t hi = newlines->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (newlines->items[mid] < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static size_t newlines_count_in(const Newlines *newlines, size_t begin,
+                                size_t len) {
+  return newlines_lower_bound(newlines, begin + len) -
+         newlines_lower_bound(newlines, begin);
+}
+
+static void newlines_scan(Newlines *newlines, const char *buf, size_t offset,
+                          size_t len) {
+  const char *end = buf + len;
+  for (const char *p = buf; p < end && (p = memchr(p, '\n', end - p)); ++p) {
+    da_append(newlines, offset + (size_t)(p - buf));
+  }
+}
+
+static size_t piece_alloc(Piece_Table *pt, Piece_Source source, size_t begin,
+                          size_t len) {
+  size_t index;
+  if (pt->free.count > 0) {
+    // Freed subtrees are released lazily: only the root of a deleted subtree
+    // is put on the free list, and its children follow once it is reused.
+    // That keeps deletion of any range O(log n).
+    index = pt->free.items[--pt->free.count];
+    Piece old = pt->pieces.items[index];
+    if (old.left != PIECE_NIL)
+      da_append(&pt->free, old.left);
+    if (old.right != PIECE_NIL)
+      da_append(&pt->free, old.right);
+  } else {
+    da_append(&pt->pieces, (Piece){0});
+    index = pt->pieces.count - 1;
+  }
+
+  size_t lf = newlines_count_in(piece_newlines(pt, source), begin, len);
+  pt->pieces.items[index] = (Piece){
+      .source = source,
+      .begin = begin,
+      .len = len,
+      .lf = lf,
+      .left = PIECE_NIL,
+      .right = PIECE_NIL,
+      .priority = piece_table_random(pt),
+      .subtree_len = len,
+      .subtree_lf = lf,
+  };
+  return index;
+}
+
+static void piece_update(Piece_Table *pt, size_t t) {
+  Piece *p = &pt->pieces.items[t];
+  p->subtree_len = pt->pieces.items[p->left].subtree_len + p->len +
+                   pt->pieces.items[p->right].subtree_len;
+  p->subtree_lf = pt->pieces.items[p->left].subtree_lf + p->lf +
+                  pt->pieces.items[p->right].subtree_lf;
+}
+
+static size_t piece_merge(Piece_Table *pt, size_t a, size_t b) {
+  if (a == PIECE_NIL)
+    return b;
+  if (b == PIECE_NIL)
+    return a;
+
+  if (pt->pieces.items[a].priority > pt->pieces.items[b].priority) {
+    size_t right = piece_merge(pt, pt->pieces.items[a].right, b);
+    pt->pieces.items[a].right = right;
+    piece_update(pt, a);
+    return a;
+  } else {
+    size_t left = piece_merge(pt, a, pt->pieces.items[b].left);
+    pt->pieces.items[b].left = left;
+    piece_update(pt, b);
+    return b;
+  }
+}
+
+// Splits the tree `t` so that `*l` holds the first `k` bytes of it and `*r`
+// the rest. A piece that straddles `k` is cut in two. May allocate, so no
+// pointers into pt->pieces are held across the recursive calls.
+static void piece_split(Piece_Table *pt, size_t t, size_t k, size_t *l,
+                        size_t *r) {
+  if (t == PIECE_NIL) {
+    *l = PIECE_NIL;
+    *r = PIECE_NIL;
+    return;
+  }
+
+  size_t left_len = pt->pieces.items[pt->pieces.items[t].left].subtree_len;
+  size_t len = pt->pieces.items[t].len;
+
+  if (k <= left_len) {
+    size_t ll, lr;
+    piece_split(pt, pt->pieces.items[t].left, k, &ll, &lr);
+    pt->pieces.items[t].left = lr;
+    piece_update(pt, t);
+    *l = ll;
+    *r = t;
+  } else if (k >= left_len + len) {
+    size_t rl, rr;
+    piece_split(pt, pt->pieces.items[t].right, k - left_len - len, &rl, &rr);
+    pt->pieces.items[t].right = rl;
+    piece_update(pt, t);
+    *l = t;
+    *r = rr;
+  } else {
+    size_t offset = k - left_len;
+    Piece p = pt->pieces.items[t];
+    size_t tail = piece_alloc(pt, p.source, p.begin + offset, p.len - offset);
+
+    pt->pieces.items[t].len = offset;
+    pt->pieces.items[t].lf = pt->pieces.items[t].lf - pt->pieces.items[tail].lf;
+    pt->pieces.items[t].right = PIECE_NIL;
+    piece_update(pt, t);
+
+    *l = t;
+    *r = piece_merge(pt, tail, p.right);
+  }
+}
+
+// Grows the last piece of `t` by `n` bytes holding `lf` line feeds if it ends
+// exactly where the added buffer used to end, so typing a run of characters
+// keeps a single piece.
+static bool piece_extend_last(Piece_Table *pt, size_t t, size_t added_end,
+                              size_t n, size_t lf) {
+  if (t == PIECE_NIL)
+    return false;
+
+  bool extended;
+  size_t right = pt->pieces.items[t].right;
+  if (right != PIECE_NIL) {
+    extended = piece_extend_last(pt, right, added_end, n, lf);
+  } else {
+    Piece *p = &pt->pieces.items[t];
+    extended = p->source == PIECE_ADDED && p->begin + p->len == added_end;
+    if (extended) {
+      p->len += n;
+      p->lf += lf;
+    }
+  }
+
+  if (extended)
+    piece_update(pt, t);
+  return extended;
+}
+
+static size_t piece_find(const Piece_Table *pt, size_t pos, size_t *offset) {
+  size_t t = pt->root;
+  while (t != PIECE_NIL) {
+    const Piece *p = &pt->pieces.items[t];
+    size_t left_len = pt->pieces.items[p->left].subtree_len;
+    if (pos < left_len) {
+      t = p->left;
+    } else if (pos < left_len + p->len) {
+      *offset = pos - left_len;
+      return t;
+    } else {
+      pos -= left_len + p->len;
+      t = p->right;
+    }
+  }
+  return PIECE_NIL;
+}
+
+static const char *piece_data(const Piece_Table *pt, const Piece *p) {
+  if (p->source == PIECE_ORIGINAL) {
+    return pt->original.items + p->begin;
+  }
+  return pt->added.items + p->begin;
+}
+
+// Sets the memory of `sb` aside if a snapshot may still read it, `sb` is
+// empty afterwards either way
+static void piece_table_retire(Piece_Table *pt, String_Builder *sb) {
+  if (pt->snapshots > 0 && sb->items != NULL) {
+    da_append(&pt->retired, sb->items);
+    sb->items = NULL;
+    sb->capacity = 0;
+  }
+  sb->count = 0;
+}
+
+void piece_table_reset(Piece_Table *pt) {
+  piece_table_retire(pt, &pt->original);
+  piece_table_retire(pt, &pt->added);
+  pt->original.count = 0;
+  pt->added.count = 0;
+  pt->original_newlines.count = 0;
+  pt->added_newlines.count = 0;
+  pt->pieces.count = 0;
+  pt->free.count = 0;
+  pt->root = PIECE_NIL;
+  piece_table_ensure_nil(pt);
+}
+
+// Makes the whole original buffer the text of the document
+static void piece_table_index_original(Piece_Table *pt) {
+  newlines_scan(&pt->original_newlines, pt->original.items, 0,
+                pt->original.count);
+  if (pt->original.count > 0) {
+    pt->root = piece_alloc(pt, PIECE_ORIGINAL, 0, pt->original.count);
+  }
+}
+
+Errno piece_table_load_from_file(Piece_Table *pt, const char *filepath) {
+  piece_table_reset(pt);
+
+  Errno err = read_entire_file(filepath, &pt->original);
+  if (err != 0)
+    return err;
+
+  piece_table_index_original(pt);
+  return 0;
+}
+
+void piece_table_load(Piece_Table *pt, const char *buf, size_t buf_len) {
+  piece_table_reset(pt);
+  sb_append_buf(&pt->original, buf, buf_len);
+  piece_table_index_original(pt);
+}
+
+Errno piece_table_save_to_file(const Piece_Table *pt, const char *filepath) {
+  Errno result = 0;
+  FILE *f = NULL;
+
+  f = fopen(filepath, "wb");
+  if (f == NULL)
+    return_defer(errno);
+
+  size_t size = piece_table_size(pt);
+  for (size_t pos = 0; pos < size;) {
+    const char *chunk;
+    size_t n = piece_table_chunk(pt, pos, &chunk);
+    fwrite(chunk, sizeof(char), n, f);
+    if (ferror(f))
+      return_defer(errno);
+    pos += n;
+  }
+
+defer:
+  if (f)
+    fclose(f);
+  return result;
+}
+
+size_t piece_table_size(const Piece_Table *pt) {
+  if (pt->root == PIECE_NIL)
+    return 0;
+  return pt->pieces.items[pt->root].subtree_len;
+}
+
+char piece_table_at(const Piece_Table *pt, size_t pos) {
+  assert(pos < piece_table_size(pt));
+  size_t offset = 0;
+  size_t t = piece_find(pt, pos, &offset);
+  return piece_data(pt, &pt->pieces.items[t])[offset];
+}
+
+// Returns how many bytes starting at `pos` are stored contiguously and points
+// `*chunk` at them. Returns 0 at the end of the text.
+size_t piece_table_chunk(const Piece_Table *pt, size_t pos,
+                         const char **chunk) {
+  if (pos >= piece_table_size(pt)) {
+    *chunk = NULL;
+    return 0;
+  }
+
+  size_t offset = 0;
+  size_t t = piece_find(pt, pos, &offset);
+  const Piece *p = &pt->pieces.items[t];
+  *chunk = piece_data(pt, p) + offset;
+  return p->len - offset;
+}
+
+void piece_table_read(const Piece_Table *pt, size_t begin, size_t len,
+                      String_Builder *sb) {
+  size_t size = piece_table_size(pt);
+  if (begin >= size)
+    return;
+  if (len > size - begin)
+    len = size - begin;
+
+  while (len > 0) {
+    const char *chunk;
+    size_t n = piece_table_chunk(pt, begin, &chunk);
+    if (n > len)
+      n = len;
+    sb_append_buf(sb, chunk, n);
+    begin += n;
+    len -= n;
+  }
+}
+
+// Returns a pointer to `len` contiguous bytes starting at `begin`. Points
+// straight into the piece buffers when the range does not cross a piece
+// boundary, otherwise the bytes are copied into `scratch`.
+const char *piece_table_span(const Piece_Table *pt, size_t begin, size_t len,
+                             String_Builder *scratch) {
+  if (len == 0)
+    return "";
+
+  const char *chunk;
+  size_t n = piece_table_chunk(pt, begin, &chunk);
+  if (n >= len)
+    return chunk;
+
+  scratch->count = 0;
+  piece_table_read(pt, begin, len, scratch);
+  return scratch->items;
+}
+
+void piece_table_insert(Piece_Table *pt, size_t pos, const char *buf,
+                        size_t buf_len) {
+  if (buf_len == 0)
+    return;
+  piece_table_ensure_nil(pt);
+
+  size_t size = piece_table_size(pt);
+  if (pos > size)
+    pos = size;
+
+  size_t added_end = pt->added.count;
+  size_t added_lf = pt->added_newlines.count;
+  if (pt->snapshots > 0 && added_end + buf_len > pt->added.capacity) {
+    // Grown into new memory, the old one is still read by a snapshot
+    String_Builder added = {0};
+    sb_append_buf(&added, pt->added.items, added_end);
+    piece_table_retire(pt, &pt->added);
+    pt->added = added;
+  }
+  sb_append_buf(&pt->added, buf, buf_len);
+  newlines_scan(&pt->added_newlines, buf, added_end, buf_len);
+  added_lf = pt->added_newlines.count - added_lf;
+
+  size_t l, r;
+  piece_split(pt, pt->root, pos, &l, &r);
+  if (!piece_extend_last(pt, l, added_end, buf_len, added_lf)) {
+    size_t n = piece_alloc(pt, PIECE_ADDED, added_end, buf_len);
+    l = piece_merge(pt, l, n);
+  }
+  pt->root = piece_merge(pt, l, r);
+}
+
+void piece_table_delete(Piece_Table *pt, size_t pos, size_t len) {
+  size_t size = piece_table_size(pt);
+  if (pos >= size || len == 0)
+    return;
+  if (len > size - pos)
+    len = size - pos;
+
+  size_t l, m, r;
+  piece_split(pt, pt->root, pos, &l, &m);
+  piece_split(pt, m, len, &m, &r);
+  if (m != PIECE_NIL)
+    da_append(&pt->free, m);
+  pt->root = piece_merge(pt, l, r);
+}
+
+size_t piece_table_lines_count(const Piece_Table *pt) {
+  if (pt->root == PIECE_NIL)
+    return 1;
+  return pt->pieces.items[pt->root].subtree_lf + 1;
+}
+
+// Row of the line containing `pos`, i.e. the number of line feeds before it
+size_t piece_table_row_of(const Piece_Table *pt, size_t pos) {
+  size_t row = 0;
+  size_t t = pt->root;
+  while (t != PIECE_NIL) {
+    const Piece *p = &pt->pieces.items[t];
+    const Piece *left = &pt->pieces.items[p->left];
+    if (pos < left->subtree_len) {
+      t = p->left;
+    } else if (pos < left->subtree_len + p->len) {
+      return row + left->subtree_lf +
+             newlines_count_in(piece_newlines(pt, p->source), p->begin,
+                               pos - left->subtree_len);
+    } else {
+      row += left->subtree_lf + p->lf;
+      pos -= left->subtree_len + p->len;
+      t = p->right;
+    }
+  }
+  return row;
+}
+
+size_t piece_table_line_begin(const Piece_Table *pt, size_t row) {
+  if (row == 0)
+    return 0;
+
+  // Looking for the offset right after the row-th line feed
+  size_t pos = 0;
+  size_t t = pt->root;
+  while (t != PIECE_NIL) {
+    const Piece *p = &pt->pieces.items[t];
+    const Piece *left = &pt->pieces.items[p->left];
+    if (row <= left->subtree_lf) {
+      t = p->left;
+    } else if (row <= left->subtree_lf + p->lf) {
+      const Newlines *newlines = piece_newlines(pt, p->source);
+      size_t index = newlines_lower_bound(newlines, p->begin) +
+                     (row - left->subtree_lf - 1);
+      return pos + left->subtree_len + (newlines->items[index] - p->begin) + 1;
+    } else {
+      row -= left->subtree_lf + p->lf;
+      pos += left->subtree_len + p->len;
+      t = p->right;
+    }
+  }
+  return piece_table_size(pt);
+}
+
+// Offset of the line feed terminating `row`, or the end of the text for the
+// last line
+size_t piece_table_line_end(const Piece_Table *pt, size_t row) {
+  if (row + 1 >= piece_table_lines_count(pt))
+    return piece_table_size(pt);
+  return piece_table_line_begin(pt, row + 1) - 1;
+}
+
+void piece_table_snapshot(Piece_Table *pt, Piece_Table *snapshot) {
+  snapshot->original = (String_Builder){
+      .items = pt->original.items,
+      .count = pt->original.count,
+  };
+  snapshot->added = (String_Builder){
+      .items = pt->added.items,
+      .count = pt->added.count,
+  };
+  snapshot->pieces.count = 0;
+  da_append_many(&snapshot->pieces, pt->pieces.items, pt->pieces.count);
+  snapshot->root = pt->root;
+  pt->snapshots += 1;
+}
+
+void piece_table_release(Piece_Table *pt) {
+  assert(pt->snapshots > 0);
+  pt->snapshots -= 1;
+  if (pt->snapshots > 0)
+    return;
+
+  for (size_t i = 0; i < pt->retired.count; ++i) {
+    free(pt->retired.items[i]);
+  }
+  pt->retired.count = 0;
+}
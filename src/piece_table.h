@@ -0,0 +1,119 @@
+#ifndef __NIJI_PIECE_TABLE_H
+#define __NIJI_PIECE_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+// The text of a document is described by a sequence of pieces, each one
+// pointing into either the original file contents (never modified after
+// loading) or the append-only buffer of added text. The pieces are kept in
+// a treap ordered by their position in the document, so locating, splitting
+// and joining pieces costs O(log n) in the number of pieces, independent of
+// how many bytes they cover.
+//
+// Every piece also knows how many line feeds it covers, which makes the
+// treap double as the line index of the document: offset -> row and
+// row -> offset are answered by the same O(log n) descent. The line feeds of
+// each buffer are recorded once, when the bytes enter the buffer, so the
+// count for any sub-range of a buffer is a binary search away.
+
+typedef enum {
+  PIECE_ORIGINAL = 0,
+  PIECE_ADDED,
+} Piece_Source;
+
+#define PIECE_NIL 0
+
+typedef struct {
+  Piece_Source source;
+  size_t begin;
+  size_t len;
+
+  size_t lf; // line feeds within [begin, begin + len)
+
+  size_t left;
+  size_t right;
+  uint32_t priority;
+
+  size_t subtree_len;
+  size_t subtree_lf;
+} Piece;
+
+typedef struct {
+  Piece *items;
+  size_t count;
+  size_t capacity;
+} Pieces;
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Piece_Indices;
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Newlines;
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+} Piece_Buffers;
+
+typedef struct {
+  String_Builder original;
+  String_Builder added;
+
+  // Sorted offsets of every '\n' in the corresponding buffer
+  Newlines original_newlines;
+  Newlines added_newlines;
+
+  Pieces pieces;
+  Piece_Indices free;
+  size_t root;
+  uint32_t seed;
+
+  // Snapshots taken and not released yet. While there are any, a buffer is
+  // never moved or written over: one that would be is set aside in
+  // `retired` until the last snapshot is released.
+  size_t snapshots;
+  Piece_Buffers retired;
+} Piece_Table;
+
+void piece_table_reset(Piece_Table *pt);
+Errno piece_table_load_from_file(Piece_Table *pt, const char *filepath);
+void piece_table_load(Piece_Table *pt, const char *buf, size_t buf_len);
+Errno piece_table_save_to_file(const Piece_Table *pt, const char *filepath);
+
+size_t piece_table_size(const Piece_Table *pt);
+char piece_table_at(const Piece_Table *pt, size_t pos);
+size_t piece_table_chunk(const Piece_Table *pt, size_t pos, const char **chunk);
+void piece_table_read(const Piece_Table *pt, size_t begin, size_t len,
+                      String_Builder *sb);
+const char *piece_table_span(const Piece_Table *pt, size_t begin, size_t len,
+                             String_Builder *scratch);
+
+size_t piece_table_lines_count(const Piece_Table *pt);
+size_t piece_table_row_of(const Piece_Table *pt, size_t pos);
+size_t piece_table_line_begin(const Piece_Table *pt, size_t row);
+size_t piece_table_line_end(const Piece_Table *pt, size_t row);
+
+void piece_table_insert(Piece_Table *pt, size_t pos, const char *buf,
+                        size_t buf_len);
+void piece_table_delete(Piece_Table *pt, size_t pos, size_t len);
+
+// Makes `snapshot` a read-only copy of the document for another thread to
+// read while `pt` goes on being edited. Only the pieces are copied, the text
+// is shared: the original buffer is never written to and the added one only
+// appended to. Just piece_table_size, _at, _chunk, _read and _span work on
+// the snapshot, and it is good until piece_table_release(pt).
+void piece_table_snapshot(Piece_Table *pt, Piece_Table *snapshot);
+void piece_table_release(Piece_Table *pt);
+
+#endif // __NIJI_PIECE_TABLE_H
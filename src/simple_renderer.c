@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,17 +16,26 @@
 #include "arena.h"
 #include "common.h"
 
-#define vert_shader_filepath "./shaders/simple.vert"
+static const char *shader_filepaths[COUNT_SIMPLE_SHADER_FILES] = {
+    [SIMPLE_SHADER_FILE_VERT] = "./shaders/simple.vert",
+    [SIMPLE_SHADER_FILE_GLYPH_VERT] = "./shaders/glyph.vert",
+    [SIMPLE_SHADER_FILE_FRAG] = "./shaders/simple.frag",
+};
 
-static_assert(COUNT_SIMPLE_SHADERS == 4,
-              "Simple shaders count does not match, please update");
-const char *frag_shader_filepaths[COUNT_SIMPLE_SHADERS] = {
-    [SHADER_COLOR] = "./shaders/simple_color.frag",
-    [SHADER_IMAGE] = "./shaders/simple_image.frag",
-    [SHADER_EPIC] = "./shaders/simple_epic.frag",
-    [SHADER_TEXT] = "./shaders/simple_text.frag",
+static const GLenum shader_types[COUNT_SIMPLE_SHADER_FILES] = {
+    [SIMPLE_SHADER_FILE_VERT] = GL_VERTEX_SHADER,
+    [SIMPLE_SHADER_FILE_GLYPH_VERT] = GL_VERTEX_SHADER,
+    [SIMPLE_SHADER_FILE_FRAG] = GL_FRAGMENT_SHADER,
 };
 
+static_assert(COUNT_SIMPLE_SHADERS <= 4,
+              "Simple_Vertex has room for 2 bits of shader");
+static_assert(COUNT_SIMPLE_SHADERS == 4,
+              "Simple shaders count does not match, please update "
+              "shaders/simple.frag");
+static_assert(sizeof(Simple_Globals) == 24,
+              "Simple_Globals does not match the std140 layout of Globals");
+
 static const char *shader_type_as_cstr(GLenum shader_type) {
   switch (shader_type) {
   case GL_VERTEX_SHADER:
@@ -37,73 +47,268 @@ static const char *shader_type_as_cstr(GLenum shader_type) {
   }
 }
 
-static bool compile_shader_source(const GLchar *source, GLenum shader_type,
-                                  GLuint *shader) {
-  *shader = glCreateShader(shader_type);
-  glShaderSource(*shader, 1, &source, NULL);
-  glCompileShader(*shader);
+static bool read_shader_sources(
+    String_Builder sources[COUNT_SIMPLE_SHADER_FILES]) {
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    sources[i].count = 0;
+    Errno err = read_entire_file(shader_filepaths[i], &sources[i]);
+    if (err != 0) {
+      fprintf(stderr, "ERROR: failed to load `%s` shader file: %s\n",
+              shader_filepaths[i], strerror(err));
+      return false;
+    }
+    sb_append_null(&sources[i]);
+  }
+  return true;
+}
 
-  GLint compiled = 0;
-  glGetShaderiv(*shader, GL_COMPILE_STATUS, &compiled);
+static void free_shader_sources(
+    String_Builder sources[COUNT_SIMPLE_SHADER_FILES]) {
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    free(sources[i].items);
+  }
+}
 
-  if (!compiled) {
-    GLchar message[1024];
-    GLsizei message_size = 0;
-    glGetShaderInfoLog(*shader, sizeof(message), &message_size, message);
-    fprintf(stderr, "ERROR: could not compile %s\n",
-            shader_type_as_cstr(shader_type));
-    fprintf(stderr, "%.*s\n", message_size, message);
-    return false;
+// What a program binary depends on: the sources it was built from and the
+// driver that built it
+static uint64_t program_binary_key(
+    const String_Builder sources[COUNT_SIMPLE_SHADER_FILES]) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    hash = fnv1a(hash, sources[i].items, sources[i].count);
+  }
+  const GLenum strings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); ++i) {
+    const char *string = (const char *)glGetString(strings[i]);
+    if (string != NULL) {
+      hash = fnv1a(hash, string, strlen(string) + 1);
+    }
+  }
+  return hash;
+}
+
+// Compiles the shaders and links them into programs: shaders/simple.frag
+// once with shaders/simple.vert into `program` and once with
+// shaders/glyph.vert into `glyph_program`. Nothing is checked here so that
+// with KHR_parallel_shader_compile none of it waits for the driver, see
+// program_build_done() and program_build_finish().
+static void program_build_start(
+    Simple_Program_Build *b,
+    const String_Builder sources[COUNT_SIMPLE_SHADER_FILES]) {
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    const GLchar *source = sources[i].items;
+    b->shaders[i] = glCreateShader(shader_types[i]);
+    glShaderSource(b->shaders[i], 1, &source, NULL);
+    glCompileShader(b->shaders[i]);
+  }
+
+  b->program = glCreateProgram();
+  glAttachShader(b->program, b->shaders[SIMPLE_SHADER_FILE_VERT]);
+  glAttachShader(b->program, b->shaders[SIMPLE_SHADER_FILE_FRAG]);
+
+  b->glyph_program = glCreateProgram();
+  glAttachShader(b->glyph_program, b->shaders[SIMPLE_SHADER_FILE_GLYPH_VERT]);
+  glAttachShader(b->glyph_program, b->shaders[SIMPLE_SHADER_FILE_FRAG]);
+
+  if (GLEW_ARB_get_program_binary) {
+    glProgramParameteri(b->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                        GL_TRUE);
+    glProgramParameteri(b->glyph_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                        GL_TRUE);
+  }
+  glLinkProgram(b->program);
+  glLinkProgram(b->glyph_program);
+}
+
+// Whether checking the outcome of the build would not block
+static bool program_build_done(const Simple_Program_Build *b) {
+  if (!GLEW_KHR_parallel_shader_compile)
+    return true;
+
+  GLint program_done = GL_FALSE;
+  GLint glyph_program_done = GL_FALSE;
+  glGetProgramiv(b->program, GL_COMPLETION_STATUS_KHR, &program_done);
+  glGetProgramiv(b->glyph_program, GL_COMPLETION_STATUS_KHR,
+                 &glyph_program_done);
+  return program_done && glyph_program_done;
+}
+
+static bool program_linked(GLuint program) {
+  GLint linked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  return linked;
+}
+
+// Reports what went wrong if anything did and lets go of the shaders. The
+// programs are deleted unless both linked.
+static bool program_build_finish(Simple_Program_Build *b) {
+  bool ok = true;
+
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    GLint compiled = 0;
+    glGetShaderiv(b->shaders[i], GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+      GLchar message[1024];
+      GLsizei message_size = 0;
+      glGetShaderInfoLog(b->shaders[i], sizeof(message), &message_size,
+                         message);
+      fprintf(stderr, "ERROR: could not compile %s `%s`\n",
+              shader_type_as_cstr(shader_types[i]), shader_filepaths[i]);
+      fprintf(stderr, "%.*s\n", message_size, message);
+      ok = false;
+    }
+  }
+
+  GLuint programs[] = {b->program, b->glyph_program};
+  for (size_t i = 0; ok && i < sizeof(programs) / sizeof(programs[0]); ++i) {
+    if (!program_linked(programs[i])) {
+      GLchar message[1024];
+      GLsizei message_size = 0;
+      glGetProgramInfoLog(programs[i], sizeof(message), &message_size,
+                          message);
+      fprintf(stderr, "ERROR: failed to link program: %.*s\n", message_size,
+              message);
+      ok = false;
+    }
+  }
+
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    glDeleteShader(b->shaders[i]);
+  }
+  if (!ok) {
+    glDeleteProgram(b->program);
+    glDeleteProgram(b->glyph_program);
+  }
+  return ok;
+}
+
+static void program_build_cancel(Simple_Program_Build *b) {
+  for (size_t i = 0; i < COUNT_SIMPLE_SHADER_FILES; ++i) {
+    glDeleteShader(b->shaders[i]);
   }
+  glDeleteProgram(b->program);
+  glDeleteProgram(b->glyph_program);
+}
+
+// Bumped whenever the layout of the program binary cache changes
+#define PROGRAM_CACHE_VERSION 1
+
+// The program binary cache file is this header followed by the binaries of
+// the program and the glyph program, each as its format, its size and the
+// bytes glGetProgramBinary gave
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t key;
+} Program_Cache_Header;
 
+static const char program_cache_magic[8] = "NIJIPROG";
+
+static bool program_binaries_supported(void) {
+  if (!GLEW_ARB_get_program_binary)
+    return false;
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+// Creates `program` from the binary at `*data` if the cache has one and
+// moves `*data` past it
+static bool program_binary_load(const char **data, const char *end,
+                                GLuint *program) {
+  uint32_t format_and_size[2];
+  if ((size_t)(end - *data) < sizeof(format_and_size))
+    return false;
+  memcpy(format_and_size, *data, sizeof(format_and_size));
+  *data += sizeof(format_and_size);
+  if ((size_t)(end - *data) < format_and_size[1])
+    return false;
+
+  *program = glCreateProgram();
+  glProgramBinary(*program, format_and_size[0], *data,
+                  (GLsizei)format_and_size[1]);
+  *data += format_and_size[1];
+  if (!program_linked(*program)) {
+    glDeleteProgram(*program);
+    return false;
+  }
   return true;
 }
 
-static bool compile_shader_file(const char *filepath, GLenum shader_type,
-                                GLuint *shader) {
-  bool result = true;
+// Takes both programs from the cache at `cache_filepath`, if it has them for
+// `key`. A driver update or edited shaders make for another key.
+static bool program_cache_load(const char *cache_filepath, uint64_t key,
+                               GLuint *program, GLuint *glyph_program) {
+  if (cache_filepath == NULL || !program_binaries_supported())
+    return false;
 
-  String_Builder source = {0};
-  Errno err = read_entire_file(filepath, &source);
-  if (err != 0) {
-    fprintf(stderr, "ERROR: failed to load `%s` shader file: %s\n", filepath,
-            strerror(err));
+  Mapped_File cache = {0};
+  if (map_entire_file(cache_filepath, &cache) != 0)
+    return false;
+
+  bool result = true;
+  Program_Cache_Header header;
+  if (cache.size < sizeof(header))
+    return_defer(false);
+  memcpy(&header, cache.data, sizeof(header));
+  if (memcmp(header.magic, program_cache_magic, sizeof(header.magic)) != 0 ||
+      header.version != PROGRAM_CACHE_VERSION ||
+      header.header_size != sizeof(header) || header.key != key)
     return_defer(false);
-  }
-  sb_append_null(&source);
 
-  if (!compile_shader_source(source.items, shader_type, shader)) {
-    fprintf(stderr, "ERROR: failed to compile `%s` shader file\n", filepath);
+  const char *data = cache.data + sizeof(header);
+  const char *end = cache.data + cache.size;
+  if (!program_binary_load(&data, end, program))
+    return_defer(false);
+  if (!program_binary_load(&data, end, glyph_program)) {
+    glDeleteProgram(*program);
     return_defer(false);
   }
+
 defer:
-  free(source.items);
+  unmap_entire_file(&cache);
   return result;
 }
 
-static void attach_shaders_to_program(GLuint *shaders, size_t shaders_count,
-                                      GLuint program) {
-  for (size_t i = 0; i < shaders_count; ++i) {
-    glAttachShader(program, shaders[i]);
-  }
+static void program_binary_append(String_Builder *sb, GLuint program) {
+  GLint size = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+
+  char *binary = malloc(size > 0 ? (size_t)size : 1);
+  assert(binary != NULL && "Buy more RAM lol");
+  GLsizei length = 0;
+  GLenum format = 0;
+  glGetProgramBinary(program, size, &length, &format, binary);
+
+  uint32_t format_and_size[2] = {format, (uint32_t)length};
+  sb_append_buf(sb, (const char *)format_and_size, sizeof(format_and_size));
+  sb_append_buf(sb, binary, (size_t)length);
+  free(binary);
 }
 
-static bool link_program(GLuint program, const char *filepath, size_t line) {
-  glLinkProgram(program);
+static void program_cache_save(const char *cache_filepath, uint64_t key,
+                               GLuint program, GLuint glyph_program) {
+  if (cache_filepath == NULL || !program_binaries_supported())
+    return;
 
-  GLint linked = 0;
-  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  Program_Cache_Header header = {0};
+  memcpy(header.magic, program_cache_magic, sizeof(header.magic));
+  header.version = PROGRAM_CACHE_VERSION;
+  header.header_size = sizeof(header);
+  header.key = key;
 
-  if (!linked) {
-    GLchar message[1024];
-    GLsizei message_size = 0;
+  String_Builder sb = {0};
+  sb_append_buf(&sb, (const char *)&header, sizeof(header));
+  program_binary_append(&sb, program);
+  program_binary_append(&sb, glyph_program);
 
-    glGetProgramInfoLog(program, sizeof(message), &message_size, message);
-    fprintf(stderr, "%s:%zu: ERROR: failed to link program: %.*s\n", filepath,
-            line, message_size, message);
+  Errno err = replace_entire_file(cache_filepath, sb.items, sb.count);
+  if (err != 0) {
+    fprintf(stderr, "WARNING: Could not save shader programs to `%s`: %s\n",
+            cache_filepath, strerror(err));
   }
-
-  return linked;
+  free(sb.items);
 }
 
 typedef struct {
@@ -112,44 +317,24 @@ typedef struct {
 } Uniform_Def;
 
 static const Uniform_Def uniform_defs[COUNT_UNIFORM_SLOTS] = {
-    [UNIFORM_SLOT_TIME] =
-        {
-            .slot = UNIFORM_SLOT_TIME,
-            .name = "time",
-        },
-    [UNIFORM_SLOT_RESOLUTION] =
-        {
-            .slot = UNIFORM_SLOT_RESOLUTION,
-            .name = "resolution",
-        },
-    [UNIFORM_SLOT_CAMERA_POS] =
-        {
-            .slot = UNIFORM_SLOT_CAMERA_POS,
-            .name = "camera_pos",
-        },
-    [UNIFORM_SLOT_CAMERA_SCALE] =
+    [UNIFORM_SLOT_GLYPH_RECTS] =
         {
-            .slot = UNIFORM_SLOT_CAMERA_SCALE,
-            .name = "camera_scale",
+            .slot = UNIFORM_SLOT_GLYPH_RECTS,
+            .name = "glyph_rects",
         },
-    [UNIFORM_SLOT_CURSOR_POS] =
+    [UNIFORM_SLOT_PALETTE] =
         {
-            .slot = UNIFORM_SLOT_CURSOR_POS,
-            .name = "cursor_pos",
+            .slot = UNIFORM_SLOT_PALETTE,
+            .name = "palette",
         },
-    [UNIFORM_SLOT_CURSOR_HEIGHT] =
+    [UNIFORM_SLOT_ORIGIN] =
         {
-            .slot = UNIFORM_SLOT_CURSOR_HEIGHT,
-            .name = "cursor_height",
-        },
-    [UNIFORM_SLOT_LAST_STROKE] =
-        {
-            .slot = UNIFORM_SLOT_LAST_STROKE,
-            .name = "last_stroke",
+            .slot = UNIFORM_SLOT_ORIGIN,
+            .name = "origin",
         },
 };
 
-static_assert(COUNT_UNIFORM_SLOTS == 7,
+static_assert(COUNT_UNIFORM_SLOTS == 3,
               "Uniform slots count have changed. Please update accordingly.");
 
 static void get_uniform_locations(GLuint program,
@@ -160,77 +345,265 @@ static void get_uniform_locations(GLuint program,
   }
 }
 
-void simple_renderer_init(Simple_Renderer *sr) {
+// Everything about a freshly linked program that does not change from one
+// draw to the next: the uniform block, the samplers and the uniform locations
+static void setup_program(GLuint program,
+                          GLint locations[COUNT_UNIFORM_SLOTS]) {
+  GLuint globals = glGetUniformBlockIndex(program, "Globals");
+  if (globals != GL_INVALID_INDEX) {
+    glUniformBlockBinding(program, globals, SIMPLE_GLOBALS_BINDING);
+  }
+
+  get_uniform_locations(program, locations);
+
+  glUseProgram(program);
+  glUniform1i(glGetUniformLocation(program, "image"), 0);
+  glUniform1i(locations[UNIFORM_SLOT_GLYPH_RECTS], SIMPLE_GLYPH_RECTS_UNIT);
+}
+
+static void simple_renderer_setup_programs(Simple_Renderer *sr) {
+  setup_program(sr->glyph_program, sr->glyph_uniforms);
+  setup_program(sr->program, sr->uniforms);
+}
+
+static void simple_ring_init(Simple_Ring *r, size_t item_size,
+                             size_t capacity) {
+  r->item_size = item_size;
+  r->capacity = capacity;
+
+  glGenBuffers(1, &r->buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, r->buffer);
+
+  if (GLEW_ARB_buffer_storage) {
+    GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr size = SIMPLE_RING_REGIONS * capacity * item_size;
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+    r->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    if (r->mapped != NULL)
+      return;
+
+    fprintf(stderr, "WARNING: could not map a vertex buffer persistently\n");
+    glDeleteBuffers(1, &r->buffer);
+    glGenBuffers(1, &r->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, r->buffer);
+  }
+
+  glBufferData(GL_ARRAY_BUFFER, capacity * item_size, NULL, GL_STREAM_DRAW);
+  r->staging = malloc(capacity * item_size);
+  assert(r->staging != NULL && "Buy more RAM lol");
+}
+
+// Makes the regions of `r` twice as big. The old buffer is deleted right
+// away, GL keeps it around for as long as draws already issued need it.
+static void simple_ring_grow(Simple_Ring *r) {
+  for (size_t i = 0; i < SIMPLE_RING_REGIONS; ++i) {
+    if (r->fences[i] != NULL) {
+      glDeleteSync(r->fences[i]);
+    }
+  }
+  if (r->mapped != NULL) {
+    glBindBuffer(GL_ARRAY_BUFFER, r->buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  glDeleteBuffers(1, &r->buffer);
+  free(r->staging);
+
+  size_t item_size = r->item_size;
+  size_t capacity = r->capacity * 2;
+  memset(r, 0, sizeof(*r));
+  simple_ring_init(r, item_size, capacity);
+}
+
+// Where the next batch goes and how many items it can take
+static void *simple_ring_batch(Simple_Ring *r, size_t *cap) {
+  if (r->mapped == NULL) {
+    *cap = r->capacity;
+    return r->staging;
+  }
+
+  // Rather than a run of tiny batches at the end of a region, move on
+  if (r->capacity - r->used < r->capacity / 8) {
+    r->fences[r->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    r->region = (r->region + 1) % SIMPLE_RING_REGIONS;
+    r->used = 0;
+
+    GLsync fence = r->fences[r->region];
+    if (fence != NULL) {
+      GLenum status = GL_TIMEOUT_EXPIRED;
+      while (status == GL_TIMEOUT_EXPIRED) {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  1000 * 1000 * 1000);
+      }
+      glDeleteSync(fence);
+      r->fences[r->region] = NULL;
+    }
+  }
+
+  *cap = r->capacity - r->used;
+  return (char *)r->mapped + (r->region * r->capacity + r->used) * r->item_size;
+}
+
+// Makes the `count` items of the batch visible to the GPU and returns their
+// offset in the buffer in bytes
+static size_t simple_ring_submit(Simple_Ring *r, size_t count) {
+  if (r->mapped == NULL) {
+    glBindBuffer(GL_ARRAY_BUFFER, r->buffer);
+    glBufferData(GL_ARRAY_BUFFER, r->capacity * r->item_size, NULL,
+                 GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * r->item_size, r->staging);
+    return 0;
+  }
+
+  size_t offset = (r->region * r->capacity + r->used) * r->item_size;
+  r->used += count;
+  return offset;
+}
+
+static void simple_renderer_vertex_attribs(size_t offset) {
+  glVertexAttribPointer(SIMPLE_VERTEX_ATTR_POSITION, 2, GL_FLOAT, GL_FALSE,
+                        sizeof(Simple_Vertex),
+                        (GLvoid *)(offset + offsetof(Simple_Vertex, position)));
+  glVertexAttribPointer(SIMPLE_VERTEX_ATTR_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+                        sizeof(Simple_Vertex),
+                        (GLvoid *)(offset + offsetof(Simple_Vertex, color)));
+  glVertexAttribIPointer(SIMPLE_VERTEX_ATTR_UV, 2, GL_UNSIGNED_SHORT,
+                         sizeof(Simple_Vertex),
+                         (GLvoid *)(offset + offsetof(Simple_Vertex, uv)));
+}
+
+static void simple_renderer_glyph_attribs(size_t offset) {
+  glVertexAttribPointer(SIMPLE_GLYPH_ATTR_POSITION, 2, GL_FLOAT, GL_FALSE,
+                        sizeof(Simple_Glyph),
+                        (GLvoid *)(offset + offsetof(Simple_Glyph, position)));
+  glVertexAttribIPointer(SIMPLE_GLYPH_ATTR_GLYPH, 1, GL_UNSIGNED_SHORT,
+                         sizeof(Simple_Glyph),
+                         (GLvoid *)(offset + offsetof(Simple_Glyph, glyph)));
+  glVertexAttribIPointer(SIMPLE_GLYPH_ATTR_COLOR, 1, GL_UNSIGNED_BYTE,
+                         sizeof(Simple_Glyph),
+                         (GLvoid *)(offset + offsetof(Simple_Glyph, color)));
+  glVertexAttribIPointer(SIMPLE_GLYPH_ATTR_SHADER, 1, GL_UNSIGNED_BYTE,
+                         sizeof(Simple_Glyph),
+                         (GLvoid *)(offset + offsetof(Simple_Glyph, shader)));
+}
+
+void simple_renderer_init(Simple_Renderer *sr,
+                          const char *program_cache_filepath) {
   sr->camera_scale = 2;
   {
     glGenVertexArrays(1, &sr->vao);
     glBindVertexArray(sr->vao);
 
-    glGenBuffers(1, &sr->vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, sr->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(sr->vertices), sr->vertices,
-                 GL_DYNAMIC_DRAW);
+    simple_ring_init(&sr->vertex_ring, sizeof(Simple_Vertex),
+                     SIMPLE_VERTICES_CAP);
 
     glEnableVertexAttribArray(SIMPLE_VERTEX_ATTR_POSITION);
-    glVertexAttribPointer(SIMPLE_VERTEX_ATTR_POSITION, 2, GL_FLOAT, GL_FALSE,
-                          sizeof(Simple_Vertex),
-                          (GLvoid *)offsetof(Simple_Vertex, position));
-
     glEnableVertexAttribArray(SIMPLE_VERTEX_ATTR_COLOR);
-    glVertexAttribPointer(SIMPLE_VERTEX_ATTR_COLOR, 4, GL_FLOAT, GL_FALSE,
-                          sizeof(Simple_Vertex),
-                          (GLvoid *)offsetof(Simple_Vertex, color));
-
     glEnableVertexAttribArray(SIMPLE_VERTEX_ATTR_UV);
-    glVertexAttribPointer(SIMPLE_VERTEX_ATTR_UV, 2, GL_FLOAT, GL_FALSE,
-                          sizeof(Simple_Vertex),
-                          (GLvoid *)offsetof(Simple_Vertex, uv));
+    simple_renderer_vertex_attribs(0);
   }
 
   {
-    GLuint shaders[2] = {0};
+    glGenVertexArrays(1, &sr->glyph_vao);
+    glBindVertexArray(sr->glyph_vao);
 
-    if (!compile_shader_file(vert_shader_filepath, GL_VERTEX_SHADER,
-                             &shaders[0])) {
-      fprintf(stderr, "ERROR: failed to compile vertex shader\n");
-      exit(1);
-    }
+    simple_ring_init(&sr->glyph_ring, sizeof(Simple_Glyph), SIMPLE_GLYPHS_CAP);
 
-    for (int i = 0; i < COUNT_SIMPLE_SHADERS; ++i) {
-      if (!compile_shader_file(frag_shader_filepaths[i], GL_FRAGMENT_SHADER,
-                               &shaders[1])) {
-        fprintf(stderr, "ERROR: failed to compile fragment shader `%s`\n",
-                frag_shader_filepaths[i]);
-        exit(1);
-      }
+    glEnableVertexAttribArray(SIMPLE_GLYPH_ATTR_POSITION);
+    glVertexAttribDivisor(SIMPLE_GLYPH_ATTR_POSITION, 1);
+    glEnableVertexAttribArray(SIMPLE_GLYPH_ATTR_GLYPH);
+    glVertexAttribDivisor(SIMPLE_GLYPH_ATTR_GLYPH, 1);
+    glEnableVertexAttribArray(SIMPLE_GLYPH_ATTR_COLOR);
+    glVertexAttribDivisor(SIMPLE_GLYPH_ATTR_COLOR, 1);
+    glEnableVertexAttribArray(SIMPLE_GLYPH_ATTR_SHADER);
+    glVertexAttribDivisor(SIMPLE_GLYPH_ATTR_SHADER, 1);
+    simple_renderer_glyph_attribs(0);
+
+    glBindVertexArray(sr->vao);
+  }
 
-      sr->programs[i] = glCreateProgram();
-      attach_shaders_to_program(shaders, sizeof(shaders) / sizeof(shaders[0]),
-                                sr->programs[i]);
+  glGenBuffers(1, &sr->globals_ubo);
+  glBindBuffer(GL_UNIFORM_BUFFER, sr->globals_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(Simple_Globals), NULL,
+               GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, SIMPLE_GLOBALS_BINDING, sr->globals_ubo);
 
-      if (!link_program(sr->programs[i], __FILE__, __LINE__)) {
-        fprintf(stderr, "ERROR: failed to link program at iteration %d\n", i);
-        exit(1);
-      }
+  simple_renderer_clear(sr);
+
+  if (program_cache_filepath != NULL) {
+    size_t n = strlen(program_cache_filepath);
+    sr->program_cache_filepath = malloc(n + 1);
+    assert(sr->program_cache_filepath != NULL && "Buy more RAM lol");
+    memcpy(sr->program_cache_filepath, program_cache_filepath, n + 1);
+  }
+  if (GLEW_KHR_parallel_shader_compile) {
+    // As many threads as the driver sees fit
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+  }
 
-      glDeleteShader(shaders[1]);
+  String_Builder sources[COUNT_SIMPLE_SHADER_FILES] = {0};
+  if (!read_shader_sources(sources)) {
+    exit(1);
+  }
+  uint64_t key = program_binary_key(sources);
+  if (!program_cache_load(sr->program_cache_filepath, key, &sr->program,
+                          &sr->glyph_program)) {
+    Simple_Program_Build b = {.key = key};
+    program_build_start(&b, sources);
+    if (!program_build_finish(&b)) {
+      exit(1);
     }
-    glDeleteShader(shaders[0]);
+    sr->program = b.program;
+    sr->glyph_program = b.glyph_program;
+    program_cache_save(sr->program_cache_filepath, key, sr->program,
+                       sr->glyph_program);
   }
+  free_shader_sources(sources);
+  simple_renderer_setup_programs(sr);
+}
+
+// Draws what was batched so far because the batch is full. A batch that
+// takes a quarter of a region or more makes the ring grow first, so that a
+// frame needs a handful of draw calls and not one per few thousand vertices.
+static void simple_renderer_batch_full(Simple_Renderer *sr, Simple_Ring *r,
+                                       size_t count, size_t max_cap) {
+  bool grow = count >= r->capacity / 4 && r->capacity < max_cap;
+  simple_renderer_flush(sr);
+  if (grow) {
+    simple_ring_grow(r);
+    simple_renderer_clear(sr);
+  }
+}
+
+static uint8_t pack_unorm8(float x) {
+  if (x <= 0.0f)
+    return 0;
+  if (x >= 1.0f)
+    return UINT8_MAX;
+  return (uint8_t)(x * UINT8_MAX + 0.5f);
+}
+
+static uint16_t pack_unorm15(float x) {
+  if (x <= 0.0f)
+    return 0;
+  if (x >= 1.0f)
+    return SIMPLE_VERTEX_UV_MAX;
+  return (uint16_t)(x * SIMPLE_VERTEX_UV_MAX + 0.5f);
 }
 
 void simple_renderer_vertex(Simple_Renderer *sr, Vec2f p, Vec4f c, Vec2f uv) {
-#if 1
-  // TODO: shouldn't crash when ran out of vertices
-  if (sr->vertices_count >= SIMPLE_VERTICES_CAP)
-    simple_renderer_flush(sr);
-#else
-  assert(sr->vertices_count < SIMPLE_VERTICES_CAP);
-#endif
+  if (sr->vertices_count >= sr->vertices_cap)
+    simple_renderer_batch_full(sr, &sr->vertex_ring, sr->vertices_count,
+                               SIMPLE_VERTICES_MAX_CAP);
   Simple_Vertex *last = &sr->vertices[sr->vertices_count];
   last->position = p;
-  last->color = c;
-  last->uv = uv;
+  last->color[0] = pack_unorm8(c.x);
+  last->color[1] = pack_unorm8(c.y);
+  last->color[2] = pack_unorm8(c.z);
+  last->color[3] = pack_unorm8(c.w);
+  unsigned shader = sr->current_shader;
+  last->uv[0] = pack_unorm15(uv.x) | (shader & 1) << SIMPLE_VERTEX_SHADER_BIT;
+  last->uv[1] = pack_unorm15(uv.y) | (shader >> 1) << SIMPLE_VERTEX_SHADER_BIT;
 
   sr->vertices_count++;
 }
@@ -269,28 +642,167 @@ void simple_renderer_solid_rect(Simple_Renderer *sr, Vec2f p, Vec2f s,
                        uv, uv, uv, uv);
 }
 
+// Index of `c` in the palette, adding it if there is room. Returns
+// SIMPLE_PALETTE_CAP if there is none.
+static size_t palette_index(Vec4f *palette, size_t *palette_count, Vec4f c) {
+  for (size_t i = 0; i < *palette_count; ++i) {
+    Vec4f p = palette[i];
+    if (p.x == c.x && p.y == c.y && p.z == c.z && p.w == c.w) {
+      return i;
+    }
+  }
+
+  if (*palette_count < SIMPLE_PALETTE_CAP) {
+    palette[*palette_count] = c;
+    *palette_count += 1;
+    return *palette_count - 1;
+  }
+  return SIMPLE_PALETTE_CAP;
+}
+
+// Draws `glyph` of the atlas with its origin at `pos` through the instanced
+// path: 12 bytes per glyph instead of the 6 vertices of an image_rect.
+void simple_renderer_glyph(Simple_Renderer *sr, Vec2f pos, size_t glyph,
+                           Vec4f c) {
+  Simple_Glyph g = {
+      .position = pos,
+      .glyph = (uint16_t)glyph,
+      .shader = (uint8_t)sr->current_shader,
+  };
+
+  if (sr->run != NULL) {
+    size_t color = palette_index(sr->run->palette, &sr->run->palette_count, c);
+    assert(color < SIMPLE_PALETTE_CAP && "Too many colors in one glyph run");
+    g.color = (uint8_t)color;
+    da_append(&sr->run_glyphs, g);
+    return;
+  }
+
+  if (sr->glyphs_count >= sr->glyphs_cap)
+    simple_renderer_batch_full(sr, &sr->glyph_ring, sr->glyphs_count,
+                               SIMPLE_GLYPHS_MAX_CAP);
+
+  size_t color = palette_index(sr->palette, &sr->palette_count, c);
+  if (color == SIMPLE_PALETTE_CAP) {
+    simple_renderer_flush(sr);
+    color = palette_index(sr->palette, &sr->palette_count, c);
+  }
+  g.color = (uint8_t)color;
+  sr->glyphs[sr->glyphs_count++] = g;
+}
+
+void simple_renderer_begin_run(Simple_Renderer *sr, Simple_Glyph_Run *run) {
+  assert(sr->run == NULL);
+  sr->run = run;
+  sr->run_glyphs.count = 0;
+  run->count = 0;
+  run->palette_count = 0;
+}
+
+void simple_renderer_end_run(Simple_Renderer *sr) {
+  Simple_Glyph_Run *run = sr->run;
+  assert(run != NULL);
+  sr->run = NULL;
+
+  if (run->buffer == 0) {
+    glGenBuffers(1, &run->buffer);
+  }
+  run->count = sr->run_glyphs.count;
+  glBindBuffer(GL_ARRAY_BUFFER, run->buffer);
+  glBufferData(GL_ARRAY_BUFFER, run->count * sizeof(Simple_Glyph),
+               sr->run_glyphs.items, GL_STATIC_DRAW);
+}
+
+// Uploads the Globals uniform block if anything in it changed since the last
+// draw, which is about once a frame
+static void simple_renderer_upload_globals(Simple_Renderer *sr) {
+  Simple_Globals globals = {
+      .resolution = sr->resolution,
+      .camera_pos = sr->camera_pos,
+      .camera_scale = sr->camera_scale,
+      .time = sr->time,
+  };
+  if (sr->globals_uploaded &&
+      memcmp(&globals, &sr->globals, sizeof(globals)) == 0)
+    return;
+
+  sr->globals = globals;
+  sr->globals_uploaded = true;
+  glBindBuffer(GL_UNIFORM_BUFFER, sr->globals_ubo);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(globals), &globals);
+}
+
 void simple_renderer_sync(Simple_Renderer *sr) {
-  glBufferSubData(GL_ARRAY_BUFFER, 0,
-                  sr->vertices_count * sizeof(Simple_Vertex), sr->vertices);
+  if (sr->vertices_count > 0) {
+    sr->vertices_offset =
+        simple_ring_submit(&sr->vertex_ring, sr->vertices_count);
+  }
+  if (sr->glyphs_count > 0) {
+    sr->glyphs_offset = simple_ring_submit(&sr->glyph_ring, sr->glyphs_count);
+  }
 }
 
 void simple_renderer_draw(Simple_Renderer *sr) {
-  glDrawArrays(GL_TRIANGLES, 0, (GLsizei)sr->vertices_count);
+  if (sr->vertices_count == 0 && sr->glyphs_count == 0)
+    return;
+
+  simple_renderer_upload_globals(sr);
+  if (sr->vertices_count > 0) {
+    glUseProgram(sr->program);
+    glBindVertexArray(sr->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, sr->vertex_ring.buffer);
+    simple_renderer_vertex_attribs(sr->vertices_offset);
+    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)sr->vertices_count);
+    sr->stats.draw_calls += 1;
+    sr->stats.vertices += sr->vertices_count;
+  }
+  if (sr->glyphs_count > 0) {
+    glUseProgram(sr->glyph_program);
+    glUniform4fv(sr->glyph_uniforms[UNIFORM_SLOT_PALETTE],
+                 (GLsizei)sr->palette_count, (const GLfloat *)sr->palette);
+    glUniform2f(sr->glyph_uniforms[UNIFORM_SLOT_ORIGIN], 0.0f, 0.0f);
+    glBindVertexArray(sr->glyph_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, sr->glyph_ring.buffer);
+    simple_renderer_glyph_attribs(sr->glyphs_offset);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4,
+                          (GLsizei)sr->glyphs_count);
+    sr->stats.draw_calls += 1;
+    sr->stats.glyphs += sr->glyphs_count;
+  }
 }
 
-void simple_renderer_clear(Simple_Renderer *sr) { sr->vertices_count = 0; }
+// Draws the glyphs of `run` moved by `origin`, after whatever was pending
+void simple_renderer_draw_run(Simple_Renderer *sr, const Simple_Glyph_Run *run,
+                              Vec2f origin) {
+  simple_renderer_flush(sr);
+  if (run->count == 0)
+    return;
+
+  simple_renderer_upload_globals(sr);
+  glUseProgram(sr->glyph_program);
+  glUniform4fv(sr->glyph_uniforms[UNIFORM_SLOT_PALETTE],
+               (GLsizei)run->palette_count, (const GLfloat *)run->palette);
+  glUniform2f(sr->glyph_uniforms[UNIFORM_SLOT_ORIGIN], origin.x, origin.y);
+  glBindVertexArray(sr->glyph_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, run->buffer);
+  simple_renderer_glyph_attribs(0);
+  glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)run->count);
+  sr->stats.draw_calls += 1;
+  sr->stats.glyphs += run->count;
+}
 
+void simple_renderer_clear(Simple_Renderer *sr) {
+  sr->vertices = simple_ring_batch(&sr->vertex_ring, &sr->vertices_cap);
+  sr->vertices_count = 0;
+  sr->glyphs = simple_ring_batch(&sr->glyph_ring, &sr->glyphs_cap);
+  sr->glyphs_count = 0;
+  sr->palette_count = 0;
+}
+
+// Picks what the vertices and glyphs added from now on are drawn with. They
+// all go through the same program, so this does not break the batch.
 void simple_renderer_set_shader(Simple_Renderer *sr, Simple_Shader shader) {
   sr->current_shader = shader;
-  glUseProgram(sr->programs[shader]);
-  get_uniform_locations(sr->programs[shader], sr->uniforms);
-
-  glUniform2f(sr->uniforms[UNIFORM_SLOT_RESOLUTION], (float)sr->resolution.x,
-              (float)sr->resolution.y);
-  glUniform1f(sr->uniforms[UNIFORM_SLOT_TIME], sr->time);
-  glUniform2f(sr->uniforms[UNIFORM_SLOT_CAMERA_POS], sr->camera_pos.x,
-              sr->camera_pos.y);
-  glUniform1f(sr->uniforms[UNIFORM_SLOT_CAMERA_SCALE], sr->camera_scale);
 }
 
 void simple_renderer_flush(Simple_Renderer *sr) {
@@ -299,48 +811,71 @@ void simple_renderer_flush(Simple_Renderer *sr) {
   simple_renderer_clear(sr);
 }
 
-void simple_renderer_reload_shaders(Simple_Renderer *sr) {
-  GLuint programs[COUNT_SIMPLE_SHADERS];
-  GLuint shaders[2] = {0};
-
-  bool ok = true;
+static void simple_renderer_use_programs(Simple_Renderer *sr, GLuint program,
+                                         GLuint glyph_program) {
+  glDeleteProgram(sr->program);
+  sr->program = program;
+  glDeleteProgram(sr->glyph_program);
+  sr->glyph_program = glyph_program;
+  simple_renderer_setup_programs(sr);
+  printf("Shaders reloading successful!\n");
+}
 
-  if (!compile_shader_file(vert_shader_filepath, GL_VERTEX_SHADER,
-                           &shaders[0])) {
-    fprintf(stderr, "ERROR: failed to compile vertex shader\n");
-    ok = false;
+// Starts building the programs again from the shader files. The current ones
+// keep drawing until simple_renderer_poll_shaders() finds the new ones ready.
+void simple_renderer_reload_shaders(Simple_Renderer *sr) {
+  String_Builder sources[COUNT_SIMPLE_SHADER_FILES] = {0};
+  if (!read_shader_sources(sources)) {
+    free_shader_sources(sources);
+    return;
   }
 
-  for (int i = 0; i < COUNT_SIMPLE_SHADERS; ++i) {
-    if (!compile_shader_file(frag_shader_filepaths[i], GL_FRAGMENT_SHADER,
-                             &shaders[1])) {
-      fprintf(stderr, "ERROR: failed to compile fragment shader `%s`\n",
-              frag_shader_filepaths[i]);
-      ok = false;
-    }
-
-    programs[i] = glCreateProgram();
-    attach_shaders_to_program(shaders, sizeof(shaders) / sizeof(shaders[0]),
-                              programs[i]);
-
-    if (!link_program(programs[i], __FILE__, __LINE__)) {
-      fprintf(stderr, "ERROR: failed to link program at iteration %d\n", i);
-      ok = false;
-    }
-
-    glDeleteShader(shaders[1]);
+  // Reloading again before the last reload is done supersedes it
+  if (sr->building) {
+    sr->building = false;
+    program_build_cancel(&sr->build);
   }
-  glDeleteShader(shaders[0]);
 
-  if (ok) {
-    for (int i = 0; i < COUNT_SIMPLE_SHADERS; ++i) {
-      glDeleteProgram(sr->programs[i]);
-      sr->programs[i] = programs[i];
-    }
-    printf("Shaders reloading successful!\n");
+  GLuint program;
+  GLuint glyph_program;
+  uint64_t key = program_binary_key(sources);
+  if (program_cache_load(sr->program_cache_filepath, key, &program,
+                         &glyph_program)) {
+    simple_renderer_use_programs(sr, program, glyph_program);
   } else {
-    for (int i = 0; i < COUNT_SIMPLE_SHADERS; ++i) {
-      glDeleteProgram(programs[i]);
-    }
+    program_build_start(&sr->build, sources);
+    sr->build.key = key;
+    sr->building = true;
+    simple_renderer_poll_shaders(sr);
   }
-}
\ No newline at end of file
+  free_shader_sources(sources);
+}
+
+// Puts the programs simple_renderer_reload_shaders() started building to use
+// once the driver is done with them. Without KHR_parallel_shader_compile that
+// is right away.
+void simple_renderer_poll_shaders(Simple_Renderer *sr) {
+  if (!sr->building || !program_build_done(&sr->build))
+    return;
+
+  sr->building = false;
+  if (program_build_finish(&sr->build)) {
+    program_cache_save(sr->program_cache_filepath, sr->build.key,
+                       sr->build.program, sr->build.glyph_program);
+    simple_renderer_use_programs(sr, sr->build.program,
+                                 sr->build.glyph_program);
+  }
+}
+
+// The camera moves less than this many units (and the scale changes less
+// than this much) per second once it is as good as at its target
+#define CAMERA_SETTLED_VEL 0.5f
+#define CAMERA_SETTLED_SCALE_VEL 0.002f
+
+// Whether the camera is still on its way to the target editor_render() or
+// fb_render() last gave it, so that another frame is needed
+bool simple_renderer_camera_moving(const Simple_Renderer *sr) {
+  return fabsf(sr->camera_vel.x) > CAMERA_SETTLED_VEL ||
+         fabsf(sr->camera_vel.y) > CAMERA_SETTLED_VEL ||
+         fabsf(sr->camera_scale_vel) > CAMERA_SETTLED_SCALE_VEL;
+}
@@ -8,18 +8,38 @@
 
 #include "la.h"
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+// Uniforms set per draw call. The ones that stay the same for a whole frame
+// are in the Globals uniform block instead (see Simple_Globals).
 typedef enum {
-  UNIFORM_SLOT_TIME = 0,
-  UNIFORM_SLOT_RESOLUTION,
-  UNIFORM_SLOT_CAMERA_POS,
-  UNIFORM_SLOT_CAMERA_SCALE,
-  UNIFORM_SLOT_CURSOR_POS,
-  UNIFORM_SLOT_CURSOR_HEIGHT,
-  UNIFORM_SLOT_LAST_STROKE,
+  UNIFORM_SLOT_GLYPH_RECTS = 0,
+  UNIFORM_SLOT_PALETTE,
+  UNIFORM_SLOT_ORIGIN,
   COUNT_UNIFORM_SLOTS,
 } Uniform_Slot;
 
+// What shaders/simple.frag does with a vertex or glyph
+typedef enum {
+  SHADER_COLOR = 0,
+  SHADER_IMAGE,
+  SHADER_TEXT,
+  SHADER_EPIC,
+  COUNT_SIMPLE_SHADERS,
+} Simple_Shader;
+
+// The Globals uniform block shared by all the shaders, laid out as std140
+typedef struct {
+  Vec2f resolution;
+  Vec2f camera_pos;
+  float camera_scale;
+  float time;
+} Simple_Globals;
+
+// Binding point of the Globals uniform block
+#define SIMPLE_GLOBALS_BINDING 0
+
 typedef enum {
   SIMPLE_VERTEX_ATTR_POSITION = 0,
   SIMPLE_VERTEX_ATTR_COLOR,
@@ -27,35 +47,170 @@ typedef enum {
   COUNT_SIMPLE_VERTEX_ATTRS
 } Simple_Vertex_Attr;
 
+// Packed down from the Vec4f color and Vec2f uv simple_renderer_vertex()
+// takes: the color is normalized RGBA8 and the uv normalized 15 bit. The top
+// bit of uv[0] and uv[1] are the low and high bit of the shader.
 typedef struct {
   Vec2f position;
-  Vec4f color;
-  Vec2f uv;
+  uint8_t color[4];
+  uint16_t uv[2];
 } Simple_Vertex;
 
-#define SIMPLE_VERTICES_CAP (3 * 1024 * 1024)
+#define SIMPLE_VERTEX_UV_MAX 0x7fff
+#define SIMPLE_VERTEX_SHADER_BIT 15
+
+static_assert(sizeof(Simple_Vertex) == 16,
+              "Simple_Vertex is not packed the way the vertex attributes say");
+
+// Vertices in one region of the vertex ring to begin with. A batch that does
+// not fit is drawn in parts, and a batch that takes a good part of a region
+// makes the ring grow, up to SIMPLE_VERTICES_MAX_CAP.
+#define SIMPLE_VERTICES_CAP (3 * 4 * 1024)
+#define SIMPLE_VERTICES_MAX_CAP (3 * 256 * 1024)
 
 static_assert(SIMPLE_VERTICES_CAP % 3 == 0,
               "Simple renderer vertex capacity must be divisible by 3.");
 
 typedef enum {
-  SHADER_COLOR = 0,
-  SHADER_IMAGE,
-  SHADER_TEXT,
-  SHADER_EPIC,
-  COUNT_SIMPLE_SHADERS,
-} Simple_Shader;
+  SIMPLE_GLYPH_ATTR_POSITION = 0,
+  SIMPLE_GLYPH_ATTR_GLYPH,
+  SIMPLE_GLYPH_ATTR_COLOR,
+  SIMPLE_GLYPH_ATTR_SHADER,
+  COUNT_SIMPLE_GLYPH_ATTRS
+} Simple_Glyph_Attr;
+
+// One glyph drawn by the instanced path. shaders/glyph.vert expands it into
+// a quad, looking the glyph up in the rects of the atlas (see
+// free_glyph_atlas_init) and the color up in the palette.
+typedef struct {
+  Vec2f position;
+  uint16_t glyph;
+  uint8_t color;
+  uint8_t shader;
+} Simple_Glyph;
+
+static_assert(sizeof(Simple_Glyph) == 12,
+              "Simple_Glyph is meant to be 12 bytes, update glyph.vert too");
+
+#define SIMPLE_GLYPHS_CAP (4 * 1024)
+#define SIMPLE_GLYPHS_MAX_CAP (256 * 1024)
+// Different colors the glyphs of one draw call can have, PALETTE_CAP in
+// shaders/glyph.vert
+#define SIMPLE_PALETTE_CAP 16
+// Texture unit of the glyph rects buffer texture
+#define SIMPLE_GLYPH_RECTS_UNIT 1
+
+// Glyphs that stay on the GPU from one frame to the next. They are recorded
+// once between simple_renderer_begin_run() and simple_renderer_end_run()
+// and drawn any number of times with simple_renderer_draw_run().
+typedef struct {
+  GLuint buffer;
+  size_t count;
+  Vec4f palette[SIMPLE_PALETTE_CAP];
+  size_t palette_count;
+} Simple_Glyph_Run;
+
+typedef struct {
+  Simple_Glyph *items;
+  size_t count;
+  size_t capacity;
+} Simple_Glyphs;
+
+#define SIMPLE_RING_REGIONS 3
+
+// A stream of vertices on its way to the GPU. With ARB_buffer_storage the
+// buffer is mapped once for good and split into SIMPLE_RING_REGIONS regions
+// of `capacity` items: batches are written right into the current region
+// one after another, and moving on to the next region first waits for the
+// fence the GPU left at the end of it the last time around. So a draw call
+// only ever waits for data two regions old. Without it the buffer is a
+// single region, batches are staged in memory and the buffer is orphaned
+// before each upload.
+typedef struct {
+  GLuint buffer;
+  size_t item_size;
+  size_t capacity;
+
+  void *mapped;
+  void *staging;
+
+  size_t region;
+  // Items of the current region taken by previous batches
+  size_t used;
+  GLsync fences[SIMPLE_RING_REGIONS];
+} Simple_Ring;
+
+// The shader files the two programs are built from
+typedef enum {
+  SIMPLE_SHADER_FILE_VERT = 0,
+  SIMPLE_SHADER_FILE_GLYPH_VERT,
+  SIMPLE_SHADER_FILE_FRAG,
+  COUNT_SIMPLE_SHADER_FILES,
+} Simple_Shader_File;
+
+// Programs being compiled and linked. With KHR_parallel_shader_compile the
+// driver does it on its own threads while the old programs keep drawing.
+typedef struct {
+  GLuint shaders[COUNT_SIMPLE_SHADER_FILES];
+  GLuint program;
+  GLuint glyph_program;
+  // Of the sources and the driver, for the program binary cache
+  uint64_t key;
+} Simple_Program_Build;
+
+// What the renderer sent to the GPU since the counters were last zeroed
+typedef struct {
+  size_t draw_calls;
+  size_t vertices;
+  size_t glyphs;
+} Simple_Renderer_Stats;
 
 typedef struct {
   GLuint vao;
-  GLuint vbo;
-  GLuint programs[COUNT_SIMPLE_SHADERS];
+  Simple_Ring vertex_ring;
+  GLuint program;
+  GLint uniforms[COUNT_UNIFORM_SLOTS];
+
+  GLuint glyph_vao;
+  Simple_Ring glyph_ring;
+  // shaders/simple.frag again, behind shaders/glyph.vert
+  GLuint glyph_program;
+  GLint glyph_uniforms[COUNT_UNIFORM_SLOTS];
+
+  // What the vertices and glyphs added from now on are drawn with
   Simple_Shader current_shader;
 
-  GLint uniforms[COUNT_UNIFORM_SLOTS];
+  // Where linked programs are kept between runs, NULL if nowhere
+  char *program_cache_filepath;
+  // The programs simple_renderer_reload_shaders() started, if building
+  Simple_Program_Build build;
+  bool building;
 
-  Simple_Vertex vertices[SIMPLE_VERTICES_CAP];
+  GLuint globals_ubo;
+  // What globals_ubo holds, if globals_uploaded
+  Simple_Globals globals;
+  bool globals_uploaded;
+
+  // The batches being written, and where simple_renderer_sync() put them
+  // in their ring buffers
+  Simple_Vertex *vertices;
   size_t vertices_count;
+  size_t vertices_cap;
+  size_t vertices_offset;
+
+  Simple_Glyph *glyphs;
+  size_t glyphs_count;
+  size_t glyphs_cap;
+  size_t glyphs_offset;
+
+  Vec4f palette[SIMPLE_PALETTE_CAP];
+  size_t palette_count;
+
+  // The run being recorded, if any, and its glyphs so far
+  Simple_Glyph_Run *run;
+  Simple_Glyphs run_glyphs;
+
+  Simple_Renderer_Stats stats;
 
   Vec2f resolution;
   float time;
@@ -66,10 +221,13 @@ typedef struct {
   Vec2f camera_vel;
 } Simple_Renderer;
 
-void simple_renderer_init(Simple_Renderer *sr);
+void simple_renderer_init(Simple_Renderer *sr,
+                          const char *program_cache_filepath);
 void simple_renderer_flush(Simple_Renderer *sr);
 void simple_renderer_set_shader(Simple_Renderer *sr, Simple_Shader shader);
 void simple_renderer_reload_shaders(Simple_Renderer *sr);
+void simple_renderer_poll_shaders(Simple_Renderer *sr);
+bool simple_renderer_camera_moving(const Simple_Renderer *sr);
 
 void simple_renderer_vertex(Simple_Renderer *sr, Vec2f p, Vec4f c, Vec2f uv);
 void simple_renderer_triangle(Simple_Renderer *sr, Vec2f p0, Vec2f p1, Vec2f p2,
@@ -79,6 +237,12 @@ void simple_renderer_quad(Simple_Renderer *sr, Vec2f p0, Vec2f p1, Vec2f p2,
                           Vec2f p3, Vec4f c0, Vec4f c1, Vec4f c2, Vec4f c3,
                           Vec2f uv0, Vec2f uv1, Vec2f uv2, Vec2f uv3);
 void simple_renderer_solid_rect(Simple_Renderer *sr, Vec2f p, Vec2f s, Vec4f c);
+void simple_renderer_glyph(Simple_Renderer *sr, Vec2f pos, size_t glyph,
+                           Vec4f c);
+void simple_renderer_begin_run(Simple_Renderer *sr, Simple_Glyph_Run *run);
+void simple_renderer_end_run(Simple_Renderer *sr);
+void simple_renderer_draw_run(Simple_Renderer *sr, const Simple_Glyph_Run *run,
+                              Vec2f origin);
 void simple_renderer_image_rect(Simple_Renderer *sr, Vec2f p, Vec2f s,
                                 Vec2f uvp, Vec2f uvs, Vec4f c);
 void simple_renderer_clear(Simple_Renderer *sr);
@@ -0,0 +1,323 @@
+#include "wrap_index.h"
+
+#include <assert.h>
+#include <string.h>
+
+static uint32_t wrap_index_random(Wrap_Index *wi) {
+  // xorshift32
+  uint32_t x = wi->seed ? wi->seed : 0x9E3779B9;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  wi->seed = x;
+  return x;
+}
+
+static size_t wrap_node_alloc(Wrap_Index *wi, size_t lines, size_t rows,
+                              size_t generation) {
+  size_t index;
+  if (wi->free.count > 0) {
+    // Freed subtrees are released lazily, the way the piece table does it
+    index = wi->free.items[--wi->free.count];
+    Wrap_Node old = wi->nodes.items[index];
+    if (old.left != WRAP_NIL)
+      da_append(&wi->free, old.left);
+    if (old.right != WRAP_NIL)
+      da_append(&wi->free, old.right);
+  } else {
+    da_append(&wi->nodes, (Wrap_Node){0});
+    index = wi->nodes.count - 1;
+  }
+
+  // The breaks of a node that is reused keep their memory
+  Wrap_Node *n = &wi->nodes.items[index];
+  n->lines = lines;
+  n->rows = rows;
+  n->generation = generation;
+  n->breaks.count = 0;
+  n->partial = false;
+  n->left = WRAP_NIL;
+  n->right = WRAP_NIL;
+  n->priority = wrap_index_random(wi);
+  n->subtree_lines = lines;
+  n->subtree_rows = rows;
+  n->subtree_generation = generation;
+  return index;
+}
+
+static void wrap_node_update(Wrap_Index *wi, size_t t) {
+  Wrap_Node *n = &wi->nodes.items[t];
+  const Wrap_Node *left = &wi->nodes.items[n->left];
+  const Wrap_Node *right = &wi->nodes.items[n->right];
+  n->subtree_lines = left->subtree_lines + n->lines + right->subtree_lines;
+  n->subtree_rows = left->subtree_rows + n->rows + right->subtree_rows;
+  // A line wrapped part of the way counts as a generation older, so that
+  // wrap_index_first_stale finds it
+  n->subtree_generation = n->partial ? n->generation - 1 : n->generation;
+  if (n->subtree_generation > left->subtree_generation)
+    n->subtree_generation = left->subtree_generation;
+  if (n->subtree_generation > right->subtree_generation)
+    n->subtree_generation = right->subtree_generation;
+}
+
+static size_t wrap_node_merge(Wrap_Index *wi, size_t a, size_t b) {
+  if (a == WRAP_NIL)
+    return b;
+  if (b == WRAP_NIL)
+    return a;
+
+  if (wi->nodes.items[a].priority > wi->nodes.items[b].priority) {
+    size_t right = wrap_node_merge(wi, wi->nodes.items[a].right, b);
+    wi->nodes.items[a].right = right;
+    wrap_node_update(wi, a);
+    return a;
+  } else {
+    size_t left = wrap_node_merge(wi, a, wi->nodes.items[b].left);
+    wi->nodes.items[b].left = left;
+    wrap_node_update(wi, b);
+    return b;
+  }
+}
+
+// Splits the tree `t` so that `*l` holds its first `k` lines and `*r` the
+// rest. A run of lines that straddles `k` is cut in two. May allocate, so
+// no pointers into wi->nodes are held across the recursive calls.
+static void wrap_node_split(Wrap_Index *wi, size_t t, size_t k, size_t *l,
+                            size_t *r) {
+  if (t == WRAP_NIL) {
+    *l = WRAP_NIL;
+    *r = WRAP_NIL;
+    return;
+  }
+
+  size_t left_lines = wi->nodes.items[wi->nodes.items[t].left].subtree_lines;
+  size_t lines = wi->nodes.items[t].lines;
+
+  if (k <= left_lines) {
+    size_t ll, lr;
+    wrap_node_split(wi, wi->nodes.items[t].left, k, &ll, &lr);
+    wi->nodes.items[t].left = lr;
+    wrap_node_update(wi, t);
+    *l = ll;
+    *r = t;
+  } else if (k >= left_lines + lines) {
+    size_t rl, rr;
+    wrap_node_split(wi, wi->nodes.items[t].right, k - left_lines - lines, &rl,
+                    &rr);
+    wi->nodes.items[t].right = rl;
+    wrap_node_update(wi, t);
+    *l = t;
+    *r = rr;
+  } else {
+    size_t offset = k - left_lines;
+    Wrap_Node n = wi->nodes.items[t];
+    assert(n.rows == n.lines);
+    size_t tail = wrap_node_alloc(wi, n.lines - offset, n.lines - offset,
+                                  n.generation);
+
+    wi->nodes.items[t].lines = offset;
+    wi->nodes.items[t].rows = offset;
+    wi->nodes.items[t].right = WRAP_NIL;
+    wrap_node_update(wi, t);
+
+    *l = t;
+    *r = wrap_node_merge(wi, tail, n.right);
+  }
+}
+
+// Grows the last (or first) node of `t` by `n` lines if it is a run of
+// lines wrapped for `generation`, so that consecutive lines without breaks
+// share a node
+static bool wrap_node_extend(Wrap_Index *wi, size_t t, bool last,
+                             size_t generation, size_t n) {
+  if (t == WRAP_NIL)
+    return false;
+
+  bool extended;
+  size_t next = last ? wi->nodes.items[t].right : wi->nodes.items[t].left;
+  if (next != WRAP_NIL) {
+    extended = wrap_node_extend(wi, next, last, generation, n);
+  } else {
+    Wrap_Node *node = &wi->nodes.items[t];
+    extended = node->generation == generation && node->rows == node->lines;
+    if (extended) {
+      node->lines += n;
+      node->rows += n;
+    }
+  }
+
+  if (extended)
+    wrap_node_update(wi, t);
+  return extended;
+}
+
+static Wrap_Line wrap_line_of(const Wrap_Index *wi, const Wrap_Node *n,
+                              size_t line, size_t row, size_t k) {
+  Wrap_Line wl = {0};
+  wl.wrapped = n->generation == wi->generation;
+  if (n->rows == n->lines) {
+    // The k-th line of a run
+    wl.line = line + k;
+    wl.row = row + k;
+    wl.rows = 1;
+    wl.run = n->lines - k;
+  } else {
+    wl.line = line;
+    wl.row = row;
+    wl.rows = n->rows;
+    wl.breaks = n->breaks.items;
+    wl.partial = n->partial;
+    wl.run = 1;
+  }
+  return wl;
+}
+
+void wrap_index_reset(Wrap_Index *wi, size_t lines_count) {
+  for (size_t i = 0; i < wi->nodes.count; ++i) {
+    free(wi->nodes.items[i].breaks.items);
+  }
+  wi->nodes.count = 0;
+  wi->free.count = 0;
+
+  // Index 0 is the nil node. It covers no lines and is older than nothing,
+  // so the tree code never has to special case missing children.
+  da_append(&wi->nodes, (Wrap_Node){0});
+  wi->nodes.items[WRAP_NIL].generation = SIZE_MAX;
+  wi->nodes.items[WRAP_NIL].subtree_generation = SIZE_MAX;
+
+  wi->generation = 1;
+  wi->root = wrap_node_alloc(wi, lines_count, lines_count, 0);
+}
+
+void wrap_index_invalidate(Wrap_Index *wi) { wi->generation += 1; }
+
+size_t wrap_index_rows_count(const Wrap_Index *wi) {
+  return wi->nodes.items[wi->root].subtree_rows;
+}
+
+Wrap_Line wrap_index_line(const Wrap_Index *wi, size_t line) {
+  size_t lines = 0;
+  size_t rows = 0;
+  size_t t = wi->root;
+  while (t != WRAP_NIL) {
+    const Wrap_Node *n = &wi->nodes.items[t];
+    const Wrap_Node *left = &wi->nodes.items[n->left];
+    if (line < lines + left->subtree_lines) {
+      t = n->left;
+      continue;
+    }
+
+    lines += left->subtree_lines;
+    rows += left->subtree_rows;
+    if (line < lines + n->lines)
+      return wrap_line_of(wi, n, lines, rows, line - lines);
+    lines += n->lines;
+    rows += n->rows;
+    t = n->right;
+  }
+  return (Wrap_Line){.line = line, .row = rows, .rows = 1};
+}
+
+// Rows past the end are on the last line
+Wrap_Line wrap_index_line_at_row(const Wrap_Index *wi, size_t row) {
+  size_t rows_count = wrap_index_rows_count(wi);
+  if (row >= rows_count)
+    row = rows_count > 0 ? rows_count - 1 : 0;
+
+  size_t lines = 0;
+  size_t rows = 0;
+  size_t t = wi->root;
+  while (t != WRAP_NIL) {
+    const Wrap_Node *n = &wi->nodes.items[t];
+    const Wrap_Node *left = &wi->nodes.items[n->left];
+    if (row < rows + left->subtree_rows) {
+      t = n->left;
+      continue;
+    }
+
+    lines += left->subtree_lines;
+    rows += left->subtree_rows;
+    if (row < rows + n->rows) {
+      size_t k = n->rows == n->lines ? row - rows : 0;
+      return wrap_line_of(wi, n, lines, rows, k);
+    }
+    lines += n->lines;
+    rows += n->rows;
+    t = n->right;
+  }
+  return (Wrap_Line){.line = lines, .row = rows, .rows = 1};
+}
+
+size_t wrap_index_first_stale(const Wrap_Index *wi) {
+  size_t lines = 0;
+  size_t t = wi->root;
+  if (wi->nodes.items[t].subtree_generation >= wi->generation)
+    return wi->nodes.items[t].subtree_lines;
+
+  while (t != WRAP_NIL) {
+    const Wrap_Node *n = &wi->nodes.items[t];
+    const Wrap_Node *left = &wi->nodes.items[n->left];
+    if (left->subtree_generation < wi->generation) {
+      t = n->left;
+    } else if (n->generation < wi->generation || n->partial) {
+      return lines + left->subtree_lines;
+    } else {
+      lines += left->subtree_lines + n->lines;
+      t = n->right;
+    }
+  }
+  return lines;
+}
+
+void wrap_index_replace(Wrap_Index *wi, size_t line, size_t old_count,
+                        size_t new_count) {
+  size_t l, m, r;
+  wrap_node_split(wi, wi->root, line, &l, &m);
+  wrap_node_split(wi, m, old_count, &m, &r);
+  if (m != WRAP_NIL)
+    da_append(&wi->free, m);
+
+  if (new_count > 0) {
+    size_t n = wrap_node_alloc(wi, new_count, new_count, 0);
+    l = wrap_node_merge(wi, l, n);
+  }
+  wi->root = wrap_node_merge(wi, l, r);
+}
+
+void wrap_index_wrap(Wrap_Index *wi, size_t line, size_t count,
+                     const size_t *breaks, size_t breaks_count, bool partial) {
+  assert(count == 1 || breaks_count == 0);
+  assert(!partial || breaks_count > 0);
+
+  size_t l, m, r;
+  wrap_node_split(wi, wi->root, line, &l, &m);
+  wrap_node_split(wi, m, count, &m, &r);
+  if (m != WRAP_NIL)
+    da_append(&wi->free, m);
+
+  if (breaks_count > 0) {
+    size_t n = wrap_node_alloc(wi, 1, breaks_count + 1, wi->generation);
+    da_append_many(&wi->nodes.items[n].breaks, breaks, breaks_count);
+    wi->nodes.items[n].partial = partial;
+    wrap_node_update(wi, n);
+    l = wrap_node_merge(wi, l, n);
+  } else if (wrap_node_extend(wi, l, true, wi->generation, count)) {
+    // The run before may now go on into the one after
+    size_t first = r;
+    while (first != WRAP_NIL && wi->nodes.items[first].left != WRAP_NIL) {
+      first = wi->nodes.items[first].left;
+    }
+    const Wrap_Node *f = &wi->nodes.items[first];
+    if (first != WRAP_NIL && f->generation == wi->generation &&
+        f->rows == f->lines) {
+      size_t lines = f->lines;
+      wrap_node_split(wi, r, lines, &m, &r);
+      da_append(&wi->free, m);
+      wrap_node_extend(wi, l, true, wi->generation, lines);
+    }
+  } else if (!wrap_node_extend(wi, r, false, wi->generation, count)) {
+    size_t n = wrap_node_alloc(wi, count, count, wi->generation);
+    l = wrap_node_merge(wi, l, n);
+  }
+  wi->root = wrap_node_merge(wi, l, r);
+}
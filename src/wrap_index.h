@@ -0,0 +1,106 @@
+#ifndef __NIJI_WRAP_INDEX_H
+#define __NIJI_WRAP_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+// Which visual rows the lines of a soft wrapped document take up. The lines
+// are kept in a treap the same way the piece table keeps its pieces: every
+// node is either a run of lines one visual row each or a single line wrapped
+// into several rows, and knows how many lines and rows its subtree covers.
+// That makes line -> visual row and visual row -> line O(log n) descents,
+// and replacing the lines an edit touched O(log n) as well.
+//
+// Lines are wrapped lazily. Changing the width only bumps `generation`, and
+// a line wrapped for an older generation keeps the rows it had (one row for
+// lines never wrapped yet) until it is wrapped again. A very long line may
+// be wrapped only part of the way, the rest of it taking up one more row
+// until it is wrapped too.
+
+#define WRAP_NIL 0
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Wrap_Breaks;
+
+typedef struct {
+  size_t lines;
+  // Equal to `lines` unless the node is a single wrapped line
+  size_t rows;
+  size_t generation;
+  // Where in the line its visual rows 1..rows-1 begin, for a single line
+  Wrap_Breaks breaks;
+  // The last row of a single line is the rest of it, not wrapped yet
+  bool partial;
+
+  size_t left;
+  size_t right;
+  uint32_t priority;
+
+  size_t subtree_lines;
+  size_t subtree_rows;
+  // The oldest generation in the subtree
+  size_t subtree_generation;
+} Wrap_Node;
+
+typedef struct {
+  Wrap_Node *items;
+  size_t count;
+  size_t capacity;
+} Wrap_Nodes;
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Wrap_Indices;
+
+typedef struct {
+  Wrap_Nodes nodes;
+  Wrap_Indices free;
+  size_t root;
+  uint32_t seed;
+  // Lines wrapped for an older generation may wrap differently now
+  size_t generation;
+} Wrap_Index;
+
+// Line `line` as laid out last: it starts at visual row `row` and takes
+// `rows` of them, breaks[i] being where in the line row i + 1 begins. The
+// `run` lines from `line` on are all wrapped for the same generation. A
+// `partial` line is wrapped only as far as its last break.
+typedef struct {
+  size_t line;
+  size_t row;
+  size_t rows;
+  const size_t *breaks;
+  bool wrapped;
+  bool partial;
+  size_t run;
+} Wrap_Line;
+
+void wrap_index_reset(Wrap_Index *wi, size_t lines_count);
+void wrap_index_invalidate(Wrap_Index *wi);
+
+size_t wrap_index_rows_count(const Wrap_Index *wi);
+Wrap_Line wrap_index_line(const Wrap_Index *wi, size_t line);
+Wrap_Line wrap_index_line_at_row(const Wrap_Index *wi, size_t row);
+// The first line not wrapped for the current generation, or wrapped only
+// part of the way, or the number of lines if there is none
+size_t wrap_index_first_stale(const Wrap_Index *wi);
+
+// Lines [line, line + old_count) were replaced by `new_count` lines that
+// are yet to be wrapped
+void wrap_index_replace(Wrap_Index *wi, size_t line, size_t old_count,
+                        size_t new_count);
+// Lines [line, line + count) are wrapped for the current generation: a
+// single line at `breaks`, or any number of lines that need no breaks. A
+// `partial` line is wrapped as far as the last of its breaks only.
+void wrap_index_wrap(Wrap_Index *wi, size_t line, size_t count,
+                     const size_t *breaks, size_t breaks_count, bool partial);
+
+#endif // __NIJI_WRAP_INDEX_H
@@ -0,0 +1,224 @@
+#include "lexer_reference.h"
+
+#include "../src/common.h"
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+
+typedef struct {
+  Token_Kind kind;
+  const char *text;
+} Reference_Literal;
+
+static Reference_Literal reference_literals[] = {
+    {.text = "(", .kind = TOKEN_OPEN_PAREN},
+    {.text = ")", .kind = TOKEN_CLOSE_PAREN},
+    {.text = "[", .kind = TOKEN_OPEN_BRACKET},
+    {.text = "]", .kind = TOKEN_CLOSE_BRACKET},
+    {.text = "{", .kind = TOKEN_OPEN_BRACE},
+    {.text = "}", .kind = TOKEN_CLOSE_BRACE},
+    {.text = ";", .kind = TOKEN_SEMICOLON},
+};
+
+#define reference_literals_count                                               \
+  (sizeof(reference_literals) / sizeof(reference_literals[0]))
+
+Reference_Lexer reference_lexer_new(const Piece_Table *content,
+                                    const Keyword_Set *keywords) {
+  Reference_Lexer l = {0};
+  l.content = content;
+  l.content_len = piece_table_size(content);
+  l.keywords = keywords;
+  return l;
+}
+
+void reference_lexer_seek(Reference_Lexer *l, size_t row, size_t line_begin,
+                          Lexer_State state) {
+  l->cursor = line_begin;
+  l->line = row;
+  l->bol = line_begin;
+  l->state = state;
+}
+
+static char reference_char_at(Reference_Lexer *l, size_t pos) {
+  assert(pos < l->content_len);
+  return piece_table_at(l->content, pos);
+}
+
+static bool reference_starts_with(Reference_Lexer *l, const char *prefix) {
+  size_t prefix_len = strlen(prefix);
+  if (prefix_len == 0) {
+    return true;
+  }
+  if (l->cursor + prefix_len - 1 >= l->content_len) {
+    return false;
+  }
+
+  for (size_t i = 0; i < prefix_len; ++i) {
+    if (prefix[i] != reference_char_at(l, l->cursor + i)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void reference_chop_chars(Reference_Lexer *l, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    assert(l->cursor < l->content_len);
+    char x = reference_char_at(l, l->cursor);
+    l->cursor += 1;
+    if (x == '\n') {
+      l->line += 1;
+      l->bol = l->cursor;
+      if (l->line_states) {
+        da_append(l->line_states, l->state);
+      }
+    }
+  }
+}
+
+// The C locale's classes, which is what the editor always ran in. The old
+// code passed a plain char, that is undefined for bytes of 128 and above.
+static bool reference_is_space(char x) { return isspace((unsigned char)x); }
+
+static bool reference_is_symbol_start(char x) {
+  return isalpha((unsigned char)x) || x == '_';
+}
+
+static bool reference_is_symbol(char x) {
+  return isalnum((unsigned char)x) || x == '_';
+}
+
+static void reference_trim_left(Reference_Lexer *l) {
+  while (l->cursor < l->content_len &&
+         reference_is_space(reference_char_at(l, l->cursor))) {
+    reference_chop_chars(l, 1);
+  }
+}
+
+static void reference_chop_block_comment(Reference_Lexer *l) {
+  while (l->cursor < l->content_len) {
+    if (reference_starts_with(l, "*/")) {
+      reference_chop_chars(l, 2);
+      l->state = LEXER_STATE_NORMAL;
+      return;
+    }
+
+    char x = reference_char_at(l, l->cursor);
+    reference_chop_chars(l, 1);
+    if (x == '\n') {
+      return;
+    }
+  }
+}
+
+static void reference_chop_line(Reference_Lexer *l) {
+  while (l->cursor < l->content_len &&
+         reference_char_at(l, l->cursor) != '\n') {
+    reference_chop_chars(l, 1);
+  }
+  if (l->cursor < l->content_len) {
+    reference_chop_chars(l, 1);
+  }
+}
+
+Token reference_lexer_next(Reference_Lexer *l) {
+  if (l->state == LEXER_STATE_NORMAL) {
+    reference_trim_left(l);
+  }
+  Token token = {
+      .offset = l->cursor,
+  };
+
+  if (l->cursor >= l->content_len)
+    return token;
+
+  if (l->state == LEXER_STATE_BLOCK_COMMENT) {
+    token.kind = TOKEN_BLOCK_COMMENT;
+    reference_chop_block_comment(l);
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  if (reference_char_at(l, l->cursor) == '"') {
+    token.kind = TOKEN_STRING;
+    reference_chop_chars(l, 1);
+    while (l->cursor < l->content_len &&
+           reference_char_at(l, l->cursor) != '"' &&
+           reference_char_at(l, l->cursor) != '\n') {
+      reference_chop_chars(l, 1);
+    }
+    if (l->cursor < l->content_len) {
+      reference_chop_chars(l, 1);
+    }
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  if (reference_char_at(l, l->cursor) == '#') {
+    token.kind = TOKEN_PREPROP;
+    reference_chop_line(l);
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  if (reference_starts_with(l, "//")) {
+    token.kind = TOKEN_SINGLE_COMMENT;
+    reference_chop_line(l);
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  if (reference_starts_with(l, "/*")) {
+    token.kind = TOKEN_BLOCK_COMMENT;
+    l->state = LEXER_STATE_BLOCK_COMMENT;
+    reference_chop_chars(l, 2);
+    reference_chop_block_comment(l);
+    token.text_len = l->cursor - token.offset;
+    return token;
+  }
+
+  for (size_t i = 0; i < reference_literals_count; ++i) {
+    if (reference_starts_with(l, reference_literals[i].text)) {
+      size_t text_len = strlen(reference_literals[i].text);
+      token.kind = reference_literals[i].kind;
+      token.text_len = text_len;
+      reference_chop_chars(l, text_len);
+      return token;
+    }
+  }
+
+  if (reference_is_symbol_start(reference_char_at(l, l->cursor))) {
+    token.kind = TOKEN_SYMBOL;
+    char text[KEYWORD_MAX_LEN];
+    while (l->cursor < l->content_len) {
+      char x = reference_char_at(l, l->cursor);
+      if (!reference_is_symbol(x))
+        break;
+      if (token.text_len < KEYWORD_MAX_LEN) {
+        text[token.text_len] = x;
+      }
+      reference_chop_chars(l, 1);
+      token.text_len += 1;
+    }
+    if (keyword_set_contains(l->keywords, text, token.text_len)) {
+      token.kind = TOKEN_KEYWORD;
+    }
+    return token;
+  }
+
+  uint8_t lead = (uint8_t)reference_char_at(l, l->cursor);
+  reference_chop_chars(l, 1);
+  if (lead >= 0xC0) {
+    for (size_t n = 1; n < 4 && l->cursor < l->content_len &&
+                       (reference_char_at(l, l->cursor) & 0xC0) == 0x80;
+         ++n) {
+      reference_chop_chars(l, 1);
+    }
+  }
+  token.kind = TOKEN_INVALID;
+  token.text_len = l->cursor - token.offset;
+
+  return token;
+}
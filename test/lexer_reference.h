@@ -0,0 +1,30 @@
+#ifndef __NIJI_LEXER_REFERENCE_H
+#define __NIJI_LEXER_REFERENCE_H
+
+#include "../src/lexer.h"
+
+// lexer_next as it was before it was driven by byte-class tables: one byte
+// at a time, trying each kind of token in turn. Slow and obviously right,
+// it is what the real lexer is checked against. Behaviour that was changed
+// on purpose since (keeping a UTF-8 sequence in one invalid token) is
+// carried over, so the two are expected to agree on everything.
+
+typedef struct {
+  const Keyword_Set *keywords;
+  const Piece_Table *content;
+  size_t content_len;
+  size_t cursor;
+  size_t line;
+  size_t bol;
+
+  Lexer_State state;
+  Lexer_States *line_states;
+} Reference_Lexer;
+
+Reference_Lexer reference_lexer_new(const Piece_Table *content,
+                                    const Keyword_Set *keywords);
+void reference_lexer_seek(Reference_Lexer *l, size_t row, size_t line_begin,
+                          Lexer_State state);
+Token reference_lexer_next(Reference_Lexer *l);
+
+#endif // __NIJI_LEXER_REFERENCE_H
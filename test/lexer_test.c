@@ -0,0 +1,287 @@
+// Lexes random documents with lexer_next and with the reference lexer and
+// fails on the first token, lexer state or line state they disagree on.
+// The documents are built from C-ish fragments and then cut into many
+// pieces, so that tokens and runs straddle piece boundaries.
+//
+// Every lexer_scan implementation the CPU supports is checked, first on its
+// own against the byte classes and then through the whole lexer.
+//
+// Usage: ./lexer_test [documents] [seed]
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/common.h"
+#include "../src/lexer.h"
+#include "../src/lexer_scan.h"
+#include "../src/piece_table.h"
+#include "lexer_reference.h"
+
+#define DOCUMENT_MAX_FRAGMENTS 400
+#define DOCUMENT_MAX_RESHUFFLES 16
+#define SCAN_RUNS 20000
+#define SCAN_MAX_LEN 200
+
+static uint32_t test_seed = 1;
+
+static uint32_t test_random(void) {
+  // xorshift32
+  uint32_t x = test_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  test_seed = x;
+  return x;
+}
+
+static size_t test_random_below(size_t n) {
+  return n > 0 ? test_random() % n : 0;
+}
+
+static const char *fragments[] = {
+    " ",       "  ",      "\t",       "\n",       "\r\n",     "\v\f",
+    "int",     "return",  "while",    "x",        "foo_bar1", "_",
+    "9",       "42abc",   "(",        ")",        "[",        "]",
+    "{",       "}",       ";",        ",",        "+",        "=",
+    "\"",      "\"str\"", "#",        "#include", "/",        "*",
+    "//",      "/*",      "*/",       "**/",      "/**/",     "\\",
+    "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\x80",  "\xc3",
+    "\xff",    "\0",      "alignas",  "xor_eq",   "@",
+};
+
+#define fragments_count (sizeof(fragments) / sizeof(fragments[0]))
+
+// Appends `n` bytes picked from `alphabet`, for runs long enough to take
+// the vector paths of the run kernels
+static void append_run(String_Builder *sb, const char *alphabet, size_t n) {
+  size_t alphabet_len = strlen(alphabet);
+  for (size_t i = 0; i < n; ++i) {
+    da_append(sb, alphabet[test_random_below(alphabet_len)]);
+  }
+}
+
+static void generate_document(String_Builder *sb) {
+  sb->count = 0;
+  size_t fragments_wanted = test_random_below(DOCUMENT_MAX_FRAGMENTS);
+  for (size_t i = 0; i < fragments_wanted; ++i) {
+    switch (test_random_below(16)) {
+    case 0:
+      append_run(sb, " \t\n", 1 + test_random_below(100));
+      break;
+    case 1:
+      append_run(sb, "abcxyzABCXYZ019_", 1 + test_random_below(80));
+      break;
+    case 2:
+      append_run(sb, "ab /\"*(\xc3", 1 + test_random_below(100));
+      break;
+    default: {
+      const char *f = fragments[test_random_below(fragments_count)];
+      // "\0" is the one fragment strlen gets wrong
+      size_t len = f[0] == '\0' ? 1 : strlen(f);
+      sb_append_buf(sb, f, len);
+    } break;
+    }
+  }
+}
+
+// Loads `text` and then deletes and re-inserts random spans of it, which
+// leaves the same text spread over many pieces
+static void load_in_pieces(Piece_Table *pt, const String_Builder *text,
+                           String_Builder *scratch) {
+  piece_table_load(pt, text->items, text->count);
+  size_t reshuffles = test_random_below(DOCUMENT_MAX_RESHUFFLES);
+  for (size_t i = 0; i < reshuffles && text->count > 0; ++i) {
+    size_t pos = test_random_below(text->count);
+    size_t len = 1 + test_random_below(text->count - pos);
+    piece_table_delete(pt, pos, len);
+
+    size_t done = 0;
+    while (done < len) {
+      size_t n = 1 + test_random_below(len - done);
+      piece_table_insert(pt, pos + done, text->items + pos + done, n);
+      done += n;
+    }
+  }
+
+  scratch->count = 0;
+  piece_table_read(pt, 0, piece_table_size(pt), scratch);
+  if (scratch->count != text->count ||
+      memcmp(scratch->items, text->items, text->count) != 0) {
+    fprintf(stderr, "ERROR: the piece table lost the document\n");
+    exit(1);
+  }
+}
+
+static bool in_class(Char_Class cls, uint8_t x) {
+  switch (cls) {
+  case CHAR_SPACE:
+    return x == ' ' || x == '\t' || x == '\n' || x == '\v' || x == '\f' ||
+           x == '\r';
+  case CHAR_SYMBOL:
+    return (x >= 'a' && x <= 'z') || (x >= 'A' && x <= 'Z') ||
+           (x >= '0' && x <= '9') || x == '_';
+  case CHAR_LINE:
+    return x != '\n';
+  case CHAR_STRING:
+    return x != '\n' && x != '"';
+  case CHAR_COMMENT:
+    return x != '\n' && x != '*';
+  default:
+    UNREACHABLE("in_class");
+  }
+  return false;
+}
+
+static uint8_t random_in_class(Char_Class cls) {
+  uint8_t x;
+  do {
+    x = (uint8_t)test_random();
+  } while (!in_class(cls, x));
+  return x;
+}
+
+// Runs of every class at every alignment, ending in a random byte, with
+// bytes of the class past the end to catch a kernel reading too far
+static bool check_scan(Lexer_Scan_Impl impl) {
+  static const Char_Class classes[] = {
+      CHAR_SPACE, CHAR_SYMBOL, CHAR_LINE, CHAR_STRING, CHAR_COMMENT,
+  };
+  static char buf[64 + SCAN_MAX_LEN + 64];
+
+  for (size_t run = 0; run < SCAN_RUNS; ++run) {
+    Char_Class cls = classes[test_random_below(5)];
+    size_t align = test_random_below(64);
+    size_t len = test_random_below(SCAN_MAX_LEN + 1);
+    size_t stop = test_random_below(len + 1);
+
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+      buf[i] = (char)random_in_class(cls);
+    }
+    for (size_t i = stop; i < len; ++i) {
+      buf[align + i] = (char)test_random();
+    }
+
+    size_t want = 0;
+    while (want < len && in_class(cls, (uint8_t)buf[align + want])) {
+      want += 1;
+    }
+    size_t got = lexer_scan(cls, buf + align, len);
+    if (got != want) {
+      fprintf(stderr,
+              "ERROR: %s: run of class %d, %zu bytes at alignment %zu: "
+              "scanned %zu bytes instead of %zu\n",
+              lexer_scan_impl_name(impl), cls, len, align, got, want);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void print_mismatch(size_t document, size_t index, Token want,
+                           Token got, const char *what) {
+  fprintf(stderr,
+          "ERROR: document %zu, token %zu: %s differs\n"
+          "  reference: %s at %zu, %zu bytes\n"
+          "  lexer:     %s at %zu, %zu bytes\n",
+          document, index, what, token_kind_name(want.kind), want.offset,
+          want.text_len, token_kind_name(got.kind), got.offset, got.text_len);
+}
+
+// Lexes the document from a random line in a random state and adds the
+// tokens it saw to `*tokens`. Returns false on a mismatch.
+static bool check_document(size_t document, const Piece_Table *pt,
+                           size_t *tokens) {
+  Lexer_States want_states = {0};
+  Lexer_States got_states = {0};
+
+  Lexer got = lexer_new(pt);
+  Reference_Lexer want = reference_lexer_new(pt, got.keywords);
+
+  size_t row = test_random_below(piece_table_lines_count(pt));
+  size_t line_begin = piece_table_line_begin(pt, row);
+  Lexer_State state = test_random_below(COUNT_LEXER_STATES);
+  lexer_seek(&got, row, line_begin, state);
+  reference_lexer_seek(&want, row, line_begin, state);
+  got.line_states = &got_states;
+  want.line_states = &want_states;
+
+  bool ok = true;
+  for (size_t index = 0;; ++index) {
+    Token w = reference_lexer_next(&want);
+    Token g = lexer_next(&got);
+    const char *what = NULL;
+    if (w.kind != g.kind) {
+      what = "kind";
+    } else if (w.offset != g.offset) {
+      what = "offset";
+    } else if (w.text_len != g.text_len) {
+      what = "length";
+    } else if (want.state != got.state) {
+      what = "lexer state";
+    } else if (want.line != got.line || want.bol != got.bol) {
+      what = "line";
+    } else if (want_states.count != got_states.count ||
+               (want_states.count > 0 &&
+                memcmp(want_states.items, got_states.items,
+                       want_states.count * sizeof(*want_states.items)) !=
+                    0)) {
+      what = "line states";
+    }
+    if (what != NULL) {
+      print_mismatch(document, index, w, g, what);
+      ok = false;
+      break;
+    }
+
+    if (w.kind == TOKEN_END)
+      break;
+    *tokens += 1;
+  }
+
+  free(want_states.items);
+  free(got_states.items);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  size_t documents = argc >= 2 ? (size_t)atol(argv[1]) : 20000;
+  test_seed = argc >= 3 ? (uint32_t)atol(argv[2]) : 1;
+  if (test_seed == 0)
+    test_seed = 1;
+
+  uint32_t seed = test_seed;
+
+  String_Builder text = {0};
+  String_Builder scratch = {0};
+  Piece_Table pt = {0};
+
+  for (Lexer_Scan_Impl impl = 0; impl < COUNT_LEXER_SCANS; ++impl) {
+    if (!lexer_scan_select(impl)) {
+      printf("lexer_test: %-6s: not supported\n",
+             lexer_scan_impl_name(impl));
+      continue;
+    }
+
+    // The same documents for every implementation
+    test_seed = seed;
+    if (!check_scan(impl))
+      return 1;
+
+    size_t tokens = 0;
+    for (size_t i = 0; i < documents; ++i) {
+      generate_document(&text);
+      load_in_pieces(&pt, &text, &scratch);
+      if (!check_document(i, &pt, &tokens)) {
+        fprintf(stderr, "ERROR: with the %s run kernels\n",
+                lexer_scan_impl_name(impl));
+        return 1;
+      }
+    }
+
+    printf("lexer_test: %-6s: %d runs, %zu documents, %zu tokens: OK\n",
+           lexer_scan_impl_name(impl), SCAN_RUNS, documents, tokens);
+  }
+  return 0;
+}